@@ -56,6 +56,12 @@ endif
 ifneq (,${PSM_PROFILE})
   BASECFLAGS += -DPSM_PROFILE
 endif
+ifeq (,${PSM_NO_MQ_HISTOGRAMS})
+  BASECFLAGS += -DPSM_MQ_HISTOGRAMS
+endif
+ifneq (,${PSM_MQ_TRACE})
+  BASECFLAGS += -DPSM_MQ_TRACE
+endif
 BASECFLAGS += -fpic -fPIC -funwind-tables -D_GNU_SOURCE
 
 ifeq (1,${PSM_USE_SYS_UUID})
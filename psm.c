@@ -255,6 +255,11 @@ __psm_init(int *major, int *minor)
 
     psmi_epid_init();
 
+    if (getenv("PSM_MQ_REPLAY")) {
+	_IPATH_INFO("Replaying MQ trace...\n");
+	psmi_mq_trace_replay(getenv("PSM_MQ_REPLAY"));
+    }
+
 update:
     *major = (int) psmi_verno_major;
     *minor = (int) psmi_verno_minor;
@@ -442,12 +447,17 @@ __psm_poll(psm_ep_t ep)
 	return err2;
     }
 
+    if (ep->mq != NULL)
+	psmi_mq_batch_poll(ep->mq);
+
     /* This is valid because..
      * PSM_OK & PSM_OK_NO_PROGRESS => PSM_OK
      * PSM_OK & PSM_OK => PSM_OK
      * PSM_OK_NO_PROGRESS & PSM_OK => PSM_OK
      * PSM_OK_NO_PROGRESS & PSM_OK_NO_PROGRESS => PSM_OK_NO_PROGRESS */
     PSMI_PUNLOCK();
+    if (ep->mq != NULL)
+	psmi_mq_run_callbacks(ep->mq);
     return (err1 & err2);
 }
 PSMI_API_DECL(psm_poll)
@@ -469,6 +479,9 @@ __psmi_poll_internal(psm_ep_t ep, int poll_amsh)
     err2 = ep->ptl_ips.ep_poll(ep->ptl_ips.ptl, 0); /* get into ips_do_work */
     if (err2 != PSM_OK_NO_PROGRESS) /* some error unrelated to polling */
 	err1 = err2;
+
+    if (ep->mq != NULL)
+	psmi_mq_batch_poll(ep->mq);
     return err1;
 }
 PSMI_API_DECL(psmi_poll_internal)
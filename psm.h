@@ -806,9 +806,54 @@ psm_epaddr_getctxt(psm_epaddr_t epaddr);
    * messages.
    *
    * component object: PSM Matched Queue (psm_mq_t).
-   * option value: Maximum amount of bytes to allocate for unexpected messages.
-   * Mesages that would cause memory allocation to exceed this amount will be
-   * dropped.
+   * option value: Maximum amount of bytes to allocate for unexpected messages,
+   * in megabytes (0 for no limit, the default).
+   * Unexpected eager messages that would cause memory allocation to exceed
+   * this amount are not dropped but pushed back to the sender, which
+   * retransmits them (ipath) or keeps them queued in the shared memory fifo
+   * (shm) until buffers are released or a matching receive is posted.
+   * Message ordering is preserved.  At least one unexpected message is
+   * always admitted, whatever its size.
+   */
+
+#define PSM_MQ_OPT_MATCH_SIMD       0x304
+  /* [uint32_t ] Set to non-zero to keep the tags of wildcard receives and
+   * unexpected messages in contiguous arrays and match them with SIMD
+   * instructions (AVX2 or SSE4.1, with a scalar fallback on other CPUs).
+   * Exact-tag receives are matched through a hash index either way.  When
+   * read, returns 0 if the backend is disabled or the instruction set in use
+   * (1 scalar, 2 SSE4.1, 3 AVX2).
+   *
+   * component object: PSM Matched Queue (psm_mq_t).
+   * option value: Non-zero to enable the SIMD matching backend.
+   */
+
+#define PSM_MQ_OPT_WAIT_SPIN_US     0x305
+  /* [uint32_t ] Microseconds that psm_mq_wait and the other blocking calls
+   * keep polling at full speed while nothing progresses (defaults to 1000).
+   * Past this budget they call sched_yield between polls for a while, and
+   * then sleep until a shared memory peer sends to this endpoint, another
+   * thread completes a request or a short timeout expires.  Any progress
+   * returns to spinning.  Messages from the network wake a sleeping wait
+   * through the receive thread if it runs, or at the next timeout.
+   *
+   * component object: PSM Matched Queue (psm_mq_t).
+   * option value: Spin budget in microseconds.
+   */
+
+#define PSM_MQ_OPT_AGG_MSG_SZ       0x306
+  /* [uint32_t ] Largest eager send, in bytes, that is packed together with
+   * other small sends to the same peer into a single message (defaults to 0,
+   * no aggregation, and is capped at 128).  Only plain sends are packed, and
+   * the ordering of all messages to a peer is kept.  A packed message leaves
+   * when its batch is full, when a larger or synchronous send goes to the
+   * same peer, when a blocking call starts waiting, when psm_mq_flush is
+   * called or once it has waited PSM_MQ_AGG_WINDOW_US microseconds in a call
+   * that makes progress.  Nonblocking sends that are packed complete
+   * immediately.
+   *
+   * component object: PSM Matched Queue (psm_mq_t).
+   * option value: Largest aggregated message in bytes.
    */
 
 
@@ -36,6 +36,9 @@
 #include <fcntl.h>
 #include <sched.h> // cpu_set
 #include <ctype.h> // isalpha
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "psm_user.h"
 #include "psm_mq_internal.h"
@@ -695,6 +698,7 @@ __psm_ep_open(psm_uuid_t const unique_job_key, struct psm_ep_open_opts const *op
 		(union psmi_envvar_val) PSMI_BLOCKUNTIL_POLLS_BEFORE_YIELD,
 		&yield_cnt);
     ep->yield_spin_cnt = yield_cnt.e_uint;
+    ep->doorbell = &ep->doorbell_local;
 
     ptl_sizes = 0;
     amsh_ptl = ips_ptl = self_ptl = NULL;
@@ -807,6 +811,25 @@ fail:
 }
 PSMI_API_DECL(psm_ep_open)
 
+/* The doorbell may be in the shared segment, so the futex can't be private */
+void
+psmi_doorbell_wake(struct psmi_doorbell *db)
+{
+    __sync_fetch_and_add(&db->seq, 1);
+    syscall(SYS_futex, &db->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Sleep until db is rung after seq was read, or for at most usecs */
+void
+psmi_doorbell_wait(struct psmi_doorbell *db, uint32_t seq, uint32_t usecs)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+    syscall(SYS_futex, &db->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+}
+
 psm_error_t
 __psm_ep_close(psm_ep_t ep, int mode, int64_t timeout_in)
 {
@@ -860,6 +883,9 @@ __psm_ep_close(psm_ep_t ep, int mode, int64_t timeout_in)
      * timeout.  There's no good way to do this until we change the PTL
      * interface to allow asynchronous finalization
      */
+    if (ep->mq != NULL)
+	psmi_mq_batch_fini(ep->mq, mode != PSM_EP_CLOSE_FORCE);
+
     if (psmi_ep_device_is_enabled(ep, PTL_DEVID_AMSH)) 
 	err = psmi_ptl_amsh.fini(ep->ptl_amsh.ptl, mode, timeout_in);
 
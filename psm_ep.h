@@ -87,6 +87,16 @@
 #define PSMI_MIN_EP_CLOSE_GRACE_INTERVAL (1 * SEC_ULL)
 #define PSMI_MAX_EP_CLOSE_GRACE_INTERVAL (10 * SEC_ULL)
 
+/* Blocking waits sleep on an endpoint doorbell once they have advertised
+ * themselves in sleepers.  Anything that can end such a wait rings it: shm
+ * peers queueing a packet and other threads completing requests.  The shm ptl
+ * keeps the doorbell in its shared block so that local peers can reach it.
+ */
+struct psmi_doorbell {
+    volatile uint32_t	seq;	    /**> futex word, bumped on each ring */
+    volatile uint32_t	sleepers;   /**> waiters that must be woken */
+};
+
 struct psm_ep {
     psm_epid_t		epid;	    /**> This endpoint's Endpoint ID */
     psm_epaddr_t	epaddr;	    /**> This ep's ep address */
@@ -113,6 +123,8 @@ struct psm_ep {
     psmi_context_t	context;
     char	*context_mylabel;
     uint32_t	yield_spin_cnt;
+    struct psmi_doorbell *doorbell; /**> where blocked waits sleep */
+    struct psmi_doorbell  doorbell_local; /**> doorbell when shm is off */
 
     /* Active Message handler table */
     void    **am_htable;
@@ -165,6 +177,7 @@ struct psm_epaddr {
     void           *usr_ep_ctxt;   /* User context associated with endpoint */
 
     STAILQ_HEAD(, psm_mq_req)	egrlong[PSMI_EGRLONG_FLOWS_MAX];
+    struct mq_batch *mqbatch;	   /* Aggregated tiny sends to this peer */
     //psm_mq_req_t    next_egrlong[PSMI_EGRLONG_FLOWS_MAX];
 
     /* PTLs have a few ways to initialize the ptl address */
@@ -205,4 +218,20 @@ struct psm_epaddr {
 	    PSMI_PROFILE_UNBLOCK();				\
 	} while(0)
 
+void psmi_doorbell_wake(struct psmi_doorbell *db);
+void psmi_doorbell_wait(struct psmi_doorbell *db, uint32_t seq, 
+			uint32_t usecs);
+
+/*
+ * Wake whoever sleeps on db.  Callers outside the endpoint lock (shm peers)
+ * must order their stores before the check on sleepers with ips_mb().
+ */
+PSMI_ALWAYS_INLINE(
+void
+psmi_doorbell_ring(struct psmi_doorbell *db))
+{
+    if_pf (db->sleepers)
+	psmi_doorbell_wake(db);
+}
+
 #endif /* _PSMI_EP_H */
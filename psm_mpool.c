@@ -166,6 +166,7 @@ psmi_mpool_create(size_t obj_size, uint32_t num_obj_per_chunk,
 	mp->mp_elm_size = hdr_size + mp->mp_obj_size;
 
 	mp->mp_elm_offset = hdr_size - sizeof(struct mpool_element);
+	psmi_assert_always(mp->mp_elm_offset >= sizeof(void *));
     } else {
 	hdr_size	= sizeof(struct mpool_element);
 	mp->mp_obj_size = PSMI_ALIGNUP(obj_size, 8);
@@ -359,7 +360,11 @@ psmi_mpool_destroy(mpool_t mp)
     size_t nbytes = mp->mp_num_obj * mp->mp_elm_size;
 
     for (i = 0; i < mp->mp_elm_vector_size; i++) {
-	if (mp->mp_elm_vector[i]) 
+	if (mp->mp_elm_vector[i] == NULL)
+	    continue;
+	if (mp->mp_flags & PSMI_MPOOL_ALIGN)
+	    psmi_free(*((void **) mp->mp_elm_vector[i]));
+	else
 	    psmi_free(mp->mp_elm_vector[i]);
     }
     psmi_free(mp->mp_elm_vector);
@@ -404,7 +409,9 @@ psmi_mpool_allocate_chunk(mpool_t mp)
 	return PSM_NO_MEMORY;
 
     chunk = psmi_malloc(PSMI_EP_NONE, mp->mp_memtype, 
-			num_to_allocate * mp->mp_elm_size);
+			num_to_allocate * mp->mp_elm_size +
+			((mp->mp_flags & PSMI_MPOOL_ALIGN) ?
+			 PSMI_MPOOL_ALIGNMENT : 0));
     if (chunk == NULL) {
 	fprintf(stderr,
 	    "Failed to allocate memory for memory pool chunk: %s\n",
@@ -412,6 +419,15 @@ psmi_mpool_allocate_chunk(mpool_t mp)
 	return PSM_NO_MEMORY;
     }
 
+    /* Aligned objects need an aligned chunk.  The padding ahead of the first
+     * element header keeps what has to be freed. */
+    if (mp->mp_flags & PSMI_MPOOL_ALIGN) {
+	void *base = chunk;
+	chunk = (void *) PSMI_ALIGNUP((uintptr_t) base + 1, 
+				      PSMI_MPOOL_ALIGNMENT);
+	*((void **) chunk) = base;
+    }
+
     for (i = 0; i < num_to_allocate; i++) {
 	elm = (struct mpool_element *)((uintptr_t)chunk +
 	    i * mp->mp_elm_size + mp->mp_elm_offset);
@@ -41,28 +41,50 @@
  */
 
 /*
- * ! @brief PSM exposed version to allow PTLs to match 
+ * Find the oldest unexpected message matching tag/tagsel.  If the selector
+ * covers the hashed tag bits, every candidate is on the tag's hash chain.  If
+ * it covers the order mask, every candidate is on the order class chain.
+ * Otherwise the whole arrival-ordered queue has to be walked.
  */
-
 static
 psm_mq_req_t 
-mq_req_match_with_tagsel(psm_mq_t mq, struct mqsq *q, uint64_t tag, 
-			 uint64_t tagsel, int remove)
+mq_req_match_with_tagsel(psm_mq_t mq, uint64_t tag, uint64_t tagsel, 
+			 int remove)
 {
-    psm_mq_req_t *curp;
     psm_mq_req_t cur;
-
-    for (curp = &q->first; (cur = *curp) != NULL; curp = &cur->next) {
-	if (!((tag ^ cur->tag) & tagsel)) { /* match! */
-	    if (remove) {
-		if ((*curp = cur->next) == NULL) /* fix tail */
-		    q->lastp = curp;
-		cur->next = NULL;
-	    }
-	    return cur;
+    uint64_t nsearch = 0;
+
+    if (mq_req_is_hashed(mq, tagsel)) {
+	cur = mq->unexpected_htab[mq_hash_tag(mq, tag)].first;
+	for (; cur != NULL; cur = cur->hnext) {
+	    nsearch++;
+	    if (!((tag ^ cur->tag) & tagsel)) /* match! */
+		break;
 	}
     }
-    return NULL;
+    else if (mq_req_is_ordered(mq, tagsel)) {
+	cur = mq->unexpected_otab[mq_order_class(mq, tag)].first;
+	for (; cur != NULL; cur = cur->onext) {
+	    nsearch++;
+	    if (!((tag ^ cur->tag) & tagsel)) /* match! */
+		break;
+	}
+    }
+    else if (mq->match_backend != MQ_MATCH_LIST)
+	cur = psmi_mq_soa_match(mq, &mq->unexpected_soa, tag, tagsel, &nsearch);
+    else {
+	for (cur = mq->unexpected_q.first; cur != NULL; cur = cur->next) {
+	    nsearch++;
+	    if (!((tag ^ cur->tag) & tagsel)) /* match! */
+		break;
+	}
+    }
+
+    mq->stats.rx_unexp_search_len += nsearch;
+    PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_UNEXP_SEARCH, nsearch);
+    if (cur != NULL && remove)
+	mq_unexpected_remove(mq, cur);
+    return cur;
 }
 
 #if 0
@@ -169,7 +191,8 @@ __psm_mq_iprobe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, psm_mq_status_t *sta
     PSMI_ASSERT_INITIALIZED();
 
     PSMI_PLOCK();
-    req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 0);
+    PSMI_MQ_TRACE(mq, MQ_TRACE_PROBE, 0, tag, tagsel, 0);
+    req = mq_req_match_with_tagsel(mq, tag, tagsel, 0);
 
     if (req != NULL) {
 	PSMI_PUNLOCK();
@@ -180,7 +203,7 @@ __psm_mq_iprobe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, psm_mq_status_t *sta
 
     psmi_poll_internal(mq->ep, 1);
     /* try again */
-    req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 0);
+    req = mq_req_match_with_tagsel(mq, tag, tagsel, 0);
 
     if (req != NULL) {
 	PSMI_PUNLOCK();
@@ -205,9 +228,16 @@ __psm_mq_cancel(psm_mq_req_t *ireq)
     if (req == NULL)
 	return PSM_MQ_NO_COMPLETIONS;
 
+    if_pf (req->type & MQE_TYPE_PERSISTENT) {
+	if (req->pers_active == NULL)
+	    return PSM_MQ_NO_COMPLETIONS;
+	return __psm_mq_cancel(&req->pers_active);
+    }
+
     /* Cancelling a send is a blocking operation, and expensive.
      * We only allow cancellation of rendezvous sends, consider the eager sends
-     * as always unsuccessfully cancelled.
+     * as always unsuccessfully cancelled.  A rendezvous send can be cancelled
+     * until a receive matches its RTS.
      */
     PSMI_PLOCK();
 
@@ -216,18 +246,37 @@ __psm_mq_cancel(psm_mq_req_t *ireq)
 	if (req->state == MQ_STATE_POSTED) {
 	    int rc;
 
-	    rc = mq_req_remove_single(mq, &mq->expected_q, req);
+	    if (mq_req_is_hashed(mq, req->tagsel))
+		rc = mq_req_remove_single(mq, 
+			&mq->expected_htab[mq_hash_tag(mq, req->tag)], req);
+	    else {
+		mq_expected_remove_wildcard(mq, req);
+		rc = 1;
+	    }
 	    psmi_assert_always(rc);
+	    mq->stats.rx_exp_qdepth--;
 	    req->state = MQ_STATE_COMPLETE;
-	    mq_qq_append(&mq->completed_q, req);
+	    mq_complete_append(mq, req);
 	    err = PSM_OK;
 	}
 	else 
 	    err = PSM_MQ_NO_COMPLETIONS;
     }
+    else if (req->state == MQ_STATE_COMPLETE || req->rts_peer == NULL ||
+	     req->rts_peer->ptlctl->mq_cancel == NULL)
+	err = PSM_MQ_NO_COMPLETIONS;
     else {
-	err = psmi_handle_error(mq->ep, PSM_PARAM_ERR,
-		"Cannot cancel send requests (req=%p)", req);
+	/* Rendezvous send, the receiver decides whether it has matched yet */
+	req->type |= MQE_TYPE_CANCELLING;
+	err = req->rts_peer->ptlctl->mq_cancel(req->rts_peer->ptl, req);
+	if (err == PSM_OK) {
+	    PSMI_BLOCKUNTIL(mq->ep, err, !(req->type & MQE_TYPE_CANCELLING));
+	    if (err <= PSM_OK_NO_PROGRESS)
+		err = (req->type & MQE_TYPE_CANCELLED) ? 
+		      PSM_OK : PSM_MQ_NO_COMPLETIONS;
+	}
+	else
+	    req->type &= ~MQE_TYPE_CANCELLING;
     }
 
     PSMI_PUNLOCK();
@@ -236,6 +285,117 @@ __psm_mq_cancel(psm_mq_req_t *ireq)
 }
 PSMI_API_DECL(psm_mq_cancel)
 
+static psm_error_t psmi_mq_wait_persistent(psm_mq_req_t req, 
+					    psm_mq_status_t *status, 
+					    int do_lock);
+
+void
+psmi_mq_wait_set_policy(psm_mq_t mq, uint32_t spin_us, uint32_t yield_us,
+			uint32_t block_us)
+{
+    mq->wait_spin_us = spin_us;
+    mq->wait_yield_us = yield_us;
+    mq->wait_block_us = block_us;
+    mq->wait_spin_cyc = nanosecs_to_cycles(1000ULL * spin_us);
+    mq->wait_yield_cyc = nanosecs_to_cycles(1000ULL * yield_us);
+}
+
+void
+psmi_mq_wait_begin(psm_mq_t mq, struct mq_waitstate *ws)
+{
+    /* Nothing more is coming for a while, don't hold back what we batched */
+    if_pf (mq->batch_pending != NULL && !mq->batch_flushing)
+	psmi_mq_batch_flush_all(mq);
+
+    ws->phase_start = get_cycles();
+    ws->idle_start = 0;
+    ws->phase = MQ_WAIT_SPIN;
+    ws->spin_cnt = 0;
+    ws->armed = 0;
+}
+
+/* Charge the time spent in the current phase and move to the next one */
+void
+psmi_mq_wait_phase(psm_mq_t mq, struct mq_waitstate *ws, uint32_t phase)
+{
+    uint64_t now = get_cycles();
+    uint64_t ns = cycles_to_nanosecs(now - ws->phase_start);
+
+    if (ws->phase == MQ_WAIT_SPIN)
+	mq->stats.wait_spin_ns += ns;
+    else if (ws->phase == MQ_WAIT_YIELD)
+	mq->stats.wait_yield_ns += ns;
+    else
+	mq->stats.wait_block_ns += ns;
+
+    if (ws->armed) {
+	__sync_fetch_and_sub(&mq->ep->doorbell->sleepers, 1);
+	ws->armed = 0;
+    }
+    ws->phase = phase;
+    ws->phase_start = now;
+}
+
+void
+psmi_mq_wait_end(psm_mq_t mq, struct mq_waitstate *ws)
+{
+    psmi_mq_wait_phase(mq, ws, MQ_WAIT_SPIN);
+}
+
+/* Called with the lock held each time a poll in a wait makes no progress */
+void
+psmi_mq_wait_idle(psm_mq_t mq, struct mq_waitstate *ws)
+{
+    struct psmi_doorbell *db;
+    uint64_t now = get_cycles();
+
+    if (ws->idle_start == 0)
+	ws->idle_start = now;
+
+    switch (ws->phase) {
+	case MQ_WAIT_SPIN:
+	    if (now - ws->idle_start < mq->wait_spin_cyc) {
+		if (++ws->spin_cnt == mq->ep->yield_spin_cnt) {
+		    ws->spin_cnt = 0;
+		    PSMI_PYIELD();
+		}
+		break;
+	    }
+	    psmi_mq_wait_phase(mq, ws, MQ_WAIT_YIELD);
+	    /* fall through */
+
+	case MQ_WAIT_YIELD:
+	    if (mq->wait_block_us == 0 || 
+		now - ws->idle_start < mq->wait_spin_cyc + mq->wait_yield_cyc) {
+		PSMI_PYIELD();
+		break;
+	    }
+	    psmi_mq_wait_phase(mq, ws, MQ_WAIT_BLOCK);
+	    /* fall through */
+
+	default:
+	    /* 
+	     * Announce ourselves before the next poll so that anything queued
+	     * after that poll rings the doorbell, then sleep.  The doorbell
+	     * can move when the shm segment is remapped, don't keep a pointer
+	     * across the unlock.
+	     */
+	    db = mq->ep->doorbell;
+	    if (!ws->armed) {
+		ws->armed = 1;
+		ws->db_seq = db->seq;
+		__sync_fetch_and_add(&db->sleepers, 1);
+		break;
+	    }
+	    PSMI_PUNLOCK();
+	    psmi_doorbell_wait(db, ws->db_seq, mq->wait_block_us);
+	    PSMI_PLOCK();
+	    mq->stats.wait_block_num++;
+	    ws->db_seq = mq->ep->doorbell->seq;
+	    break;
+    }
+}
+
 /* This is the only PSM function that blocks.
  * We handle it in a special manner since we don't know what the user's
  * execution environment is (threads, oversubscribing processes, etc).
@@ -251,6 +411,8 @@ psmi_mq_wait_inner(psm_mq_req_t *ireq, psm_mq_status_t *status, int do_lock))
     if (req == PSM_MQ_REQINVALID) {
 	return PSM_OK;
     }
+    if_pf (req->type & MQE_TYPE_PERSISTENT)
+	return psmi_mq_wait_persistent(req, status, do_lock);
 
     if (do_lock)
 	PSMI_PLOCK();
@@ -271,7 +433,7 @@ psmi_mq_wait_inner(psm_mq_req_t *ireq, psm_mq_status_t *status, int do_lock))
 	    return err;
 	}
 
-	PSMI_BLOCKUNTIL(mq->ep, err, req->state == MQ_STATE_COMPLETE);
+	PSMI_MQ_WAITUNTIL(mq, err, req->state == MQ_STATE_COMPLETE);
 
 	if (err > PSM_OK_NO_PROGRESS)
 	    goto fail_with_lock;
@@ -295,6 +457,22 @@ fail_with_lock:
     return err;
 }
 
+/* Waiting on an inactive persistent request returns immediately */
+static
+psm_error_t
+psmi_mq_wait_persistent(psm_mq_req_t req, psm_mq_status_t *status, 
+			int do_lock)
+{
+    psm_error_t err;
+
+    if (req->pers_active == NULL)
+	return PSM_OK;
+    err = psmi_mq_wait_inner(&req->pers_active, status, do_lock);
+    if (req->pers_active == PSM_MQ_REQINVALID)
+	req->state = MQ_STATE_COMPLETE;
+    return err;
+}
+
 psm_error_t __sendpath
 __psm_mq_wait(psm_mq_req_t *ireq, psm_mq_status_t *status)
 {
@@ -321,6 +499,15 @@ __psm_mq_test(psm_mq_req_t *ireq, psm_mq_status_t *status)
 	return PSM_OK;
     }
 
+    if_pf (req->type & MQE_TYPE_PERSISTENT) {
+	if (req->pers_active == NULL)
+	    return PSM_OK;
+	err = __psm_mq_test(&req->pers_active, status);
+	if (req->pers_active == PSM_MQ_REQINVALID)
+	    req->state = MQ_STATE_COMPLETE;
+	return err;
+    }
+
     if (req->state != MQ_STATE_COMPLETE) {
 	if (req->testwait_callback) {
 	    PSMI_PLOCK();
@@ -349,180 +536,1048 @@ __psm_mq_test(psm_mq_req_t *ireq, psm_mq_status_t *status)
 }
 PSMI_API_DECL(psm_mq_test)
 
-psm_error_t __sendpath
-__psm_mq_isend(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
-	     const void *buf, uint32_t len, void *context, psm_mq_req_t *req)
+/*
+ * Batch completion.  The array entry points below take the progress lock once
+ * for the whole array instead of once per request as psm_mq_test does.
+ * Entries that are PSM_MQ_REQINVALID are inactive and skipped.
+ */
+
+/* Request to act on: the started request of a persistent request, NULL if
+ * it is inactive */
+PSMI_ALWAYS_INLINE(
+psm_mq_req_t
+mq_req_active(psm_mq_req_t req))
 {
-    psm_error_t err;
+    return (req->type & MQE_TYPE_PERSISTENT) ? req->pers_active : req;
+}
 
-    PSMI_ASSERT_INITIALIZED();
+/* Retire a request if it is complete, called with the lock held */
+PSMI_ALWAYS_INLINE(
+psm_error_t
+psmi_mq_harvest_one(psm_mq_req_t *ireq, psm_mq_status_t *status))
+{
+    psm_mq_req_t req = *ireq;
 
-    PSMI_PLOCK();
-    err = dest->ptlctl->mq_isend(dest->ptl, mq, dest, flags, stag, buf, len, context, req);
-    PSMI_PUNLOCK();
+    if (req->state != MQ_STATE_COMPLETE) {
+	if (req->testwait_callback)
+	    return req->testwait_callback(ireq, 1, status);
+	else
+	    return PSM_MQ_NO_COMPLETIONS;
+    }
 
-#if 0
-#ifdef PSM_VALGRIND
-    /* If the send isn't completed yet, make sure that we mark the memory as
-     * unaccessible 
-     */
-    if (*req != PSM_MQ_REQINVALID && 
-	(*req)->state != MQ_STATE_COMPLETE)
-	VALGRIND_MAKE_MEM_NOACCESS(buf, len);
-#endif
-#endif
-    psmi_assert(*req != NULL);
+    mq_qq_remove(&req->mq->completed_q, req);
+    if (status != NULL)
+	mq_status_copy(req, status);
+    psmi_mq_req_free(req);
+    *ireq = PSM_MQ_REQINVALID;
+
+    _IPATH_VDBG("req=%p complete, tag=%llx buf=%p, len=%d, err=%d\n", 
+	req, (unsigned long long) req->tag, req->buf, 
+	req->buf_len, req->error_code);
+    return PSM_OK;
+}
+
+PSMI_ALWAYS_INLINE(
+psm_error_t
+psmi_mq_harvest(psm_mq_req_t *ireq, psm_mq_status_t *status))
+{
+    psm_mq_req_t req = *ireq;
+    psm_error_t err;
+
+    if_pt (!(req->type & MQE_TYPE_PERSISTENT))
+	return psmi_mq_harvest_one(ireq, status);
+
+    err = psmi_mq_harvest_one(&req->pers_active, status);
+    if (req->pers_active == PSM_MQ_REQINVALID)
+	req->state = MQ_STATE_COMPLETE;
     return err;
 }
-PSMI_API_DECL(psm_mq_isend)
+
+/* Index of the first request that psmi_mq_harvest can retire, or -1 */
+PSMI_ALWAYS_INLINE(
+int
+psmi_mq_first_ready(psm_mq_req_t *reqs, int count))
+{
+    psm_mq_req_t req;
+    int i;
+    for (i = 0; i < count; i++) {
+	if (reqs[i] == PSM_MQ_REQINVALID || 
+	    (req = mq_req_active(reqs[i])) == NULL)
+	    continue;
+	if (req->state == MQ_STATE_COMPLETE || req->testwait_callback != NULL)
+	    return i;
+    }
+    return -1;
+}
+
+/* Endpoint to make progress on, taken from the first active request */
+PSMI_ALWAYS_INLINE(
+psm_ep_t
+psmi_mq_reqs_ep(psm_mq_req_t *reqs, int count))
+{
+    int i;
+    for (i = 0; i < count; i++)
+	if (reqs[i] != PSM_MQ_REQINVALID && mq_req_active(reqs[i]) != NULL)
+	    return reqs[i]->mq->ep;
+    return NULL;
+}
 
 psm_error_t __sendpath
-__psm_mq_send(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
-	    const void *buf, uint32_t len)
+__psm_mq_testsome(psm_mq_req_t *reqs, int count, int *outcount, 
+		  int *indices, psm_mq_status_t *statuses)
 {
-    psm_error_t err;
+    psm_error_t err = PSM_OK;
+    psm_ep_t ep;
+    int i, n = 0;
 
     PSMI_ASSERT_INITIALIZED();
 
     PSMI_PLOCK();
-    err =  dest->ptlctl->mq_send(dest->ptl, mq, dest, flags, stag, buf, len);
+    ep = psmi_mq_reqs_ep(reqs, count);
+    if (ep == NULL) 
+	goto done;
+
+    err = psmi_poll_internal(ep, 1);
+    if (err > PSM_OK_NO_PROGRESS)
+	goto done;
+
+    for (i = 0; i < count; i++) {
+	if (reqs[i] == PSM_MQ_REQINVALID || mq_req_active(reqs[i]) == NULL)
+	    continue;
+	err = psmi_mq_harvest(&reqs[i], statuses != NULL ? &statuses[n] : NULL);
+	if (err == PSM_OK)
+	    indices[n++] = i;
+	else if (err != PSM_MQ_NO_COMPLETIONS)
+	    goto done;
+    }
+    err = PSM_OK;
+
+done:
     PSMI_PUNLOCK();
+    *outcount = n;
+    if (err == PSM_OK && n == 0)
+	err = PSM_MQ_NO_COMPLETIONS;
     return err;
 }
-PSMI_API_DECL(psm_mq_send)
+PSMI_API_DECL(psm_mq_testsome)
 
-psm_error_t __recvpath
-__psm_mq_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags, 
-	      void *buf, uint32_t len, void *context, psm_mq_req_t *reqo)
+psm_error_t __sendpath
+__psm_mq_waitany(psm_mq_req_t *reqs, int count, int *index, 
+		 psm_mq_status_t *status)
 {
     psm_error_t err = PSM_OK;
-    psm_mq_req_t req;
+    psm_ep_t ep;
+    int i = -1;
 
     PSMI_ASSERT_INITIALIZED();
 
     PSMI_PLOCK();
+    ep = psmi_mq_reqs_ep(reqs, count);
+    if (ep == NULL)
+	goto done;
 
-    /* First check unexpected Queue and remove req if found */
-    req = mq_req_match_with_tagsel(mq, &mq->unexpected_q, tag, tagsel, 1);
+    PSMI_MQ_WAITUNTIL(ep->mq, err, 
+		      (i = psmi_mq_first_ready(reqs, count)) >= 0);
+    if (err > PSM_OK_NO_PROGRESS)
+	goto done;
 
-    if (req == NULL) 
-    {
-	/* prepost before arrival, add to expected q */
-	req = psmi_mq_req_alloc(mq, MQE_TYPE_RECV);
-	if_pf (req == NULL) {
-	    err = PSM_NO_MEMORY;
-	    goto ret;
-	}
+    err = psmi_mq_harvest(&reqs[i], status);
 
-	req->tag = tag;
-	req->tagsel = tagsel;
-	req->state = MQ_STATE_POSTED;
-	req->buf = buf;
-	req->buf_len = len;
-	req->recv_msglen = len;
-	req->recv_msgoff = 0;
-	req->context = context;
+done:
+    PSMI_PUNLOCK();
+    *index = i;
+    return err;
+}
+PSMI_API_DECL(psm_mq_waitany)
 
-	/* Nobody should touch the buffer after it's posted */
-	VALGRIND_MAKE_MEM_NOACCESS(buf, len);
+psm_error_t __sendpath
+__psm_mq_waitall(psm_mq_req_t *reqs, int count, psm_mq_status_t *statuses)
+{
+    psm_error_t err = PSM_OK;
+    int i;
 
-	mq_sq_append(&mq->expected_q, req);
-	_IPATH_VDBG("buf=%p,len=%d,tag=%"PRIx64
-		    " tagsel=%"PRIx64" req=%p\n", 
-		    buf,len,tag, tagsel, req);
-    }
-    else {
-	uint32_t copysz;
-	req->context = context;
+    PSMI_ASSERT_INITIALIZED();
 
-	psmi_assert(MQE_TYPE_IS_RECV(req->type));
-	_IPATH_VDBG("unexpected buf=%p,len=%d,tag=%"PRIx64 
-		    " tagsel=%"PRIx64" req=%p\n", buf, len, tag, tagsel, req);
+    PSMI_PLOCK();
+    for (i = 0; err == PSM_OK && i < count; i++)
+	err = psmi_mq_wait_inner(&reqs[i], 
+				 statuses != NULL ? &statuses[i] : NULL, 0);
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_waitall)
 
-	switch (req->state) {
-	  case MQ_STATE_COMPLETE:
-	    if (req->buf != NULL) { /* 0-byte messages don't alloc a sysbuf */
-		copysz = mq_set_msglen(req, len, req->send_msglen);
-		psmi_mq_mtucpy(buf, (const void *) req->buf, copysz);
-		psmi_mq_sysbuf_free(mq, req->buf);
-	    }
-	    req->buf = buf;
-	    req->buf_len = len;
-	    mq_qq_append(&mq->completed_q, req);
-	    break;
+/*
+ * Completion callbacks.  Requests posted with PSM_MQ_FLAG_CALLBACK complete
+ * onto callback_q instead of completed_q.  They are detached from it under the
+ * lock but their callbacks run without it, so that callbacks can post new
+ * requests or make progress.  While no callback is registered, completed
+ * requests stay on callback_q until one is.
+ */
+psm_mq_completion_fn_t
+__psm_mq_register_completion_callback(psm_mq_t mq, psm_mq_completion_fn_t fn)
+{
+    psm_mq_completion_fn_t old_fn;
 
-	  case MQ_STATE_UNEXP: /* not done yet */
-	    copysz = mq_set_msglen(req, len, req->send_msglen);
-	    /* Copy What's been received so far and make sure we don't receive
-	     * any more than copysz.  After that, swap system with user buffer
-	     */
-	    req->recv_msgoff = min(req->recv_msgoff, copysz);
-	    psmi_mq_mtucpy(buf, (const void *) req->buf, req->recv_msgoff);
-	    /* What's "left" is no access */
-	    VALGRIND_MAKE_MEM_NOACCESS(
-		(void *)((uintptr_t) buf + req->recv_msgoff), len - req->recv_msgoff);
-	    psmi_mq_sysbuf_free(mq, req->buf);
-	    req->state = MQ_STATE_MATCHED;
-	    req->buf = buf;
-	    req->buf_len = len;
-	    break;
+    PSMI_PLOCK();
+    old_fn = mq->completion_fn;
+    mq->completion_fn = fn;
+    PSMI_PUNLOCK();
+    return old_fn;
+}
+PSMI_API_DECL(psm_mq_register_completion_callback)
 
-	  case MQ_STATE_UNEXP_RV: /* rendez-vous ... */
-	    copysz = mq_set_msglen(req, len, req->send_msglen);
-	    req->state = MQ_STATE_MATCHED;
-	    req->buf = buf;
-	    req->buf_len = len;
-	    VALGRIND_MAKE_MEM_NOACCESS(buf, len);
-	    req->recv_msgoff = 0;
-	    req->rts_callback(req, 0);
-	    break;
+void
+psmi_mq_run_callbacks(psm_mq_t mq)
+{
+    psm_mq_req_t req, next;
+    psm_mq_status_t status;
+    psm_mq_completion_fn_t fn;
 
-	  default:
-	    fprintf(stderr, "Unexpected state %d in req %p\n", req->state, req);
-	    fprintf(stderr, "type=%d, mq=%p, tag=%p\n",
-			    req->type, req->mq, (void *)(uintptr_t)req->tag);
-	    abort();
-	}
+    /* Peek without the lock so that polls with nothing to call back stay
+     * cheap.  A stale NULL only leaves the callbacks to the next poll, and
+     * the queue is looked at again under the lock before it is taken. */
+    if (*((psm_mq_req_t volatile *) &mq->callback_q.first) == NULL)
+	return;
+
+    PSMI_PLOCK();
+    fn = mq->completion_fn;
+    if (fn == NULL || mq->callback_q.first == NULL) {
+	PSMI_PUNLOCK();
+	return;
+    }
+    req = mq->callback_q.first;
+    mq->callback_q.first = NULL;
+    mq->callback_q.lastp = &mq->callback_q.first;
+    PSMI_PUNLOCK();
+
+    for (next = req; next != NULL; next = next->next) {
+	mq_status_copy(next, &status);
+	fn(mq, &status);
     }
 
-ret:
+    PSMI_PLOCK();
+    for (; req != NULL; req = next) {
+	next = req->next;
+	psmi_mq_req_free(req);
+    }
     PSMI_PUNLOCK();
-    *reqo = req;
-    return PSM_OK;
 }
-PSMI_API_DECL(psm_mq_irecv)
 
-psm_error_t __sendpath
-__psm_mq_ipeek(psm_mq_t mq, psm_mq_req_t *oreq, psm_mq_status_t *status)
+/* Send requests can complete before the ptl returns them */
+static
+void
+mq_req_set_callback(psm_mq_t mq, psm_mq_req_t req)
 {
-    psm_mq_req_t req;
+    req->type |= MQE_TYPE_CALLBACK;
+    if (req->state == MQ_STATE_COMPLETE && req->testwait_callback == NULL) {
+	mq_qq_remove(&mq->completed_q, req);
+	mq_qq_append(&mq->callback_q, req);
+    }
+}
 
-    PSMI_ASSERT_INITIALIZED();
+/*
+ * Aggregated tiny sends
+ */
+int
+psmi_mq_batch_add(psm_mq_t mq, psm_epaddr_t dest, uint64_t tag, 
+		  const void *buf, uint32_t len)
+{
+    struct mq_batch *b = dest->mqbatch;
+    struct mq_batch_rec *rec;
+
+    if_pf (b == NULL) {
+	if (dest->ptlctl->mq_send_batch == NULL)
+	    return 0;
+	b = (struct mq_batch *) 
+	    psmi_malloc(mq->ep, UNDEFINED, sizeof(struct mq_batch));
+	if (b == NULL)
+	    return 0;
+	b->epaddr = dest;
+	b->len = b->cnt = 0;
+	b->next_all = mq->batches;
+	mq->batches = b;
+	dest->mqbatch = b;
+    }
 
-    if ((req = mq->completed_q.first) == NULL) {
-	PSMI_PLOCK();
-	psmi_poll_internal(mq->ep, 1);
-	if ((req = mq->completed_q.first) == NULL) {
-	    PSMI_PUNLOCK();
-	    return PSM_MQ_NO_COMPLETIONS;
-	}
-	PSMI_PUNLOCK();
+    if (b->len + MQ_BATCH_RECLEN(len) > MQ_BATCH_BYTES) {
+	psmi_mq_batch_flush(mq, b);
+	/* Records that couldn't go out stay first, send this one apart */
+	if_pf (b->len + MQ_BATCH_RECLEN(len) > MQ_BATCH_BYTES)
+	    return 0;
     }
-    /* something in the queue */
-    *oreq = req;
-    if (status != NULL)
-	mq_status_copy(req, status);
 
-    return PSM_OK;
+    if (b->len == 0) {
+	b->t_first = get_cycles();
+	b->next = mq->batch_pending;
+	if (b->next != NULL)
+	    b->next->pprev = &b->next;
+	b->pprev = &mq->batch_pending;
+	mq->batch_pending = b;
+    }
+
+    rec = (struct mq_batch_rec *) &b->buf[b->len];
+    rec->tag = tag;
+    rec->len = len;
+    rec->_pad = 0;
+    if (len)
+	psmi_mq_mtucpy(rec + 1, buf, len);
+    b->len += MQ_BATCH_RECLEN(len);
+    b->cnt++;
+
+    mq->stats.tx_num++;
+    mq->stats.tx_eager_num++;
+    mq->stats.tx_eager_bytes += len;
+    return 1;
 }
-PSMI_API_DECL(psm_mq_ipeek)
 
-static
 psm_error_t
-psmi_mqopt_ctl(psm_mq_t mq, uint32_t key, void *value, int get)
+psmi_mq_batch_flush(psm_mq_t mq, struct mq_batch *b)
 {
-    psm_error_t err = PSM_OK;
-    uint32_t val32;
+    psm_epaddr_t dest = b->epaddr;
+    psm_error_t err;
+    uint32_t nsent = 0, off;
+
+    /* Sending can poll, which must not flush this batch again */
+    if (b->next != NULL)
+	b->next->pprev = b->pprev;
+    *(b->pprev) = b->next;
+    mq->batch_flushing++;
+
+    _IPATH_VDBG("to=%s msgs=%d len=%d\n", 
+		psmi_epaddr_get_name(dest->epid), b->cnt, b->len);
+    err = dest->ptlctl->mq_send_batch(dest->ptl, dest, b->buf, b->len, 
+				      &nsent);
+    if_pf (err != PSM_OK && nsent < b->len) {
+	/* Keep the records that weren't sent pending, in order, so that the
+	 * next flush retries them before anything else goes to dest */
+	b->len -= nsent;
+	memmove(b->buf, b->buf + nsent, b->len);
+	for (b->cnt = 0, off = 0; off < b->len; b->cnt++)
+	    off += MQ_BATCH_RECLEN(
+		((struct mq_batch_rec *) &b->buf[off])->len);
+	b->next = mq->batch_pending;
+	if (b->next != NULL)
+	    b->next->pprev = &b->next;
+	b->pprev = &mq->batch_pending;
+	mq->batch_pending = b;
+	_IPATH_VDBG("to=%s kept msgs=%d len=%d, err=%d\n", 
+		    psmi_epaddr_get_name(dest->epid), b->cnt, b->len, err);
+    }
+    else
+	b->len = b->cnt = 0;
+
+    mq->batch_flushing--;
+    return err;
+}
+
+/* Each pending batch is flushed once, those that fail stay pending */
+psm_error_t
+psmi_mq_batch_flush_all(psm_mq_t mq)
+{
+    struct mq_batch *b, *next;
+    psm_error_t err, ret = PSM_OK;
+
+    for (b = mq->batch_pending; b != NULL; b = next) {
+	next = b->next;
+	err = psmi_mq_batch_flush(mq, b);
+	if (err != PSM_OK && ret == PSM_OK)
+	    ret = err;
+    }
+    return ret;
+}
+
+/* Called by the progress engine while batches are pending */
+void
+psmi_mq_batch_poll(psm_mq_t mq)
+{
+    struct mq_batch *b, *next;
+    uint64_t now;
+
+    if_pf (mq->batch_pending == NULL || mq->batch_flushing)
+	return;
+
+    now = get_cycles();
+    for (b = mq->batch_pending; b != NULL; b = next) {
+	next = b->next;
+	if (now - b->t_first >= mq->batch_window_cyc)
+	    psmi_mq_batch_flush(mq, b);
+    }
+}
+
+void
+psmi_mq_batch_fini(psm_mq_t mq, int flush)
+{
+    struct mq_batch *b;
+
+    if (flush)
+	psmi_mq_batch_flush_all(mq);
+    mq->batch_pending = NULL;
+    while ((b = mq->batches) != NULL) {
+	mq->batches = b->next_all;
+	b->epaddr->mqbatch = NULL;
+	psmi_free(b);
+    }
+}
+
+/* Aggregated sends are done as soon as they are packed */
+static
+psm_error_t
+mq_batch_isend_req(psm_mq_t mq, uint64_t tag, uint32_t len, void *context,
+		   psm_mq_req_t *req_o)
+{
+    psm_mq_req_t req = psmi_mq_req_alloc(mq, MQE_TYPE_SEND);
+    if_pf (req == NULL)
+	return PSM_NO_MEMORY;
+
+    req->tag = tag;
+    req->send_msglen = len;
+    req->context = context;
+    req->state = MQ_STATE_COMPLETE;
+    mq_complete_append(mq, req);
+    *req_o = req;
+    return PSM_OK;
+}
+
+psm_error_t
+__psm_mq_flush(psm_mq_t mq)
+{
+    psm_error_t err;
+
+    PSMI_ERR_UNLESS_INITIALIZED(mq->ep);
+
+    PSMI_PLOCK();
+    err = psmi_mq_batch_flush_all(mq);
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_flush)
+
+psm_error_t __sendpath
+__psm_mq_isend(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
+	     const void *buf, uint32_t len, void *context, psm_mq_req_t *req)
+{
+    psm_error_t err;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && mq->completion_fn == NULL)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"No MQ completion callback registered");
+
+    PSMI_PLOCK();
+    PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_TX_SIZE, len);
+    if_pf (mq->batch_msg_max) {
+	if (!(flags & ~PSM_MQ_FLAG_CALLBACK) && len <= mq->batch_msg_max &&
+	    psmi_mq_batch_add(mq, dest, stag, buf, len)) {
+	    err = mq_batch_isend_req(mq, stag, len, context, req);
+	    goto done;
+	}
+    }
+    if_pf ((err = psmi_mq_batch_flush_dest(mq, dest)) != PSM_OK)
+	goto done;
+    err = dest->ptlctl->mq_isend(dest->ptl, mq, dest, 
+				 flags & ~PSM_MQ_FLAG_CALLBACK, stag, buf, len, 
+				 context, req);
+done:
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && err == PSM_OK)
+	mq_req_set_callback(mq, *req);
+    PSMI_PUNLOCK();
+
+#if 0
+#ifdef PSM_VALGRIND
+    /* If the send isn't completed yet, make sure that we mark the memory as
+     * unaccessible 
+     */
+    if (*req != PSM_MQ_REQINVALID && 
+	(*req)->state != MQ_STATE_COMPLETE)
+	VALGRIND_MAKE_MEM_NOACCESS(buf, len);
+#endif
+#endif
+    psmi_assert(*req != NULL);
+    return err;
+}
+PSMI_API_DECL(psm_mq_isend)
+
+/* Total length of an iovec list, or -1 if it doesn't fit a message */
+static
+int64_t
+mq_iov_length(const struct iovec *iov, uint32_t iovcnt)
+{
+    uint64_t len = 0;
+    uint32_t i;
+
+    for (i = 0; i < iovcnt; i++) {
+	len += iov[i].iov_len;
+	if (len > UINT32_MAX)
+	    return -1;
+    }
+    return (int64_t) len;
+}
+
+psm_error_t __sendpath
+__psm_mq_isendv(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
+		const struct iovec *iov, uint32_t iovcnt, void *context, 
+		psm_mq_req_t *req)
+{
+    psm_error_t err;
+    int64_t len;
+    void *buf;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    len = mq_iov_length(iov, iovcnt);
+    if_pf (len < 0)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"iovec message is larger than %u bytes", UINT32_MAX);
+    if (iovcnt <= 1 || len == 0)
+	return __psm_mq_isend(mq, dest, flags, stag, 
+			      iovcnt ? iov[0].iov_base : NULL, (uint32_t) len, 
+			      context, req);
+
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && mq->completion_fn == NULL)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"No MQ completion callback registered");
+
+    PSMI_PLOCK();
+    PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_TX_SIZE, len);
+    if_pf ((err = psmi_mq_batch_flush_dest(mq, dest)) != PSM_OK) {
+	PSMI_PUNLOCK();
+	return err;
+    }
+    if (dest->ptlctl->mq_isendv != NULL)
+	err = dest->ptlctl->mq_isendv(dest->ptl, mq, dest,
+				      flags & ~PSM_MQ_FLAG_CALLBACK, stag, 
+				      iov, iovcnt, (uint32_t) len, context, req);
+    else {
+	/* PTL only takes contiguous buffers, send from a staged copy */
+	buf = psmi_mq_iov_stage(mq, iov, iovcnt, (uint32_t) len);
+	err = dest->ptlctl->mq_isend(dest->ptl, mq, dest, 
+				     flags & ~PSM_MQ_FLAG_CALLBACK, stag, 
+				     buf, (uint32_t) len, context, req);
+	if (err == PSM_OK)
+	    mq_req_set_stage(mq, *req, buf);
+	else
+	    psmi_free(buf);
+    }
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && err == PSM_OK)
+	mq_req_set_callback(mq, *req);
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_isendv)
+
+psm_error_t __sendpath
+__psm_mq_send(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
+	    const void *buf, uint32_t len)
+{
+    psm_error_t err;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    PSMI_PLOCK();
+    PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_TX_SIZE, len);
+    if_pf (mq->batch_msg_max) {
+	if (!flags && len <= mq->batch_msg_max &&
+	    psmi_mq_batch_add(mq, dest, stag, buf, len)) {
+	    PSMI_PUNLOCK();
+	    return PSM_OK;
+	}
+    }
+    if_pf ((err = psmi_mq_batch_flush_dest(mq, dest)) != PSM_OK) {
+	PSMI_PUNLOCK();
+	return err;
+    }
+    err =  dest->ptlctl->mq_send(dest->ptl, mq, dest, flags, stag, buf, len);
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_send)
+
+/*
+ * Bind a user buffer to an unexpected request that has just been dequeued
+ * from the unexpected queue, whatever stage the message has reached.  For
+ * iovec receives, buf is NULL and the request already carries the iovecs.
+ */
+PSMI_ALWAYS_INLINE(
+void
+mq_req_recv_unexpected(psm_mq_t mq, psm_mq_req_t req, void *buf, uint32_t len,
+		       void *context))
+{
+    uint32_t copysz;
+    req->context = context;
+    PSMI_MQ_HIST_POSTED(req);
+
+    switch (req->state) {
+      case MQ_STATE_COMPLETE:
+	if (req->buf != NULL) { /* 0-byte messages don't alloc a sysbuf */
+	    copysz = mq_set_msglen(req, len, req->send_msglen);
+	    if_pf (req->type & MQE_TYPE_IOV)
+		psmi_mq_iov_scatter(req->iov, req->iovcnt, 0, 
+				    req->buf, copysz);
+	    else
+		psmi_mq_mtucpy(buf, (const void *) req->buf, copysz);
+	    psmi_mq_sysbuf_free(mq, req->buf);
+	}
+	req->buf = buf;
+	req->buf_len = len;
+	mq_complete_append(mq, req);
+	break;
+
+      case MQ_STATE_UNEXP: /* not done yet */
+	copysz = mq_set_msglen(req, len, req->send_msglen);
+	/* Copy What's been received so far and make sure we don't receive
+	 * any more than copysz.  After that, swap system with user buffer
+	 */
+	req->recv_msgoff = min(req->recv_msgoff, copysz);
+	if_pf (req->type & MQE_TYPE_IOV)
+	    psmi_mq_iov_scatter(req->iov, req->iovcnt, 0, req->buf, 
+				req->recv_msgoff);
+	else {
+	    psmi_mq_mtucpy(buf, (const void *) req->buf, req->recv_msgoff);
+	    /* What's "left" is no access */
+	    VALGRIND_MAKE_MEM_NOACCESS(
+		(void *)((uintptr_t) buf + req->recv_msgoff), 
+		len - req->recv_msgoff);
+	}
+	psmi_mq_sysbuf_free(mq, req->buf);
+	req->state = MQ_STATE_MATCHED;
+	req->buf = buf;
+	req->buf_len = len;
+	break;
+
+      case MQ_STATE_UNEXP_RV: /* rendez-vous ... */
+	copysz = mq_set_msglen(req, len, req->send_msglen);
+	if_pf (req->type & MQE_TYPE_IOV) /* transports want one buffer */
+	    buf = psmi_mq_iov_stage_recv(mq, req, copysz);
+	req->state = MQ_STATE_MATCHED;
+	req->buf = buf;
+	req->buf_len = len;
+	VALGRIND_MAKE_MEM_NOACCESS(buf, len);
+	req->recv_msgoff = 0;
+	req->rts_callback(req, 0);
+	break;
+
+      default:
+	fprintf(stderr, "Unexpected state %d in req %p\n", req->state, req);
+	fprintf(stderr, "type=%d, mq=%p, tag=%p\n",
+			req->type, req->mq, (void *)(uintptr_t)req->tag);
+	abort();
+    }
+}
+
+/* Post a receive, called with the lock held.  Returns NULL if out of
+ * requests. */
+static __recvpath
+psm_mq_req_t
+mq_irecv_inner(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags, 
+	       void *buf, uint32_t len, const struct iovec *iov, 
+	       uint32_t iovcnt, void *context)
+{
+    psm_mq_req_t req;
+
+    PSMI_MQ_TRACE(mq, MQ_TRACE_POST, 0, tag, tagsel, len);
+
+    /* First check unexpected Queue and remove req if found */
+    req = mq_req_match_with_tagsel(mq, tag, tagsel, 1);
+
+    if (req == NULL) 
+    {
+	/* prepost before arrival, add to expected q */
+	req = psmi_mq_req_alloc(mq, MQE_TYPE_RECV);
+	if_pf (req == NULL)
+	    return NULL;
+
+	req->tag = tag;
+	req->tagsel = tagsel;
+	req->state = MQ_STATE_POSTED;
+	req->buf = buf;
+	req->buf_len = len;
+	req->recv_msglen = len;
+	req->recv_msgoff = 0;
+	req->context = context;
+	PSMI_MQ_HIST_POSTED(req);
+	if_pf (flags & PSM_MQ_FLAG_CALLBACK)
+	    req->type |= MQE_TYPE_CALLBACK;
+	if_pf (iov != NULL) {
+	    req->type |= MQE_TYPE_IOV;
+	    req->iov = iov;
+	    req->iovcnt = iovcnt;
+	}
+	else /* Nobody should touch the buffer after it's posted */
+	    VALGRIND_MAKE_MEM_NOACCESS(buf, len);
+
+	mq_expected_append(mq, req);
+	_IPATH_VDBG("buf=%p,len=%d,tag=%"PRIx64
+		    " tagsel=%"PRIx64" req=%p\n", 
+		    buf,len,tag, tagsel, req);
+    }
+    else {
+	psmi_assert(MQE_TYPE_IS_RECV(req->type));
+	_IPATH_VDBG("unexpected buf=%p,len=%d,tag=%"PRIx64 
+		    " tagsel=%"PRIx64" req=%p\n", buf, len, tag, tagsel, req);
+	if_pf (flags & PSM_MQ_FLAG_CALLBACK)
+	    req->type |= MQE_TYPE_CALLBACK;
+	if_pf (iov != NULL) {
+	    req->type |= MQE_TYPE_IOV;
+	    req->iov = iov;
+	    req->iovcnt = iovcnt;
+	}
+	mq_req_recv_unexpected(mq, req, buf, len, context);
+    }
+    return req;
+}
+
+psm_mq_req_t
+psmi_mq_replay_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, void *buf,
+		     uint32_t len)
+{
+    return mq_irecv_inner(mq, tag, tagsel, 0, buf, len, NULL, 0, NULL);
+}
+
+psm_mq_req_t
+psmi_mq_replay_probe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, int remove)
+{
+    return mq_req_match_with_tagsel(mq, tag, tagsel, remove);
+}
+
+void
+psmi_mq_replay_imrecv(psm_mq_t mq, psm_mq_req_t req, void *buf, uint32_t len)
+{
+    mq_req_recv_unexpected(mq, req, buf, len, NULL);
+}
+
+psm_error_t __recvpath
+__psm_mq_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags, 
+	      void *buf, uint32_t len, void *context, psm_mq_req_t *reqo)
+{
+    psm_mq_req_t req;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && mq->completion_fn == NULL)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"No MQ completion callback registered");
+
+    PSMI_PLOCK();
+    req = mq_irecv_inner(mq, tag, tagsel, flags, buf, len, NULL, 0, context);
+    PSMI_PUNLOCK();
+    *reqo = req;
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_irecv)
+
+psm_error_t __recvpath
+__psm_mq_irecvv(psm_mq_t mq, uint64_t tag, uint64_t tagsel, uint32_t flags, 
+		const struct iovec *iov, uint32_t iovcnt, void *context, 
+		psm_mq_req_t *reqo)
+{
+    psm_mq_req_t req;
+    int64_t len;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    len = mq_iov_length(iov, iovcnt);
+    if_pf (len < 0)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"iovec message is larger than %u bytes", UINT32_MAX);
+    if (iovcnt <= 1 || len == 0)
+	return __psm_mq_irecv(mq, tag, tagsel, flags, 
+			      iovcnt ? iov[0].iov_base : NULL, (uint32_t) len, 
+			      context, reqo);
+
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK && mq->completion_fn == NULL)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"No MQ completion callback registered");
+
+    PSMI_PLOCK();
+    req = mq_irecv_inner(mq, tag, tagsel, flags, NULL, (uint32_t) len, 
+			 iov, iovcnt, context);
+    PSMI_PUNLOCK();
+    *reqo = req;
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_irecvv)
+
+/*
+ * Persistent requests.  psm_mq_send_init and psm_mq_recv_init record the
+ * arguments of a send or receive in a request that is never queued itself.
+ * psm_mq_start posts a regular request from them, and test, wait and cancel
+ * on the persistent request act on the started one.  Completing it leaves
+ * the persistent request inactive instead of releasing it.  The started
+ * request is allocated once with the persistent one and posted again on
+ * every start, except for a receive that matches an unexpected message,
+ * which completes the request already holding it.
+ */
+static
+psm_error_t
+mq_req_persistent(psm_mq_t mq, uint32_t type, uint32_t flags, uint64_t tag, 
+		  uint64_t tagsel, const void *buf, uint32_t len, 
+		  void *context, psm_epaddr_t dest, psm_mq_req_t *reqo)
+{
+    psm_mq_req_t req, pers_req = NULL;
+
+    if_pf (flags & PSM_MQ_FLAG_CALLBACK)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"Persistent requests cannot complete through callbacks");
+
+    PSMI_PLOCK();
+    req = psmi_mq_req_alloc(mq, type);
+    if_pt (req != NULL) {
+	pers_req = psmi_mq_req_alloc(mq, type);
+	if_pf (pers_req == NULL)
+	    psmi_mq_req_free(req);
+    }
+    PSMI_PUNLOCK();
+    if_pf (pers_req == NULL)
+	return psmi_handle_error(mq->ep, PSM_NO_MEMORY,
+		"Couldn't allocate persistent request");
+
+    req->type |= MQE_TYPE_PERSISTENT;
+    req->state = MQ_STATE_COMPLETE; /* inactive */
+    req->tag = tag;
+    req->tagsel = tagsel;
+    req->buf = (uint8_t *) buf;
+    req->buf_len = len;
+    req->context = context;
+    req->rts_peer = dest;
+    req->pers_flags = flags;
+    req->pers_active = NULL;
+    req->pers_req = pers_req;
+    pers_req->pers_owner = req;
+    *reqo = req;
+    return PSM_OK;
+}
+
+psm_error_t
+__psm_mq_send_init(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, 
+		   uint64_t stag, const void *buf, uint32_t len, void *context, 
+		   psm_mq_req_t *req)
+{
+    PSMI_ERR_UNLESS_INITIALIZED(mq->ep);
+    return mq_req_persistent(mq, MQE_TYPE_SEND, flags, stag, 0, buf, len, 
+			     context, dest, req);
+}
+PSMI_API_DECL(psm_mq_send_init)
+
+psm_error_t
+__psm_mq_recv_init(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, 
+		   uint32_t flags, void *buf, uint32_t len, void *context, 
+		   psm_mq_req_t *req)
+{
+    PSMI_ERR_UNLESS_INITIALIZED(mq->ep);
+    return mq_req_persistent(mq, MQE_TYPE_RECV, flags, rtag, rtagsel, buf, 
+			     len, context, NULL, req);
+}
+PSMI_API_DECL(psm_mq_recv_init)
+
+psm_error_t __sendpath
+__psm_mq_start(psm_mq_req_t *ireq)
+{
+    psm_mq_req_t req = *ireq;
+    psm_mq_t mq;
+    psm_epaddr_t dest;
+    psm_error_t err = PSM_OK;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    mq = req->mq;
+    if (!(req->type & MQE_TYPE_PERSISTENT) || req->pers_active != NULL)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"Request %p is not an inactive persistent request", req);
+
+    PSMI_PLOCK();
+    mq->req_reuse = req->pers_req;
+    if (MQE_TYPE_IS_SEND(req->type)) {
+	dest = req->rts_peer;
+	PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_TX_SIZE, req->buf_len);
+	err = psmi_mq_batch_flush_dest(mq, dest);
+	if (err == PSM_OK)
+	    err = dest->ptlctl->mq_isend(dest->ptl, mq, dest, 
+					 req->pers_flags, req->tag, req->buf, 
+					 req->buf_len, req->context, 
+					 &req->pers_active);
+    }
+    else {
+	req->pers_active = mq_irecv_inner(mq, req->tag, req->tagsel, 
+					  req->pers_flags, req->buf, 
+					  req->buf_len, NULL, 0, req->context);
+	if_pf (req->pers_active == NULL)
+	    err = PSM_NO_MEMORY;
+    }
+    mq->req_reuse = NULL;
+    if (err == PSM_OK)
+	req->state = MQ_STATE_POSTED; /* active */
+    PSMI_PUNLOCK();
+    return err;
+}
+PSMI_API_DECL(psm_mq_start)
+
+psm_error_t
+__psm_mq_request_free(psm_mq_req_t *ireq)
+{
+    psm_mq_req_t req = *ireq;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if (req == PSM_MQ_REQINVALID)
+	return PSM_OK;
+    if (!(req->type & MQE_TYPE_PERSISTENT) || req->pers_active != NULL)
+	return psmi_handle_error(req->mq->ep, PSM_PARAM_ERR,
+		"Request %p is not an inactive persistent request", req);
+
+    PSMI_PLOCK();
+    req->pers_req->pers_owner = NULL;
+    psmi_mq_req_free(req->pers_req);
+    psmi_mq_req_free(req);
+    PSMI_PUNLOCK();
+    *ireq = PSM_MQ_REQINVALID;
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_request_free)
+
+psm_error_t __recvpath
+__psm_mq_improbe(psm_mq_t mq, uint64_t tag, uint64_t tagsel, 
+		 psm_mq_req_t *reqo, psm_mq_status_t *status)
+{
+    psm_mq_req_t req;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    PSMI_PLOCK();
+    req = mq_req_match_with_tagsel(mq, tag, tagsel, 1);
+    if (req == NULL) {
+	psmi_poll_internal(mq->ep, 1);
+	/* try again */
+	req = mq_req_match_with_tagsel(mq, tag, tagsel, 1);
+    }
+    PSMI_MQ_TRACE(mq, req != NULL ? MQ_TRACE_MPROBE : MQ_TRACE_PROBE, 0, 
+		  tag, tagsel, 0);
+    PSMI_PUNLOCK();
+
+    if (req == NULL)
+	return PSM_MQ_NO_COMPLETIONS;
+
+    /* The request is now owned by the caller until psm_mq_imrecv.  Eager
+     * data still arriving for it keeps landing in its system buffer. */
+    _IPATH_VDBG("tag=%"PRIx64" tagsel=%"PRIx64" req=%p state=%d\n",
+		tag, tagsel, req, req->state);
+    if (status != NULL)
+	mq_status_copy(req, status);
+    *reqo = req;
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_improbe)
+
+psm_error_t __recvpath
+__psm_mq_imrecv(psm_mq_t mq, uint32_t flags, void *buf, uint32_t len, 
+		void *context, psm_mq_req_t *reqo)
+{
+    psm_mq_req_t req = *reqo;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if (req == PSM_MQ_REQINVALID || !MQE_TYPE_IS_RECV(req->type))
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"Invalid request passed to psm_mq_imrecv (req=%p)", req);
+
+    PSMI_PLOCK();
+    _IPATH_VDBG("buf=%p,len=%d req=%p state=%d\n", buf, len, req, req->state);
+    mq_req_recv_unexpected(mq, req, buf, len, context);
+    PSMI_PUNLOCK();
+
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_imrecv)
+
+psm_error_t __recvpath
+__psm_mq_imrecv_sysbuf(psm_mq_t mq, psm_mq_req_t *reqo, void **bufo, 
+		       psm_mq_status_t *status)
+{
+    psm_mq_req_t req = *reqo;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if (req == PSM_MQ_REQINVALID || !MQE_TYPE_IS_RECV(req->type))
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR,
+		"Invalid request passed to psm_mq_imrecv_sysbuf (req=%p)", req);
+
+    PSMI_PLOCK();
+    if (req->state == MQ_STATE_UNEXP)	/* eager data still arriving */
+	psmi_poll_internal(mq->ep, 1);
+    if (req->state != MQ_STATE_COMPLETE) {
+	PSMI_PUNLOCK();
+	return PSM_MQ_NO_COMPLETIONS;
+    }
+
+    /* Loan the system buffer to the caller, who gives it back through
+     * psm_mq_sysbuf_release.  0-byte messages never had one. */
+    *bufo = req->buf;
+    req->recv_msglen = req->send_msglen;
+    req->error_code = PSM_OK;
+    if (status != NULL)
+	mq_status_copy(req, status);
+    _IPATH_VDBG("req=%p loaned sysbuf=%p len=%d\n", req, req->buf, 
+		req->send_msglen);
+    psmi_mq_req_free(req);
+    PSMI_PUNLOCK();
+
+    *reqo = PSM_MQ_REQINVALID;
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_imrecv_sysbuf)
+
+psm_error_t
+__psm_mq_sysbuf_release(psm_mq_t mq, void *buf)
+{
+    PSMI_ASSERT_INITIALIZED();
+
+    if (buf == NULL)
+	return PSM_OK;
+
+    PSMI_PLOCK();
+    psmi_mq_sysbuf_free(mq, buf);
+    PSMI_PUNLOCK();
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_sysbuf_release)
+
+psm_error_t __sendpath
+__psm_mq_ipeek(psm_mq_t mq, psm_mq_req_t *oreq, psm_mq_status_t *status)
+{
+    psm_mq_req_t req;
+
+    PSMI_ASSERT_INITIALIZED();
+
+    if ((req = mq->completed_q.first) == NULL) {
+	PSMI_PLOCK();
+	psmi_poll_internal(mq->ep, 1);
+	if ((req = mq->completed_q.first) == NULL) {
+	    /* Nothing to do, a good time to give back unexpected buffers */
+	    if_pf (mq->sysbuf.trim_pending)
+		psmi_mq_sysbuf_trim(mq);
+	    PSMI_PUNLOCK();
+	    psmi_mq_run_callbacks(mq);
+	    return PSM_MQ_NO_COMPLETIONS;
+	}
+	PSMI_PUNLOCK();
+	psmi_mq_run_callbacks(mq);
+    }
+    /* something in the queue */
+    *oreq = req;
+    if (status != NULL)
+	mq_status_copy(req, status);
+
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_ipeek)
+
+static
+psm_error_t
+psmi_mqopt_ctl(psm_mq_t mq, uint32_t key, void *value, int get)
+{
+    psm_error_t err = PSM_OK;
+    uint32_t val32;
 
     switch (key) {
 	case PSM_MQ_RNDV_IPATH_SZ:
@@ -531,6 +1586,10 @@ psmi_mqopt_ctl(psm_mq_t mq, uint32_t key, void *value, int get)
 	    else {
 		val32 = *((uint32_t *) value);
 		mq->ipath_thresh_rv = val32;
+		mq->stats.rndv_ipath_thresh = val32;
+		PSMI_PLOCK();
+		psmi_mq_sysbuf_set_eager_max(mq, val32);
+		PSMI_PUNLOCK();
 	    }
 	    _IPATH_VDBG("RNDV_IPATH_SZ = %d (%s)\n",
 			mq->ipath_thresh_rv, get ? "GET" : "SET");
@@ -542,20 +1601,72 @@ psmi_mqopt_ctl(psm_mq_t mq, uint32_t key, void *value, int get)
 	    else {
 		val32 = *((uint32_t *) value);
 		mq->shm_thresh_rv = val32;
+		mq->stats.rndv_shm_thresh = val32;
+		PSMI_PLOCK();
+		psmi_mq_sysbuf_set_eager_max(mq, val32);
+		PSMI_PUNLOCK();
 	    }
 	    _IPATH_VDBG("RNDV_SHM_SZ = %d (%s)\n",
 			mq->shm_thresh_rv, get ? "GET" : "SET");
 	    break;
 
+	case PSM_MQ_OPT_MATCH_SIMD:
+	    if (get) 
+		*((uint32_t *)value) = mq->match_backend;
+	    else {
+		val32 = *((uint32_t *) value);
+		PSMI_PLOCK();
+		err = psmi_mq_soa_enable(mq, val32 != 0);
+		PSMI_PUNLOCK();
+	    }
+	    _IPATH_VDBG("MATCH_SIMD = %d (%s)\n",
+			mq->match_backend, get ? "GET" : "SET");
+	    break;
+
 	case PSM_MQ_MAX_SYSBUF_MBYTES:
 	    if (get)
-		*((uint32_t *)value) = (uint32_t)(mq->max_sysbuf_bytes / 1048576);
+		*((uint32_t *)value) = mq->max_sysbuf_bytes == ~(0ULL) ? 0 :
+		    (uint32_t)(mq->max_sysbuf_bytes / 1048576);
+	    else {
+		val32 = *((uint32_t *) value);
+		PSMI_PLOCK();
+		mq->max_sysbuf_bytes = val32 ? 1048576ULL * val32 : ~(0ULL);
+		mq->sysbuf_gen++;
+		PSMI_PUNLOCK();
+	    }
+	    _IPATH_VDBG("MAX_SYSBUF_MBYTES = %d (%s)\n",
+			mq->max_sysbuf_bytes == ~(0ULL) ? 0 :
+			(int) (mq->max_sysbuf_bytes / 1048576), 
+			get ? "GET" : "SET");
+	    break;
+
+	case PSM_MQ_OPT_WAIT_SPIN_US:
+	    if (get)
+		*((uint32_t *)value) = mq->wait_spin_us;
+	    else {
+		val32 = *((uint32_t *) value);
+		PSMI_PLOCK();
+		psmi_mq_wait_set_policy(mq, val32, mq->wait_yield_us,
+					mq->wait_block_us);
+		PSMI_PUNLOCK();
+	    }
+	    _IPATH_VDBG("WAIT_SPIN_US = %d (%s)\n",
+			mq->wait_spin_us, get ? "GET" : "SET");
+	    break;
+
+	case PSM_MQ_OPT_AGG_MSG_SZ:
+	    if (get)
+		*((uint32_t *)value) = mq->batch_msg_max;
 	    else {
 		val32 = *((uint32_t *) value);
-		/* XXX For now, don't support this */
-		/* mq->max_sysbuf_bytes = 1048576ULL * val32; */
-		mq->max_sysbuf_bytes = ~(0ULL);
+		PSMI_PLOCK();
+		if (val32 == 0)
+		    psmi_mq_batch_flush_all(mq);
+		mq->batch_msg_max = min(val32, MQ_BATCH_MSG_MAX);
+		PSMI_PUNLOCK();
 	    }
+	    _IPATH_VDBG("AGG_MSG_SZ = %d (%s)\n",
+			mq->batch_msg_max, get ? "GET" : "SET");
 	    break;
 	
 	default:
@@ -581,6 +1692,70 @@ __psm_mq_setopt(psm_mq_t mq, int key, const void *value)
 }
 PSMI_API_DECL(psm_mq_setopt)
 
+/*
+ * Partition matching by tag_order_mask.  NONE and ALL keep a single order
+ * class, any other mask gets per-class lists for wildcard receives and
+ * unexpected messages.  Receives and unexpected messages may already be
+ * queued, so move them to their class in the order they were queued.
+ */
+static
+psm_error_t
+mq_set_order_mask(psm_mq_t mq, uint64_t order_mask)
+{
+    psm_mq_req_t req, next;
+    int i;
+
+    mq->order_mask = order_mask;
+    if (order_mask == PSM_MQ_ORDERMASK_NONE || 
+	order_mask == PSM_MQ_ORDERMASK_ALL)
+	return PSM_OK;
+
+    mq->expected_otab = (struct mqq *) 
+	psmi_calloc(mq->ep, UNDEFINED, MQ_HASH_SIZE, sizeof(struct mqq));
+    mq->unexpected_otab = (struct mqq *) 
+	psmi_calloc(mq->ep, UNDEFINED, MQ_HASH_SIZE, sizeof(struct mqq));
+    if (mq->expected_otab == NULL || mq->unexpected_otab == NULL) {
+	if (mq->expected_otab != NULL)
+	    psmi_free(mq->expected_otab);
+	if (mq->unexpected_otab != NULL)
+	    psmi_free(mq->unexpected_otab);
+	mq->expected_otab = mq->unexpected_otab = NULL;
+	mq->order_mask = PSM_MQ_ORDERMASK_ALL;
+	return psmi_handle_error(mq->ep, PSM_NO_MEMORY,
+		"Couldn't allocate memory for mq order classes");
+    }
+    for (i = 0; i < MQ_HASH_SIZE; i++) {
+	mq->expected_otab[i].first = NULL;
+	mq->expected_otab[i].lastp = &mq->expected_otab[i].first;
+	mq->unexpected_otab[i].first = NULL;
+	mq->unexpected_otab[i].lastp = &mq->unexpected_otab[i].first;
+    }
+
+    req = mq->expected_q.first;
+    mq->expected_q.first = NULL;
+    mq->expected_q.lastp = &mq->expected_q.first;
+    for (; req != NULL; req = next) {
+	next = req->next;
+	req->next = NULL;
+	if (mq_req_is_ordered(mq, req->tagsel)) {
+	    if (mq->match_backend != MQ_MATCH_LIST)
+		psmi_mq_soa_remove(mq, &mq->expected_soa, req);
+	    mq_qq_append(&mq->expected_otab[mq_order_class(mq, req->tag)], req);
+	}
+	else
+	    mq_qq_append(&mq->expected_q, req);
+    }
+
+    for (req = mq->unexpected_q.first; req != NULL; req = req->next) {
+	struct mqq *q = &mq->unexpected_otab[mq_order_class(mq, req->tag)];
+	req->onext = NULL;
+	req->opprev = q->lastp;
+	*(q->lastp) = req;
+	q->lastp = &req->onext;
+    }
+    return PSM_OK;
+}
+
 /*
  * This is the API for the user.  We actually allocate the MQ much earlier, but
  * the user can set options after obtaining an endpoint
@@ -610,6 +1785,12 @@ __psm_mq_init(psm_ep_t ep, uint64_t tag_order_mask,
 	err = psmi_mqopt_ctl(mq, opts[i].key, opts[i].value, 0);
     if (err != PSM_OK) /* error already handled */
 	goto fail;
+
+    PSMI_PLOCK();
+    err = mq_set_order_mask(mq, tag_order_mask);
+    PSMI_PUNLOCK();
+    if (err != PSM_OK)
+	goto fail;
     
     *mqo = mq;
 
@@ -633,10 +1814,26 @@ __psm_mq_get_stats(psm_mq_t mq, psm_mq_stats_t *stats)
 }
 PSMI_API_DECL(psm_mq_get_stats)
 
+psm_error_t
+__psm_mq_get_histogram(psm_mq_t mq, int hist, uint64_t *buckets)
+{
+    if (hist < 0 || hist >= PSM_MQ_NUM_HISTS)
+	return psmi_handle_error(mq->ep, PSM_PARAM_ERR, 
+		"Unknown MQ histogram %d", hist);
+#ifdef PSM_MQ_HISTOGRAMS
+    memcpy(buckets, mq->hist[hist], sizeof(mq->hist[hist]));
+#else
+    memset(buckets, 0, PSM_MQ_HIST_BUCKETS * sizeof(uint64_t));
+#endif
+    return PSM_OK;
+}
+PSMI_API_DECL(psm_mq_get_histogram)
+
 psm_error_t
 psmi_mq_malloc(psm_ep_t ep, psm_mq_t *mqo)
 {
     psm_error_t err = PSM_OK;
+    int i;
 
     psm_mq_t mq = (psm_mq_t) psmi_calloc(ep, UNDEFINED, 1, sizeof(struct psm_mq));
     if (mq == NULL) {
@@ -645,13 +1842,37 @@ psmi_mq_malloc(psm_ep_t ep, psm_mq_t *mqo)
 	goto fail;
     }
 
+    mq->expected_htab = (struct mqsq *) 
+	psmi_calloc(ep, UNDEFINED, MQ_HASH_SIZE, sizeof(struct mqsq));
+    mq->unexpected_htab = (struct mqq *) 
+	psmi_calloc(ep, UNDEFINED, MQ_HASH_SIZE, sizeof(struct mqq));
+    if (mq->expected_htab == NULL || mq->unexpected_htab == NULL) {
+	err = psmi_handle_error(ep, PSM_NO_MEMORY,
+		"Couldn't allocate memory for mq queues");
+	goto fail;
+    }
+
     mq->ep = ep;
     mq->expected_q.first = NULL;
     mq->expected_q.lastp = &mq->expected_q.first;
+    for (i = 0; i < MQ_HASH_SIZE; i++) {
+	mq->expected_htab[i].first = NULL;
+	mq->expected_htab[i].lastp = &mq->expected_htab[i].first;
+	mq->unexpected_htab[i].first = NULL;
+	mq->unexpected_htab[i].lastp = &mq->unexpected_htab[i].first;
+    }
+    mq->expected_seq = 0;
+    mq->hash_tagsel = ~(0ULL);
+    mq->order_mask = PSM_MQ_ORDERMASK_ALL;
+    mq->expected_otab = NULL;
+    mq->unexpected_otab = NULL;
     mq->unexpected_q.first = NULL;
     mq->unexpected_q.lastp = &mq->unexpected_q.first;
     mq->completed_q.first = NULL;
     mq->completed_q.lastp = &mq->completed_q.first;
+    mq->callback_q.first = NULL;
+    mq->callback_q.lastp = &mq->callback_q.first;
+    mq->completion_fn = NULL;
 
     mq->cur_sysbuf_bytes = 0ULL;
     mq->max_sysbuf_bytes = ~(0ULL);
@@ -661,6 +1882,13 @@ psmi_mq_malloc(psm_ep_t ep, psm_mq_t *mqo)
     mq->ipath_thresh_rv = 64000;
     mq->ipath_window_rv = 131072;
     mq->shm_thresh_rv = 16000;
+    psmi_mq_wait_set_policy(mq, MQ_WAIT_SPIN_US_DEFAULT, 
+			    MQ_WAIT_YIELD_US_DEFAULT, MQ_WAIT_BLOCK_US_DEFAULT);
+    mq->batch_msg_max = 0;
+    mq->batch_window_us = MQ_BATCH_WINDOW_US_DEFAULT;
+    mq->batch_window_cyc = nanosecs_to_cycles(1000ULL * mq->batch_window_us);
+    mq->batch_pending = NULL;
+    mq->batches = NULL;
 
     memset(&mq->stats, 0, sizeof(psm_mq_stats_t));
     err = psmi_mq_req_init(mq);
@@ -669,22 +1897,30 @@ psmi_mq_malloc(psm_ep_t ep, psm_mq_t *mqo)
 
     /* Initialize the unexpected system buffer allocator */
     psmi_mq_sysbuf_init(mq);
-    char buf[128];
+    char buf[1024];
     psmi_mq_sysbuf_getinfo(mq, buf, sizeof buf);
     _IPATH_VDBG("%s", buf);
     *mqo = mq;
 
     return PSM_OK;
 fail:
-    if (mq != NULL)
+    if (mq != NULL) {
+	if (mq->expected_htab != NULL)
+	    psmi_free(mq->expected_htab);
+	if (mq->unexpected_htab != NULL)
+	    psmi_free(mq->unexpected_htab);
 	psmi_free(mq);
+    }
     return err;
 }
 
 psm_error_t
 psmi_mq_initialize_defaults(psm_mq_t mq)
 {
-    union psmi_envvar_val env_rvwin, env_ipathrv, env_shmrv;
+    union psmi_envvar_val env_rvwin, env_ipathrv, env_shmrv, env_hashsel;
+    union psmi_envvar_val env_simd, env_sysbufmax;
+    union psmi_envvar_val env_waitspin, env_waityield, env_waitblock;
+    union psmi_envvar_val env_aggmax, env_aggwin;
 
     psmi_getenv("PSM_MQ_RNDV_IPATH_THRESH", 
 		"ipath eager-to-rendezvous switchover",
@@ -693,13 +1929,15 @@ psmi_mq_initialize_defaults(psm_mq_t mq)
     mq->ipath_thresh_rv = env_ipathrv.e_uint;
 
     /* Re-evaluate this since it may have changed after initializing the shm
-     * device */
+     * device, or been calibrated when attaching to it */
     mq->shm_thresh_rv = psmi_shm_mq_rv_thresh;
     psmi_getenv("PSM_MQ_RNDV_SHM_THRESH", 
 		"shm eager-to-rendezvous switchover",
 		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
 		(union psmi_envvar_val) mq->shm_thresh_rv, &env_shmrv);
     mq->shm_thresh_rv = env_shmrv.e_uint;
+    mq->stats.rndv_ipath_thresh = mq->ipath_thresh_rv;
+    mq->stats.rndv_shm_thresh = mq->shm_thresh_rv;
 
     psmi_getenv("PSM_MQ_RNDV_IPATH_WINDOW", 
 		"ipath rendezvous window size",
@@ -707,6 +1945,66 @@ psmi_mq_initialize_defaults(psm_mq_t mq)
 		(union psmi_envvar_val) 131072, &env_rvwin);
     mq->ipath_window_rv = env_rvwin.e_uint;
 
+    psmi_getenv("PSM_MQ_MAX_SYSBUF_MBYTES", 
+		"Megabytes of unexpected messages to buffer before pushing "
+		"back on senders (0 for no limit)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 0, &env_sysbufmax);
+    if (env_sysbufmax.e_uint)
+	mq->max_sysbuf_bytes = 1048576ULL * env_sysbufmax.e_uint;
+
+    /* Size classes of unexpected buffers follow the eager thresholds */
+    psmi_mq_sysbuf_set_eager_max(mq, 
+	max(mq->ipath_thresh_rv, mq->shm_thresh_rv));
+
+    /* Nothing can be posted yet, so the hash index can still change */
+    psmi_getenv("PSM_MQ_HASH_TAGSEL", 
+		"Tag bits a receive must select to be hashed on posting",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_ULONG_ULONG,
+		(union psmi_envvar_val) (unsigned long long) mq->hash_tagsel, 
+		&env_hashsel);
+    mq->hash_tagsel = (uint64_t) env_hashsel.e_ulonglong;
+
+    psmi_getenv("PSM_MQ_MATCH_SIMD", 
+		"Match wildcard receives with SIMD scans of tag arrays",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		PSMI_ENVVAR_VAL_NO, &env_simd);
+    if (env_simd.e_uint)
+	psmi_mq_soa_enable(mq, 1);
+
+    psmi_getenv("PSM_MQ_WAIT_SPIN_US", 
+		"Microseconds a blocking wait spins without progress before "
+		"yielding the CPU",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->wait_spin_us, &env_waitspin);
+    psmi_getenv("PSM_MQ_WAIT_YIELD_US", 
+		"Microseconds a blocking wait yields before it sleeps",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->wait_yield_us, &env_waityield);
+    psmi_getenv("PSM_MQ_WAIT_BLOCK_US", 
+		"Longest sleep of a blocking wait between polls (0 never "
+		"sleeps)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->wait_block_us, &env_waitblock);
+    psmi_mq_wait_set_policy(mq, env_waitspin.e_uint, env_waityield.e_uint,
+			    env_waitblock.e_uint);
+
+    psmi_getenv("PSM_MQ_AGG_MSG_MAX", 
+		"Largest eager send packed with others to the same peer "
+		"(0 disables)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->batch_msg_max, &env_aggmax);
+    mq->batch_msg_max = min(env_aggmax.e_uint, MQ_BATCH_MSG_MAX);
+    psmi_getenv("PSM_MQ_AGG_WINDOW_US", 
+		"Microseconds packed sends may wait for company",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) mq->batch_window_us, &env_aggwin);
+    mq->batch_window_us = env_aggwin.e_uint;
+    mq->batch_window_cyc = nanosecs_to_cycles(1000ULL * mq->batch_window_us);
+
+#ifdef PSM_MQ_TRACE
+    psmi_mq_trace_init(mq);
+#endif
     return PSM_OK;
 }
     
@@ -714,8 +2012,19 @@ psmi_mq_initialize_defaults(psm_mq_t mq)
 psm_error_t
 psmi_mq_free(psm_mq_t mq)
 {
+    psmi_mq_batch_fini(mq, 0);
+#ifdef PSM_MQ_TRACE
+    psmi_mq_trace_fini(mq);
+#endif
     psmi_mq_req_fini(mq);
     psmi_mq_sysbuf_fini(mq);
+    psmi_mq_soa_enable(mq, 0);
+    psmi_free(mq->expected_htab);
+    psmi_free(mq->unexpected_htab);
+    if (mq->expected_otab != NULL)
+	psmi_free(mq->expected_otab);
+    if (mq->unexpected_otab != NULL)
+	psmi_free(mq->unexpected_otab);
     psmi_free(mq);
     return PSM_OK;
 }
@@ -38,6 +38,8 @@
 extern "C" {
 #endif
 
+struct iovec;	/* <sys/uio.h> */
+
 
 
 /* Initialize the MQ component for MQ communication
@@ -54,7 +56,10 @@ extern "C" {
  *                           PSM_MQ_ORDERMASK_ALL to tell MQ to respectively
  *                           provide no ordering guarantees or to provide
  *                           ordering over all messages by ignoring the
- *                           contexts of the send tags.
+ *                           contexts of the send tags.  Any other mask lets
+ *                           MQ match each context independently, so receives
+ *                           that select the whole context only search
+ *                           messages and receives of that context.
  * [in] opts Set of options for Matched Queue
  * [in] numopts Number of options passed
  * [out] mq User-supplied storage to return the Matched Queue handle
@@ -118,6 +123,9 @@ psm_mq_status_t;
 /* PSM Communication handle (opaque) */
 typedef struct psm_mq_req *psm_mq_req_t;
 
+/* Completion callback, see psm_mq_register_completion_callback */
+typedef void (*psm_mq_completion_fn_t)(psm_mq_t mq, psm_mq_status_t *status);
+
 
 
 /* Get an MQ option (Deprecated. Use psm_getopt with PSM_COMPONENT_MQ)
@@ -170,6 +178,10 @@ psm_mq_setopt(psm_mq_t mq, int option, const void *value);
 #define PSM_MQ_FLAG_SENDSYNC	0x01 
 				/* MQ Send Force synchronous send */
 
+#define PSM_MQ_FLAG_CALLBACK	0x02
+				/* MQ Send or receive completes through the
+				 * MQ completion callback */
+
 #define PSM_MQ_REQINVALID	((psm_mq_req_t)(NULL)) 
 				/* MQ request completion value */
 
@@ -183,7 +195,9 @@ psm_mq_setopt(psm_mq_t mq, int option, const void *value);
  * [in] mq Matched Queue Handle
  * [in] rtag Receive tag
  * [in] rtagsel Receive tag selector
- * [in] flags Receive flags (None currently supported)
+ * [in] flags Receive flags, currently:
+ *            * PSM_MQ_FLAG_CALLBACK tells PSM to complete the request
+ *              through the MQ completion callback.
  * [in] buf Receive buffer 
  * [in] len Receive buffer length
  * [in] context User context pointer, available in psm_mq_status_t
@@ -205,6 +219,33 @@ psm_error_t
 psm_mq_irecv(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, uint32_t flags,
 	     void *buf, uint32_t len, void *context, psm_mq_req_t *req);
 
+/* Post a receive into a list of buffers
+ *
+ * Function identical to psm_mq_irecv, except that the message is scattered
+ * into iovcnt buffers in order, as if they were one buffer whose length is
+ * the sum of their lengths.
+ *
+ * [in] mq Matched Queue Handle
+ * [in] rtag Receive tag
+ * [in] rtagsel Receive tag selector
+ * [in] flags Receive flags, as for psm_mq_irecv
+ * [in] iov Array of receive buffers
+ * [in] iovcnt Number of buffers in iov
+ * [in] context User context pointer, available in psm_mq_status_t
+ *                    upon completion
+ * [out] req PSM MQ Request handle created by the preposted receive
+ *
+ * [post] Neither the iov array nor the buffers it describes may be modified
+ *       or released until the request is completed.
+ *
+ * [retval] PSM_OK The receive buffers have successfully been posted to the MQ.
+ * [retval] PSM_PARAM_ERR The buffers add up to more than 4GB.
+ */
+psm_error_t
+psm_mq_irecvv(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, uint32_t flags,
+	      const struct iovec *iov, uint32_t iovcnt, void *context, 
+	      psm_mq_req_t *req);
+
 /* Send a blocking MQ message
  *
  * Function to send a blocking MQ message, whereby the message is locally
@@ -248,6 +289,8 @@ psm_mq_send(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag,
  *            synchronously, meaning that the message will not be sent until
  *            the receiver acknowledges that it has matched the send with a
  *            receive buffer.
+ *            * PSM_MQ_FLAG_CALLBACK tells PSM to complete the request
+ *            through the MQ completion callback.
  * [in] stag Message Send Tag
  * [in] buf Source buffer pointer
  * [in] len Length of message starting at buf.
@@ -272,6 +315,34 @@ psm_error_t
 psm_mq_isend(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
 	     const void *buf, uint32_t len, void *context, psm_mq_req_t *req);
 
+/* Send a non-blocking MQ message gathered from a list of buffers
+ *
+ * Function identical to psm_mq_isend, except that the message is the
+ * concatenation of iovcnt source buffers.  Shared memory eager messages are
+ * copied straight from the buffers; other messages may be gathered into a
+ * temporary buffer first.
+ *
+ * [in] mq Matched Queue Handle
+ * [in] dest Destination EP address
+ * [in] flags Message flags, as for psm_mq_isend
+ * [in] stag Message Send Tag
+ * [in] iov Array of source buffers
+ * [in] iovcnt Number of buffers in iov
+ * [in] context Optional user-provided pointer available in @ref
+ *                    psm_mq_status_t when the send is locally completed.
+ * [out] req PSM MQ Request handle created by the non-blocking send
+ *
+ * [post] Neither the iov array nor the buffers it describes may be modified
+ *       until the request is completed.
+ *
+ * [retval] PSM_OK The message has been successfully initiated.
+ * [retval] PSM_PARAM_ERR The buffers add up to more than 4GB.
+ */
+psm_error_t
+psm_mq_isendv(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, uint64_t stag, 
+	      const struct iovec *iov, uint32_t iovcnt, void *context, 
+	      psm_mq_req_t *req);
+
 /* Try to Probe if a message is received to match tag selection
  * criteria
  *
@@ -299,6 +370,104 @@ psm_error_t
 psm_mq_iprobe(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, 
 		   psm_mq_status_t *status);
 
+/* Probe for a message and dequeue it if one matches the tag selection
+ * criteria
+ *
+ * Function to atomically probe for and dequeue a received message that
+ * matches the supplied tag and tag selector.  Unlike psm_mq_iprobe, a
+ * successful probe removes the message from MQ's unexpected queue so that no
+ * later probe or receive can match it.  The message is then received by
+ * passing the returned request to psm_mq_imrecv.
+ *
+ * [in] mq Matched Queue Handle
+ * [in] rtag Message receive tag
+ * [in] rtagsel Message receive tag selector
+ * [out] req Upon success, a request handle for the matched message
+ * [out] status Upon success, status is filled with information
+ *                    regarding the matching send if non-NULL.
+ *
+ * [post] If the probe is successful, the user must receive the message by
+ *       calling psm_mq_imrecv with the returned request.
+ *
+ * The following error codes are returned.  Other errors are handled by the PSM
+ * error handler (psm_error_register_handler).
+ *
+ * [retval] PSM_OK The improbe is successful, req and status are updated.
+ * [retval] PSM_MQ_NO_COMPLETIONS The improbe is unsuccessful and req and
+ *                                status are unchanged.
+ */
+psm_error_t
+psm_mq_improbe(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, 
+	       psm_mq_req_t *req, psm_mq_status_t *status);
+
+/* Receive a message previously matched by psm_mq_improbe
+ *
+ * Function to bind a receive buffer to a message dequeued by @ref
+ * psm_mq_improbe.  Data that already arrived is copied into the buffer; if the
+ * message is sent with rendezvous, the transfer is started directly into the
+ * supplied buffer.  The request then completes like any receive request
+ * posted with psm_mq_irecv.
+ *
+ * [in] mq Matched Queue Handle
+ * [in] flags Receive flags (None currently supported)
+ * [in] buf Receive buffer 
+ * [in] len Receive buffer length
+ * [in] context User context pointer, available in psm_mq_status_t
+ *                    upon completion
+ * [in,out] req Request returned by psm_mq_improbe, to be completed
+ *                    through psm_mq_wait or psm_mq_test.
+ *
+ * The following error code is returned.  Other errors are handled by the PSM
+ * error handler (psm_error_register_handler).
+ *
+ * [retval] PSM_OK The receive buffer has successfully been bound to the
+ *                message.
+ */
+psm_error_t
+psm_mq_imrecv(psm_mq_t mq, uint32_t flags, void *buf, uint32_t len, 
+	      void *context, psm_mq_req_t *req);
+
+/* Receive a message matched by psm_mq_improbe without copying it
+ *
+ * Function to complete a message dequeued by psm_mq_improbe by taking
+ * ownership of the system buffer MQ received it into, instead of having it
+ * copied into a user buffer.  This is only possible for messages sent eagerly
+ * (below the rendezvous threshold) that have been received in full.
+ *
+ * [in] mq Matched Queue Handle
+ * [in,out] req Request returned by psm_mq_improbe
+ * [out] buf Upon success, the system buffer holding the message data, or
+ *                 NULL for a zero-length message
+ * [out] status Upon success, status is filled with information regarding
+ *                    the matching send if non-NULL.
+ *
+ * [post] On success, req is set to PSM_MQ_REQINVALID and the user must
+ *       return buf to MQ through psm_mq_sysbuf_release once done with it.
+ *
+ * The following error codes are returned.  Other errors are handled by the PSM
+ * error handler (psm_error_register_handler).
+ *
+ * [retval] PSM_OK The message data is available in buf.
+ * [retval] PSM_MQ_NO_COMPLETIONS The message is not available in a system
+ *                                buffer, either because eager data is still
+ *                                arriving or because it is sent with
+ *                                rendezvous.  The request is unchanged and
+ *                                can be retried or passed to psm_mq_imrecv.
+ */
+psm_error_t
+psm_mq_imrecv_sysbuf(psm_mq_t mq, psm_mq_req_t *req, void **buf, 
+		     psm_mq_status_t *status);
+
+/* Release a system buffer obtained from psm_mq_imrecv_sysbuf
+ *
+ * [in] mq Matched Queue Handle
+ * [in] buf System buffer returned by psm_mq_imrecv_sysbuf (may be NULL)
+ *
+ * [retval] PSM_OK The buffer has been returned to MQ.
+ */
+psm_error_t
+psm_mq_sysbuf_release(psm_mq_t mq, void *buf);
+
 /* Query for non-blocking requests ready for completion.
  *
  * Function to query a particular MQ for non-blocking requests that are ready
@@ -423,11 +592,87 @@ psm_mq_wait(psm_mq_req_t *request, psm_mq_status_t *status);
 psm_error_t
 psm_mq_test(psm_mq_req_t *request, psm_mq_status_t *status);
 
+/* Test an array of requests for completion
+ *
+ * Function to complete every request of an array that has completed.  Unlike
+ * psm_mq_test, this function ensures progress once before testing the
+ * requests, and the whole array is tested under a single acquisition of the
+ * library lock.
+ *
+ * [in,out] requests Array of MQ non-blocking requests.  Entries that are
+ *                   PSM_MQ_REQINVALID are ignored.
+ * [in] count Number of entries in requests
+ * [out] outcount Number of requests that completed
+ * [out] indices Array of at least count entries, the first outcount entries
+ *               are updated with the positions of the completed requests
+ * [out] statuses Updated if non-NULL, the first outcount entries receive the
+ *                status of the completed requests, in the same order as
+ *                indices
+ *
+ * [post] Completed requests are assigned the value PSM_MQ_REQINVALID
+ *       and their storage is released back to the MQ library.  Incomplete
+ *       requests are unchanged.
+ *
+ * The following two errors are always returned.  Other errors are handled by
+ * the PSM error handler (psm_error_register_handler).
+ *
+ * [retval] PSM_OK At least one request completed.
+ *
+ * [retval] PSM_MQ_NO_COMPLETIONS No request completed, or no entry was
+ *                           active.
+ */
+psm_error_t
+psm_mq_testsome(psm_mq_req_t *requests, int count, int *outcount, 
+		int *indices, psm_mq_status_t *statuses);
+
+/* Wait until any request of an array is complete
+ *
+ * Function to block until one request of an array completes, ensuring
+ * progress as psm_mq_wait does.
+ *
+ * [in,out] requests Array of MQ non-blocking requests.  Entries that are
+ *                   PSM_MQ_REQINVALID are ignored.
+ * [in] count Number of entries in requests
+ * [out] index Position of the completed request, or -1 if no entry was
+ *             active
+ * [out] status Updated if non-NULL when a request completes
+ *
+ * [post] The completed request is assigned the value PSM_MQ_REQINVALID
+ *       and its storage is released back to the MQ library.
+ *
+ * [retval] PSM_OK A request is complete or no entry was active.
+ */
+psm_error_t
+psm_mq_waitany(psm_mq_req_t *requests, int count, int *index, 
+	       psm_mq_status_t *status);
+
+/* Wait until all requests of an array are complete
+ *
+ * Function equivalent to calling psm_mq_wait on each request of an array,
+ * but under a single acquisition of the library lock.
+ *
+ * [in,out] requests Array of MQ non-blocking requests.  Entries that are
+ *                   PSM_MQ_REQINVALID are ignored.
+ * [in] count Number of entries in requests
+ * [out] statuses Updated if non-NULL, entry i receives the status of
+ *                requests[i]
+ *
+ * [post] All requests are assigned the value PSM_MQ_REQINVALID and their
+ *       storage is released back to the MQ library.
+ *
+ * [retval] PSM_OK All requests are complete.
+ */
+psm_error_t
+psm_mq_waitall(psm_mq_req_t *requests, int count, 
+	       psm_mq_status_t *statuses);
+
 /* Cancel a preposted request
  *
  * Function to cancel a preposted receive request returned by @ref
- * psm_mq_irecv.  It is currently illegal to cancel a send request initiated
- * with psm_mq_isend.
+ * psm_mq_irecv, or a send request returned by psm_mq_isend.  Only
+ * rendezvous sends that no receive has matched yet can be cancelled; eager
+ * sends are always considered matched.  Cancelling a send blocks until the
+ * receiver has answered.
  *
  * [pre] The user has obtained a valid MQ request by calling psm_mq_isend
  *      or psm_mq_irecv and passes a pointer to enough storage to write
@@ -443,19 +688,114 @@ psm_mq_test(psm_mq_req_t *request, psm_mq_status_t *status);
  *
  * [retval] PSM_OK The request could be successfully cancelled such that the
  *                preposted receive buffer could be removed from the preposted
- *                receive queue before a match occured. The associated @c
+ *                receive queue before a match occured, or the send was
+ *                withdrawn from the receiver before it matched a receive
+ *                (its status reports 0 bytes delivered). The associated @c
  *                request remains unchanged and the user must still return
  *                the storage to the MQ library.
  *
  * [retval] PSM_MQ_NO_COMPLETIONS The request could not be successfully cancelled
  *                           since the preposted receive buffer has already
- *                           matched an incoming message.  The request
+ *                           matched an incoming message, or the send has
+ *                           already matched a receive.  The request
  *                           remains unchanged.
  *
  */
 psm_error_t
 psm_mq_cancel(psm_mq_req_t *req);
 
+/* Register the MQ completion callback
+ *
+ * Function to register the function called for requests posted through
+ * psm_mq_isend or psm_mq_irecv with PSM_MQ_FLAG_CALLBACK.  Such requests are
+ * not returned by psm_mq_ipeek and must not be passed to psm_mq_test or
+ * psm_mq_wait.  Once complete, the callback is called with the request status
+ * and the request storage is released back to the MQ library.
+ *
+ * Callbacks are called from psm_poll and psm_mq_ipeek, outside of the library
+ * lock, so they may post new requests or make progress themselves.  While no
+ * callback is registered, requests posted with PSM_MQ_FLAG_CALLBACK that
+ * complete are kept until one is registered again.
+ *
+ * [in] mq Matched Queue handle
+ * [in] fn Completion callback, or NULL to unregister it
+ *
+ * [returns] The previously registered callback, or NULL.
+ */
+psm_mq_completion_fn_t
+psm_mq_register_completion_callback(psm_mq_t mq, psm_mq_completion_fn_t fn);
+
+/* Create a persistent send request
+ *
+ * Function to record the arguments of a non-blocking send so that the same
+ * send can be started many times with psm_mq_start.  The arguments are the
+ * same as for psm_mq_isend, except that PSM_MQ_FLAG_CALLBACK is not
+ * supported.
+ *
+ * [out] req Persistent request, initially inactive
+ *
+ * [post] Test, wait and cancel calls on an active persistent request act on
+ *       the send that was last started.  Once that send completes the
+ *       request becomes inactive again but is @e not assigned the value
+ *       PSM_MQ_REQINVALID.  Test and wait return PSM_OK immediately on an
+ *       inactive request, and psm_mq_testsome and psm_mq_waitany ignore it.
+ *
+ * [retval] PSM_OK The persistent request was created.
+ */
+psm_error_t
+psm_mq_send_init(psm_mq_t mq, psm_epaddr_t dest, uint32_t flags, 
+		 uint64_t stag, const void *buf, uint32_t len, void *context, 
+		 psm_mq_req_t *req);
+
+/* Create a persistent receive request
+ *
+ * Function to record the arguments of a non-blocking receive so that the
+ * same receive can be started many times with psm_mq_start.  The arguments
+ * are the same as for psm_mq_irecv, except that PSM_MQ_FLAG_CALLBACK is not
+ * supported.  Completion follows psm_mq_send_init.
+ *
+ * [out] req Persistent request, initially inactive
+ *
+ * [retval] PSM_OK The persistent request was created.
+ */
+psm_error_t
+psm_mq_recv_init(psm_mq_t mq, uint64_t rtag, uint64_t rtagsel, 
+		 uint32_t flags, void *buf, uint32_t len, void *context, 
+		 psm_mq_req_t *req);
+
+/* Start a persistent request
+ *
+ * [in] req Inactive request created by psm_mq_send_init or
+ *          psm_mq_recv_init
+ *
+ * [retval] PSM_OK The send or receive was posted and the request is active.
+ */
+psm_error_t
+psm_mq_start(psm_mq_req_t *req);
+
+/* Release a persistent request
+ *
+ * [in,out] req Inactive persistent request, assigned the value
+ *              PSM_MQ_REQINVALID on return
+ *
+ * [retval] PSM_OK The request storage was released back to the MQ library.
+ */
+psm_error_t
+psm_mq_request_free(psm_mq_req_t *req);
+
+/* Send aggregated messages
+ *
+ * Function to send right away every small message that was packed with
+ * others under PSM_MQ_OPT_AGG_MSG_SZ and is still waiting for company.
+ * Blocking calls already do this before they start waiting.
+ *
+ * [in] mq Matched Queue handle
+ *
+ * [retval] PSM_OK Nothing aggregated is held back anymore.
+ */
+psm_error_t
+psm_mq_flush(psm_mq_t mq);
+
 struct psm_mq_stats {
     uint64_t	rx_user_bytes;/* Bytes received into a matched user buffer */
     uint64_t	rx_user_num;  /* Messages received into a matched user buffer */
@@ -473,10 +813,28 @@ struct psm_mq_stats {
     uint64_t	rx_sysbuf_num;   /* Number of system buffers allocated  */
     uint64_t	rx_sysbuf_bytes; /* Bytes allcoated for system buffers */
 
-    uint64_t	_reserved[16];	 /* Internally reserved for future use */
+    uint64_t	rx_exp_qdepth;	     /* Receives currently posted */
+    uint64_t	rx_unexp_qdepth;     /* Messages currently unexpected */
+    uint64_t	rx_unexp_qdepth_max; /* High-water mark of unexpected messages */
+    uint64_t	rx_exp_search_len;   /* Posted receives examined by arrivals */
+    uint64_t	rx_unexp_search_len; /* Unexpected messages examined by receives
+					and probes */
+    uint64_t	rx_unexp_deferred;   /* Unexpected eager messages pushed back 
+					because of PSM_MQ_MAX_SYSBUF_MBYTES */
+
+    uint64_t	wait_spin_ns;	/* Time blocking calls spent spinning */
+    uint64_t	wait_yield_ns;	/* Time blocking calls spent yielding */
+    uint64_t	wait_block_ns;	/* Time blocking calls spent asleep */
+    uint64_t	wait_block_num;	/* Times blocking calls went to sleep */
+
+    uint64_t	rndv_shm_thresh;   /* Current shm rendezvous threshold, set by
+				      PSM_MQ_RNDV_SHM_CALIBRATE if enabled */
+    uint64_t	rndv_ipath_thresh; /* Current ipath rendezvous threshold */
+
+    uint64_t	_reserved[4];	 /* Internally reserved for future use */
 };
 
-#define PSM_MQ_NUM_STATS    13	/* How many stats are currently used in psm_mq_stats */
+#define PSM_MQ_NUM_STATS    25	/* How many stats are currently used in psm_mq_stats */
 
 typedef struct psm_mq_stats	   psm_mq_stats_t;
 
@@ -484,6 +842,40 @@ typedef struct psm_mq_stats	   psm_mq_stats_t;
 void 
 psm_mq_get_stats(psm_mq_t mq, psm_mq_stats_t *stats);
 
+/* Histograms kept by an MQ when the library is built with them (the
+ * default, unless built with PSM_NO_MQ_HISTOGRAMS=1) */
+#define PSM_MQ_HIST_BUCKETS	    32
+
+#define PSM_MQ_HIST_TX_SIZE	    0 /* Bytes per message sent */
+#define PSM_MQ_HIST_RX_SIZE	    1 /* Bytes per message received */
+#define PSM_MQ_HIST_LAT_TINY	    2 /* Nanoseconds from posting a receive to
+				         its completion, per protocol */
+#define PSM_MQ_HIST_LAT_SHORT	    3
+#define PSM_MQ_HIST_LAT_EAGERLONG   4
+#define PSM_MQ_HIST_LAT_RNDV	    5
+#define PSM_MQ_HIST_EXP_SEARCH	    6 /* Posted receives examined per arrival */
+#define PSM_MQ_HIST_UNEXP_SEARCH    7 /* Unexpected messages examined per
+				         receive or probe */
+#define PSM_MQ_NUM_HISTS	    8
+
+/* Retrieve a histogram from an instantiated MQ
+ *
+ * Bucket 0 counts values of 0, and bucket i counts values from 2^(i-1) to
+ * 2^i - 1.  The last bucket also counts everything larger.  Receive sizes and
+ * latencies are only counted for receives posted by the user, and a receive
+ * matched to an unexpected message is timed from when it was posted.
+ *
+ * [in] mq Matched Queue handle
+ * [in] hist One of the PSM_MQ_HIST_* histograms
+ * [out] buckets Array of PSM_MQ_HIST_BUCKETS counts, all 0 if the library was
+ *               built without histograms
+ *
+ * [retval] PSM_OK The histogram was copied.
+ * [retval] PSM_PARAM_ERR hist is not a known histogram.
+ */
+psm_error_t
+psm_mq_get_histogram(psm_mq_t mq, int hist, uint64_t *buckets);
+
 
 #ifdef __cplusplus
 }				/* extern "C" */
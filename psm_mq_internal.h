@@ -46,6 +46,93 @@ struct mqsq {
     psm_mq_req_t    *lastp;
 };
 
+/* 
+ * Posted receives whose tagsel covers every bit of the MQ's hash_tagsel are
+ * kept in hash buckets indexed by those tag bits, so an incoming envelope only
+ * has to walk one short bucket.  Wildcard receives stay on the ordered
+ * expected_q.  Each post is stamped with a sequence number so that matching
+ * can honour posting order across the buckets and the wildcard list.
+ *
+ * Unexpected messages are linked both on the arrival-ordered unexpected_q and
+ * on a hash chain, so that receives and probes that select the hashed bits
+ * only look at messages that can possibly match.
+ *
+ * When psm_mq_init is given a tag_order_mask other than NONE or ALL, the
+ * masked bits define independent order classes.  Wildcard receives that
+ * select every order bit then live on a per-class list of expected_otab
+ * instead of expected_q, and unexpected messages are also chained per class
+ * in unexpected_otab, so a search only walks its own class.
+ */
+#define MQ_HASH_BITS	10
+#define MQ_HASH_SIZE	(1<<MQ_HASH_BITS)
+
+/*
+ * Optional structure-of-arrays shadow of the two ordered queues (wildcard
+ * receives and unexpected arrivals), see psm_mq_match.c.  Entries are kept in
+ * queue order, removals leave a tombstone (NULL req) that is compacted away
+ * once tombstones make up half of the live window.
+ */
+struct mqsoa {
+    uint64_t	 *tag;
+    uint64_t	 *tagsel;   /* per-entry selectors, NULL for unexpected */
+    psm_mq_req_t *req;
+    uint32_t	  head;	    /* first slot that may be live */
+    uint32_t	  tail;	    /* next free slot */
+    uint32_t	  size;
+    uint32_t	  ndead;    /* tombstones between head and tail */
+};
+
+typedef uint32_t (*mq_soa_find_fn_t)(const uint64_t *tags, 
+				     const uint64_t *tagsels, uint64_t tag, 
+				     uint64_t tagsel, uint32_t i, uint32_t end);
+
+#define MQ_MATCH_LIST	    0	/* Walk the ordered lists */
+#define MQ_MATCH_SOA	    1	/* Scalar scan of the SoA arrays */
+#define MQ_MATCH_SOA_SSE41  2	/* SSE4.1 scan, 4 entries per iteration */
+#define MQ_MATCH_SOA_AVX2   3	/* AVX2 scan, 8 entries per iteration */
+
+/*
+ * Unexpected system buffers come from a per-MQ slab allocator (see
+ * psm_mq_utils.c).  Each size class is refilled one page-aligned chunk at a
+ * time; chunks that become entirely free are handed back to the OS once a
+ * class holds more than free_hiwat free blocks, down to free_lowat.
+ * Requests larger than the last class are allocated on their own.
+ */
+#define MQ_SYSBUF_MAX_CLASSES	16
+
+struct mqsysbuf_chunk;
+
+struct mqsysbuf_class {
+    uint32_t	block_size;	/* usable bytes in each block */
+    uint32_t	block_stride;	/* distance between two blocks in a chunk */
+    uint32_t	blocks_per_chunk;
+    uint32_t	nchunks;
+    uint32_t	nblocks;	/* blocks across all chunks */
+    uint32_t	nfree;		/* free blocks across all chunks */
+    uint32_t	nempty;		/* chunks with no block handed out */
+    uint32_t	free_hiwat;
+    uint32_t	free_lowat;
+    size_t	chunk_bytes;
+    struct mqsysbuf_chunk  *avail;	/* chunks with at least one free block */
+    struct mqsysbuf_chunk  *full;	/* chunks with every block handed out */
+    uint64_t	nalloc;		/* blocks handed out, lifetime */
+    uint64_t	ntrimmed;	/* chunks released by trimming, lifetime */
+};
+
+struct mqsysbuf {
+    int		is_init;
+    int		trim_pending;
+    int		use_hugepages;
+    uint32_t	nclasses;
+    int		fixed_classes;	/* classes given by PSM_MQ_SYSBUF_CLASSES */
+    uint32_t	chunk_bytes;	/* minimum chunk size */
+    uint32_t	hiwat_chunks;
+    uint32_t	lowat_chunks;
+    uint64_t	mapped_bytes;	/* bytes held in chunks */
+    uint32_t	transient_num;	/* oversized one-off buffers in use */
+    struct mqsysbuf_class class[MQ_SYSBUF_MAX_CLASSES];
+};
+
 typedef psm_error_t (*psm_mq_unexpected_callback_fn_t)
 		    (psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 		     uint64_t tag, uint32_t send_msglen, 
@@ -55,19 +142,56 @@ struct psm_mq {
     psm_ep_t	  ep;		/**> ep back pointer */
     mpool_t	  sreq_pool;
     mpool_t	  rreq_pool;
+    psm_mq_req_t  req_reuse;	/**> Handed out by the next allocation of its
+				     type instead of a pool request */
 
     psm_mq_unexpected_callback_fn_t unexpected_callback;
-    struct mqsq   expected_q;	/**> Preposted (expected) queue */
-    struct mqsq   unexpected_q;	/**> Unexpected queue */
+    struct mqq    expected_q;	/**> Preposted (expected) wildcard queue */
+    struct mqsq  *expected_htab;/**> Preposted exact-tag receives, hashed */
+    uint64_t	  expected_seq;	/**> Posting order of expected receives */
+    uint64_t	  hash_tagsel;	/**> Tag bits used to index the hash */
+    uint64_t	  order_mask;	/**> tag_order_mask from psm_mq_init */
+    struct mqq   *expected_otab;/**> Wildcard receives by order class */
+    struct mqq    unexpected_q;	/**> Unexpected queue, in arrival order */
+    struct mqq   *unexpected_htab;/**> Unexpected queue, hashed by tag */
+    struct mqq   *unexpected_otab;/**> Unexpected queue, by order class */
     struct mqq    completed_q;	/**> Completed queue */
+    struct mqq    callback_q;	/**> Completed, callback not yet run */
+    psm_mq_completion_fn_t completion_fn;
+
+    uint32_t	  match_backend;  /**> MQ_MATCH_* for the ordered queues */
+    mq_soa_find_fn_t soa_find;
+    struct mqsoa  expected_soa;
+    struct mqsoa  unexpected_soa;
 
+    struct mqsysbuf sysbuf;	/**> Unexpected buffer slabs */
     uint64_t	  cur_sysbuf_bytes;
     uint64_t	  max_sysbuf_bytes;
+    uint64_t	  sysbuf_gen;	/**> Bumped when budget room appears */
     uint32_t	  ipath_thresh_rv;
     uint32_t	  shm_thresh_rv;
     uint32_t	  ipath_window_rv;
 
+    uint32_t	  wait_spin_us;	/**> Idle time spent spinning in a wait */
+    uint32_t	  wait_yield_us;/**> then yielding, before blocking */
+    uint32_t	  wait_block_us;/**> Longest sleep between polls (0 never) */
+    uint64_t	  wait_spin_cyc;
+    uint64_t	  wait_yield_cyc;
+
+    uint32_t	  batch_msg_max;  /**> Largest send aggregated, 0 disables */
+    uint32_t	  batch_window_us;/**> Age at which polling flushes a batch */
+    uint64_t	  batch_window_cyc;
+    struct mq_batch *batch_pending; /**> Batches holding messages */
+    struct mq_batch *batches;	  /**> Every batch, for teardown */
+    int		  batch_flushing;
+
     psm_mq_stats_t	stats;	/**> MQ stats, accumulated by each PTL */
+#ifdef PSM_MQ_HISTOGRAMS
+    uint64_t	  hist[PSM_MQ_NUM_HISTS][PSM_MQ_HIST_BUCKETS];
+#endif
+#ifdef PSM_MQ_TRACE
+    FILE	 *trace_fp;	/**> PSM_MQ_TRACE_FILE, or NULL */
+#endif
 };
 
 #define MQ_IPATH_THRESH_TINY	8
@@ -83,6 +207,11 @@ struct psm_mq {
 #define MQE_TYPE_WAITING	0x0001
 #define MQE_TYPE_WAITING_PEER	0x0004
 #define MQE_TYPE_EGRLONG	0x0008
+#define MQE_TYPE_CALLBACK	0x0010
+#define MQE_TYPE_PERSISTENT	0x0020
+#define MQE_TYPE_IOV		0x0040
+#define MQE_TYPE_CANCELLING	0x0080	/* send waits for receiver's answer */
+#define MQE_TYPE_CANCELLED	0x0100
 
 #define MQ_STATE_COMPLETE	0
 #define MQ_STATE_POSTED		1
@@ -100,6 +229,9 @@ struct psm_mq {
 #define MQ_MSG_RTS_EGR	9
 #define MQ_MSG_CTS_EGR	10
 #define MQ_MSG_DATA_REQ	11
+#define MQ_MSG_RTS_CANCEL	12
+#define MQ_MSG_RTS_CANCEL_ACK	13
+#define MQ_MSG_BATCH	14	/* packed tiny messages, see struct mq_batch */
 
 #define MQ_MSG_USER_FIRST 64
 
@@ -130,35 +262,42 @@ struct psm_mq {
 	}
 
 typedef psm_error_t (*mq_rts_callback_fn_t)(psm_mq_req_t req, int was_posted);
+typedef int (*mq_rts_sender_fn_t)(psm_mq_req_t req, uintptr_t sender);
 typedef psm_error_t (*mq_testwait_callback_fn_t)(psm_mq_req_t *req, int istest,
 						 psm_mq_status_t *status);
 
 /* receive mq_req, the default */
+/*
+ * Requests are allocated cache aligned.  Every queue walk reads the first 32
+ * bytes (list link, tag, tagsel, state and type) and the hash, order class and
+ * wildcard walks also read the rest of the first cache line.  Fields that are
+ * only used once a request is matched, posted or completed come after it, the
+ * rarely used rendezvous, persistent and iovec state last.
+ */
 struct psm_mq_req {
-    struct {
-	psm_mq_req_t    next;
-	psm_mq_req_t    *pprev; /* used in completion queue */
-    };
+    psm_mq_req_t    next;
+    uint64_t	    tag;
+    uint64_t	    tagsel;	/* used for receives */
     uint32_t	    state;
     uint32_t	    type;
-    psm_mq_t	    mq;
 
-    /* Tag matching vars */
-    uint64_t	tag;
-    uint64_t    tagsel;	    /* used for receives */
+    /* Tag hash and order class chains, used while on the unexpected queue */
+    psm_mq_req_t    hnext;
+    psm_mq_req_t    onext;
+    uint64_t	    seq;	/* posting order, for expected receives */
+    psm_mq_req_t    *pprev;	/* used in completion and unexpected queues */
 
-    /* Some PTLs want to get notified when there's a test/wait event */
-    mq_testwait_callback_fn_t	testwait_callback;
+    /* Second cache line */
+    psm_mq_req_t    *hpprev;
+    psm_mq_req_t    *opprev;
+    psm_mq_t	    mq;
+    uint32_t	    soa_idx;	/* slot in the SoA shadow, if enabled */
+    uint32_t	    error_code;
 
     /* Buffer attached to request.  May be a system buffer for unexpected
      * messages or a user buffer when an expected message */
     uint8_t *buf;
     uint32_t buf_len;
-    uint32_t error_code;
-
-    /* Used only for eager LONGs */
-    STAILQ_ENTRY(psm_mq_req)    nextq; /* used for egr-long only */
-    psmi_egrid_t  egrid;
     uint32_t recv_msglen; /* Message length we are ready to receive */
     uint32_t send_msglen; /* Message length from sender */
     uint32_t recv_msgoff; /* Message offset into buf */
@@ -170,12 +309,40 @@ struct psm_mq_req {
     /* Used for request to send messages */
     void	*context;  /* user context associated to sends or receives */
 
+    /* Some PTLs want to get notified when there's a test/wait event */
+    mq_testwait_callback_fn_t	testwait_callback;
+
+    /* Used only for eager LONGs */
+    STAILQ_ENTRY(psm_mq_req)    nextq; /* used for egr-long only */
+    psmi_egrid_t  egrid;
+
     /* Used to keep track of unexpected rendezvous */
     mq_rts_callback_fn_t    rts_callback;
     psm_epaddr_t	    rts_peer;
     uint32_t		    rts_reqidx_peer;
     uintptr_t		    rts_sbuf;
 
+    /* Persistent requests keep their posting arguments in the fields above
+     * and track the request started from them.  pers_req is set aside when
+     * the persistent request is created and is the one every start posts;
+     * its pers_owner keeps it from going back to the pool when it completes. */
+    psm_mq_req_t    pers_active;
+    psm_mq_req_t    pers_req;
+    psm_mq_req_t    pers_owner;
+    uint32_t	    pers_flags;
+
+    /* Scatter list of iovec receives, and the contiguous staging buffer used
+     * when a transport needs one.  The staging buffer is a sysbuf released
+     * with the request. */
+    const struct iovec *iov;
+    uint32_t	    iovcnt;
+    void	   *stage_buf;
+
+#ifdef PSM_MQ_HISTOGRAMS
+    uint64_t	    hist_t_post;  /* cycles, when the receive was posted */
+    uint32_t	    hist_class;	  /* PSM_MQ_HIST_LAT_* of its protocol */
+#endif
+
     /* PTLs get to store their own per-request data.  MQ manages the allocation
      * by allocating psm_mq_req so that ptl_req_data has enough space for all 
      * possible PTLs.
@@ -184,7 +351,7 @@ struct psm_mq_req {
 	void    *ptl_req_ptr;	  /* when used by ptl as pointer */
 	uint8_t  ptl_req_data[0]; /* when used by ptl for "inline" data */
     };
-};
+} PSMI_CACHEALIGN;
 
 void psmi_mq_mtucpy(void *vdest, const void *vsrc, uint32_t nchars);
 
@@ -257,6 +424,82 @@ uint32_t mq_set_msglen(psm_mq_req_t req, uint32_t recvlen, uint32_t sendlen))
     }
 }
 
+/*
+ * Histograms, compiled in with PSM_MQ_HISTOGRAMS.  Receives are stamped when
+ * posted (or matched to an unexpected message), learn their protocol when the
+ * envelope arrives and are accounted when they complete.
+ */
+PSMI_ALWAYS_INLINE(
+int
+psmi_mq_hist_bucket(uint64_t val))
+{
+    int b = val ? 64 - __builtin_clzll(val) : 0;
+    return b < PSM_MQ_HIST_BUCKETS ? b : PSM_MQ_HIST_BUCKETS - 1;
+}
+
+#ifdef PSM_MQ_HISTOGRAMS
+#define PSMI_MQ_HIST_ADD(mq,id,val)					\
+	((mq)->hist[(id)][psmi_mq_hist_bucket(val)]++)
+#define PSMI_MQ_HIST_POSTED(req)    ((req)->hist_t_post = get_cycles())
+#define PSMI_MQ_HIST_MODE(req,mode)	((req)->hist_class =		\
+	(mode) == MQ_MSG_TINY ? PSM_MQ_HIST_LAT_TINY :			\
+	(mode) == MQ_MSG_SHORT ? PSM_MQ_HIST_LAT_SHORT :		\
+	(mode) == MQ_MSG_LONG ? PSM_MQ_HIST_LAT_EAGERLONG : 0)
+#define PSMI_MQ_HIST_RNDV(req)	    ((req)->hist_class = PSM_MQ_HIST_LAT_RNDV)
+
+PSMI_ALWAYS_INLINE(
+void
+psmi_mq_hist_complete(psm_mq_t mq, psm_mq_req_t req))
+{
+    if (req->hist_class && req->hist_t_post) {
+	PSMI_MQ_HIST_ADD(mq, req->hist_class, 
+	    cycles_to_nanosecs(get_cycles() - req->hist_t_post));
+	PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_RX_SIZE, req->send_msglen);
+	req->hist_class = 0;
+    }
+}
+#else
+#define PSMI_MQ_HIST_ADD(mq,id,val)
+#define PSMI_MQ_HIST_POSTED(req)
+#define PSMI_MQ_HIST_MODE(req,mode)
+#define PSMI_MQ_HIST_RNDV(req)
+#define psmi_mq_hist_complete(mq,req)
+#endif
+
+/*
+ * Traces, compiled in with PSM_MQ_TRACE.  Every receive posted, probe and
+ * accepted arrival is written as one line of text to PSM_MQ_TRACE_FILE so
+ * that the matching engine can be replayed on it without a transport (see
+ * psm_mq_trace.c).  Arrivals refused for lack of system buffers are left out,
+ * their sender presents them again.
+ */
+#define MQ_TRACE_POST	    'P'	/* irecv */
+#define MQ_TRACE_PROBE	    'Q'	/* iprobe, or improbe that found nothing */
+#define MQ_TRACE_MPROBE	    'M'	/* improbe that dequeued a message */
+#define MQ_TRACE_ARRIVAL    'A'	/* eager envelope, mode is its MQ_MSG_* */
+#define MQ_TRACE_RTS	    'R'	/* rendezvous request */
+
+#ifdef PSM_MQ_TRACE
+void psmi_mq_trace_init(psm_mq_t mq);
+void psmi_mq_trace_fini(psm_mq_t mq);
+void psmi_mq_trace_record(psm_mq_t mq, int ev, uint16_t mode, uint64_t tag,
+			  uint64_t tagsel, uint32_t len);
+#define PSMI_MQ_TRACE(mq,ev,mode,tag,tagsel,len) do {			\
+	if_pf ((mq)->trace_fp != NULL)					\
+	    psmi_mq_trace_record(mq, ev, mode, tag, tagsel, len);	\
+    } while (0)
+#else
+#define PSMI_MQ_TRACE(mq,ev,mode,tag,tagsel,len) do { } while (0)
+#endif
+
+/* Entry points into the matching engine for trace replay */
+psm_mq_req_t psmi_mq_replay_irecv(psm_mq_t mq, uint64_t tag, uint64_t tagsel,
+				  void *buf, uint32_t len);
+psm_mq_req_t psmi_mq_replay_probe(psm_mq_t mq, uint64_t tag, uint64_t tagsel,
+				  int remove);
+void	     psmi_mq_replay_imrecv(psm_mq_t mq, psm_mq_req_t req, void *buf,
+				   uint32_t len);
+
 #ifndef PSM_DEBUG
 
 PSMI_ALWAYS_INLINE(
@@ -279,6 +522,20 @@ mq_qq_append(struct mqq *q, psm_mq_req_t req))
 } while (0)
 #endif
 
+/* Queue a request that just completed, for the user or for its callback */
+PSMI_ALWAYS_INLINE(
+void
+mq_complete_append(psm_mq_t mq, psm_mq_req_t req))
+{
+    psmi_mq_hist_complete(mq, req);
+    if_pf (req->type & MQE_TYPE_CALLBACK)
+	mq_qq_append(&mq->callback_q, req);
+    else
+	mq_qq_append(&mq->completed_q, req);
+    /* Another thread may be asleep in a wait, we hold the lock it dropped */
+    psmi_doorbell_ring(mq->ep->doorbell);
+}
+
 PSMI_ALWAYS_INLINE(
 void
 mq_sq_append(struct mqsq *q, psm_mq_req_t req))
@@ -302,7 +559,6 @@ mq_qq_remove(struct mqq *q, psm_mq_req_t req))
 psm_error_t  psmi_mq_req_init(psm_mq_t mq);
 psm_error_t  psmi_mq_req_fini(psm_mq_t mq);
 psm_mq_req_t psmi_mq_req_alloc(psm_mq_t mq, uint32_t type);
-#define      psmi_mq_req_free(req)  psmi_mpool_put(req)
 
 /*
  * MQ unexpected buffer management
@@ -312,6 +568,60 @@ void	  psmi_mq_sysbuf_fini(psm_mq_t mq);
 void *	  psmi_mq_sysbuf_alloc(psm_mq_t mq, uint32_t nbytes);
 void	  psmi_mq_sysbuf_free(psm_mq_t mq, void *);
 void	  psmi_mq_sysbuf_getinfo(psm_mq_t mq, char *buf, size_t len);
+void	  psmi_mq_sysbuf_set_eager_max(psm_mq_t mq, uint32_t nbytes);
+void	  psmi_mq_sysbuf_trim(psm_mq_t mq);
+
+PSMI_ALWAYS_INLINE(
+void
+psmi_mq_req_free(psm_mq_req_t req))
+{
+    if_pf (req->stage_buf != NULL) {
+	psmi_free(req->stage_buf);
+	req->stage_buf = NULL;
+    }
+    if_pf (req->pers_owner != NULL) {
+	req->state = MQ_STATE_FREE;
+	return;
+    }
+    psmi_mpool_put(req);
+}
+
+/*
+ * Scatter/gather between iovecs and contiguous buffers, at a byte offset
+ * into the iovec list
+ */
+void	  psmi_mq_iov_scatter(const struct iovec *iov, uint32_t iovcnt,
+			      uint32_t off, const void *src, uint32_t nbytes);
+void	  psmi_mq_iov_gather(void *dst, const struct iovec *iov, 
+			     uint32_t iovcnt, uint32_t off, uint32_t nbytes);
+void *	  psmi_mq_iov_stage(psm_mq_t mq, const struct iovec *iov, 
+			    uint32_t iovcnt, uint32_t nbytes);
+void *	  psmi_mq_iov_stage_recv(psm_mq_t mq, psm_mq_req_t req, 
+				 uint32_t nbytes);
+
+/* Copy received data into a matched request at offset off */
+PSMI_ALWAYS_INLINE(
+void
+mq_req_copy_in(psm_mq_req_t req, uint32_t off, const void *src, 
+	       uint32_t nbytes))
+{
+    if_pf (req->type & MQE_TYPE_IOV)
+	psmi_mq_iov_scatter(req->iov, req->iovcnt, off, src, nbytes);
+    else
+	psmi_mq_mtucpy(req->buf + off, src, nbytes);
+}
+
+/* Give a send the staging buffer its data was gathered into.  If the PTL is
+ * already done with the data, the buffer is released right away. */
+PSMI_ALWAYS_INLINE(
+void
+mq_req_set_stage(psm_mq_t mq, psm_mq_req_t req, void *buf))
+{
+    if (req->state == MQ_STATE_COMPLETE && req->testwait_callback == NULL)
+	psmi_free(buf);
+    else
+	req->stage_buf = buf;
+}
 
 /*
  * Main receive progress engine, for shmops and ipath, in mq.c
@@ -320,6 +630,112 @@ psm_error_t psmi_mq_malloc(psm_ep_t ep, psm_mq_t *mqo);
 psm_error_t psmi_mq_initialize_defaults(psm_mq_t mq);
 psm_error_t psmi_mq_free(psm_mq_t mq);
 
+/*
+ * Aggregation of tiny sends, in mq.c.  Eager sends of at most batch_msg_max
+ * bytes to a peer whose ptl has mq_send_batch are packed into that peer's
+ * batch as records (a struct mq_batch_rec followed by the payload, padded to 8
+ * bytes) and go out as a single MQ_MSG_BATCH message.  A batch is flushed when
+ * it is full, before any other send to the same peer, when polling finds it
+ * older than batch_window_us, when a blocking wait starts and on psm_mq_flush.
+ * Records are delivered in order by psmi_mq_handle_batch.  Records a failed
+ * flush didn't send stay in the batch for the next flush.
+ */
+#define MQ_BATCH_BYTES	    1024
+#define MQ_BATCH_MSG_MAX    128
+#define MQ_BATCH_WINDOW_US_DEFAULT  20
+
+struct mq_batch_rec {
+    uint64_t	tag;
+    uint32_t	len;
+    uint32_t	_pad;
+};
+
+struct mq_batch {
+    struct mq_batch  *next;	/* on batch_pending */
+    struct mq_batch **pprev;
+    struct mq_batch  *next_all;
+    psm_epaddr_t      epaddr;
+    uint64_t	      t_first;	/* cycles, when the oldest record was added */
+    uint32_t	      len;
+    uint32_t	      cnt;
+    uint8_t	      buf[MQ_BATCH_BYTES] __attribute__ ((aligned(8)));
+};
+
+#define MQ_BATCH_RECLEN(len)	\
+	(sizeof(struct mq_batch_rec) + PSMI_ALIGNUP((len), 8))
+
+int	    psmi_mq_batch_add(psm_mq_t mq, psm_epaddr_t dest, uint64_t tag,
+			      const void *buf, uint32_t len);
+psm_error_t psmi_mq_batch_flush(psm_mq_t mq, struct mq_batch *b);
+psm_error_t psmi_mq_batch_flush_all(psm_mq_t mq);
+void	    psmi_mq_batch_fini(psm_mq_t mq, int flush);
+
+/* Keep the order of sends to dest that can't join its batch.  If the batch
+ * can't be sent, nothing else may go to dest and the error is returned. */
+PSMI_ALWAYS_INLINE(
+psm_error_t
+psmi_mq_batch_flush_dest(psm_mq_t mq, psm_epaddr_t dest))
+{
+    if_pf (dest->mqbatch != NULL && dest->mqbatch->len)
+	return psmi_mq_batch_flush(mq, dest->mqbatch);
+    return PSM_OK;
+}
+
+/*
+ * Blocking waits, in mq.c.  Polls that make no progress first spin for
+ * wait_spin_us, then yield the CPU for wait_yield_us and finally sleep on the
+ * endpoint doorbell for up to wait_block_us at a time.  Progress goes back to
+ * spinning.
+ */
+#define MQ_WAIT_SPIN	0
+#define MQ_WAIT_YIELD	1
+#define MQ_WAIT_BLOCK	2
+
+#define MQ_WAIT_SPIN_US_DEFAULT	    1000
+#define MQ_WAIT_YIELD_US_DEFAULT    1000
+#define MQ_WAIT_BLOCK_US_DEFAULT    1000
+
+struct mq_waitstate {
+    uint64_t	phase_start;	/* cycles */
+    uint64_t	idle_start;	/* cycles, 0 until a poll makes no progress */
+    uint32_t	phase;
+    uint32_t	spin_cnt;
+    uint32_t	armed;		/* counted in the doorbell's sleepers */
+    uint32_t	db_seq;
+};
+
+void psmi_mq_wait_set_policy(psm_mq_t mq, uint32_t spin_us, 
+			     uint32_t yield_us, uint32_t block_us);
+void psmi_mq_wait_begin(psm_mq_t mq, struct mq_waitstate *ws);
+void psmi_mq_wait_idle(psm_mq_t mq, struct mq_waitstate *ws);
+void psmi_mq_wait_phase(psm_mq_t mq, struct mq_waitstate *ws, 
+			uint32_t phase);
+void psmi_mq_wait_end(psm_mq_t mq, struct mq_waitstate *ws);
+
+#define PSMI_MQ_WAITUNTIL(mq,err,cond)	do {			\
+	    struct mq_waitstate _ws;				\
+	    psmi_mq_wait_begin(mq, &_ws);			\
+	    PSMI_PROFILE_BLOCK();				\
+	    while (!(cond)) {					\
+		err = psmi_poll_internal((mq)->ep, 1);		\
+		if (err == PSM_OK_NO_PROGRESS) {		\
+		    PSMI_PROFILE_REBLOCK(1);			\
+		    psmi_mq_wait_idle(mq, &_ws);		\
+		}						\
+		else if (err == PSM_OK) {			\
+		    PSMI_PROFILE_REBLOCK(0);			\
+		    _ws.idle_start = 0;				\
+		    _ws.spin_cnt = 0;				\
+		    if_pf (_ws.phase != MQ_WAIT_SPIN)		\
+			psmi_mq_wait_phase(mq, &_ws, MQ_WAIT_SPIN);  \
+		}						\
+		else						\
+		    break;					\
+	    }							\
+	    PSMI_PROFILE_UNBLOCK();				\
+	    psmi_mq_wait_end(mq, &_ws);				\
+	} while(0)
+
 /* Three functions that handle all MQ stuff */
 #define MQ_RET_MATCH_OK	0
 #define MQ_RET_UNEXP_OK 1
@@ -340,27 +756,234 @@ int psmi_mq_handle_rts(psm_mq_t mq, uint64_t tag, uintptr_t send_buf,
 		   mq_rts_callback_fn_t cb, psm_mq_req_t *req_o);
 void psmi_mq_handle_rts_complete(psm_mq_req_t req);
 
+/* Cancelling rendezvous sends: the receiver drops the RTS if it is still
+ * unexpected, and the sender completes the send as cancelled or not */
+psm_mq_req_t psmi_mq_handle_rts_cancel(psm_mq_t mq, uint64_t tag, 
+		   psm_epaddr_t peer, mq_rts_sender_fn_t is_sender, 
+		   uintptr_t sender);
+void psmi_mq_handle_send_cancel(psm_mq_req_t req, int cancelled);
+
+/* Unpack an MQ_MSG_BATCH payload into envelopes, all or nothing */
+int psmi_mq_handle_batch(psm_mq_t mq, psm_epaddr_t epaddr, 
+			 const void *payload, uint32_t paylen);
+
 void psmi_mq_stats_register(psm_mq_t mq, mpspawn_stats_add_fn add_fn);
 
+/*
+ * SoA matching backend, in psm_mq_match.c
+ */
+psm_error_t  psmi_mq_soa_enable(psm_mq_t mq, int enable);
+void	     psmi_mq_soa_append(psm_mq_t mq, struct mqsoa *soa, 
+				psm_mq_req_t req);
+void	     psmi_mq_soa_remove(psm_mq_t mq, struct mqsoa *soa, 
+				psm_mq_req_t req);
+psm_mq_req_t psmi_mq_soa_match(psm_mq_t mq, struct mqsoa *soa, uint64_t tag,
+			       uint64_t tagsel, uint64_t *nsearch);
+
+PSMI_ALWAYS_INLINE(
+uint32_t
+mq_hash_bits(uint64_t bits))
+{
+    /* Fibonacci hashing, keep the high bits of the product */
+    return (uint32_t) ((bits * 0x9e3779b97f4a7c15ULL) >> (64-MQ_HASH_BITS));
+}
+
+PSMI_ALWAYS_INLINE(
+uint32_t
+mq_hash_tag(psm_mq_t mq, uint64_t tag))
+{
+    return mq_hash_bits(tag & mq->hash_tagsel);
+}
+
+PSMI_ALWAYS_INLINE(
+uint32_t
+mq_order_class(psm_mq_t mq, uint64_t tag))
+{
+    return mq_hash_bits(tag & mq->order_mask);
+}
+
+PSMI_ALWAYS_INLINE(
+int
+mq_req_is_hashed(psm_mq_t mq, uint64_t tagsel))
+{
+    return ((tagsel & mq->hash_tagsel) == mq->hash_tagsel);
+}
+
+/* Whether a wildcard selector stays within one order class */
+PSMI_ALWAYS_INLINE(
+int
+mq_req_is_ordered(psm_mq_t mq, uint64_t tagsel))
+{
+    return (mq->expected_otab != NULL && 
+	    (tagsel & mq->order_mask) == mq->order_mask);
+}
+
+PSMI_ALWAYS_INLINE(
+void
+mq_expected_append(psm_mq_t mq, psm_mq_req_t req))
+{
+    req->seq = mq->expected_seq++;
+    mq->stats.rx_exp_qdepth++;
+    if (mq_req_is_hashed(mq, req->tagsel))
+	mq_sq_append(&mq->expected_htab[mq_hash_tag(mq, req->tag)], req);
+    else if (mq_req_is_ordered(mq, req->tagsel))
+	mq_qq_append(&mq->expected_otab[mq_order_class(mq, req->tag)], req);
+    else {
+	mq_qq_append(&mq->expected_q, req);
+	if (mq->match_backend != MQ_MATCH_LIST)
+	    psmi_mq_soa_append(mq, &mq->expected_soa, req);
+    }
+}
+
+PSMI_ALWAYS_INLINE(
+void
+mq_expected_remove_wildcard(psm_mq_t mq, psm_mq_req_t req))
+{
+    if (mq_req_is_ordered(mq, req->tagsel)) {
+	mq_qq_remove(&mq->expected_otab[mq_order_class(mq, req->tag)], req);
+	req->next = NULL;
+	return;
+    }
+    mq_qq_remove(&mq->expected_q, req);
+    req->next = NULL;
+    if (mq->match_backend != MQ_MATCH_LIST)
+	psmi_mq_soa_remove(mq, &mq->expected_soa, req);
+}
+
+PSMI_ALWAYS_INLINE(
+void
+mq_unexpected_append(psm_mq_t mq, psm_mq_req_t req))
+{
+    struct mqq *q = &mq->unexpected_htab[mq_hash_tag(mq, req->tag)];
+
+    mq_qq_append(&mq->unexpected_q, req);
+    req->hnext = NULL;
+    req->hpprev = q->lastp;
+    *(q->lastp) = req;
+    q->lastp = &req->hnext;
+    if (mq->unexpected_otab != NULL) {
+	q = &mq->unexpected_otab[mq_order_class(mq, req->tag)];
+	req->onext = NULL;
+	req->opprev = q->lastp;
+	*(q->lastp) = req;
+	q->lastp = &req->onext;
+    }
+    if (mq->match_backend != MQ_MATCH_LIST)
+	psmi_mq_soa_append(mq, &mq->unexpected_soa, req);
+
+    if (++mq->stats.rx_unexp_qdepth > mq->stats.rx_unexp_qdepth_max)
+	mq->stats.rx_unexp_qdepth_max = mq->stats.rx_unexp_qdepth;
+}
+
+PSMI_ALWAYS_INLINE(
+void
+mq_unexpected_remove(psm_mq_t mq, psm_mq_req_t req))
+{
+    struct mqq *q = &mq->unexpected_htab[mq_hash_tag(mq, req->tag)];
+
+    mq_qq_remove(&mq->unexpected_q, req);
+    if (req->hnext != NULL)
+	req->hnext->hpprev = req->hpprev;
+    else
+	q->lastp = req->hpprev;
+    *(req->hpprev) = req->hnext;
+    req->next = req->hnext = NULL;
+    if (mq->unexpected_otab != NULL) {
+	q = &mq->unexpected_otab[mq_order_class(mq, req->tag)];
+	if (req->onext != NULL)
+	    req->onext->opprev = req->opprev;
+	else
+	    q->lastp = req->opprev;
+	*(req->opprev) = req->onext;
+	req->onext = NULL;
+    }
+    if (mq->match_backend != MQ_MATCH_LIST)
+	psmi_mq_soa_remove(mq, &mq->unexpected_soa, req);
+
+    mq->stats.rx_unexp_qdepth--;
+}
+
+/* First receive on a wildcard list matching tag, only looking at receives
+ * posted before bound (if any) */
+PSMI_ALWAYS_INLINE(
+psm_mq_req_t
+mq_wildcard_match(struct mqq *q, uint64_t tag, psm_mq_req_t bound, 
+		  uint64_t *nsearch))
+{
+    psm_mq_req_t cur;
+
+    for (cur = q->first; cur != NULL; cur = cur->next) {
+	if (bound != NULL && cur->seq > bound->seq)
+	    return NULL;
+	(*nsearch)++;
+	if (!((tag ^ cur->tag) & cur->tagsel)) /* match! */
+	    break;
+    }
+    return cur;
+}
+
+/*
+ * Find and remove the oldest posted receive matching tag.  The first match in
+ * the tag's bucket is the oldest hashed candidate, so the wildcard lists only
+ * need to be walked up to that candidate's sequence number.  With
+ * PSM_MQ_ORDERMASK_NONE there is no order to honour and any hashed match is
+ * taken without looking at the wildcard lists.
+ */
 PSMI_ALWAYS_INLINE(
 psm_mq_req_t 
-mq_req_match(struct mqsq *q, uint64_t tag, int remove)
+mq_req_match_expected(psm_mq_t mq, uint64_t tag)
 )
 {
-    psm_mq_req_t *curp;
-    psm_mq_req_t cur;
+    struct mqsq *q = &mq->expected_htab[mq_hash_tag(mq, tag)];
+    psm_mq_req_t *curp, *hashp = NULL;
+    psm_mq_req_t cur, hreq = NULL, oreq = NULL;
+    uint64_t nsearch = 0;
 
     for (curp = &q->first; (cur = *curp) != NULL; curp = &cur->next) {
-	if (!((tag ^ cur->tag) & cur->tagsel)) { /* match! */
-	    if (remove) {
-		if ((*curp = cur->next) == NULL) /* fix tail */
-		    q->lastp = curp;
-		cur->next = NULL;
-	    }
-	    return cur;
+	nsearch++;
+	if (!((tag ^ cur->tag) & cur->tagsel)) {
+	    hreq = cur;
+	    hashp = curp;
+	    break;
 	}
     }
-    return NULL; /* no match */
+    if (hreq != NULL && mq->order_mask == PSM_MQ_ORDERMASK_NONE)
+	goto take_hashed;
+
+    if (mq->expected_otab != NULL) {
+	oreq = mq_wildcard_match(&mq->expected_otab[mq_order_class(mq, tag)], 
+				 tag, hreq, &nsearch);
+	if (oreq != NULL)
+	    hreq = NULL; /* older than the hashed candidate */
+    }
+
+    if (mq->match_backend != MQ_MATCH_LIST)
+	cur = psmi_mq_soa_match(mq, &mq->expected_soa, tag, 0, &nsearch);
+    else
+	cur = mq_wildcard_match(&mq->expected_q, tag, 
+				oreq != NULL ? oreq : hreq, &nsearch);
+
+    if (oreq != NULL && (cur == NULL || oreq->seq < cur->seq))
+	cur = oreq;
+
+    if (cur != NULL && (hreq == NULL || cur->seq < hreq->seq)) {
+	mq_expected_remove_wildcard(mq, cur);
+	mq->stats.rx_exp_qdepth--;
+	mq->stats.rx_exp_search_len += nsearch;
+	PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_EXP_SEARCH, nsearch);
+	return cur;
+    }
+
+take_hashed:
+    if (hreq != NULL) {
+	if ((*hashp = hreq->next) == NULL) /* fix tail */
+	    q->lastp = hashp;
+	hreq->next = NULL;
+	mq->stats.rx_exp_qdepth--;
+    }
+    mq->stats.rx_exp_search_len += nsearch;
+    PSMI_MQ_HIST_ADD(mq, PSM_MQ_HIST_EXP_SEARCH, nsearch);
+    return hreq;
 }
 
 /* Default handler */
@@ -387,14 +1010,18 @@ psmi_mq_handle_tiny_envelope(psm_mq_t mq, psm_epaddr_t epaddr,
     int rc;
     psmi_assert(epaddr != NULL);
 
-    req = mq_req_match(&(mq->expected_q), tag, 1);
+    req = mq_req_match_expected(mq, tag);
     if (req) { /* we have a match */
 	req->tag = tag;
+	PSMI_MQ_HIST_MODE(req, MQ_MSG_TINY);
 	msglen = mq_set_msglen(req, req->buf_len, tinylen);
 	PSM_VALGRIND_DEFINE_MQ_RECV(req->buf, req->buf_len, msglen);
-	mq_copy_tiny((uint32_t *)req->buf, (uint32_t *)payload, msglen);
+	if_pf (req->type & MQE_TYPE_IOV)
+	    mq_req_copy_in(req, 0, payload, msglen);
+	else
+	    mq_copy_tiny((uint32_t *)req->buf, (uint32_t *)payload, msglen);
 	req->state = MQ_STATE_COMPLETE;
-	mq_qq_append(&mq->completed_q, req);
+	mq_complete_append(mq, req);
 	mq->stats.rx_user_bytes += msglen;
 	mq->stats.rx_user_num++;
 	_IPATH_VDBG("tiny from=%s match=YES (req=%p) mode=1 mqtag=%llu "
@@ -406,9 +1033,36 @@ psmi_mq_handle_tiny_envelope(psm_mq_t mq, psm_epaddr_t epaddr,
 	rc = psmi_mq_handle_envelope_unexpected(mq, MQ_MSG_TINY, epaddr, tag, 
 		(union psmi_egrid) 0U, tinylen, payload, tinylen);
     }
+    if (rc != MQ_RET_UNEXP_NO_RESOURCES)
+	PSMI_MQ_TRACE(mq, MQ_TRACE_ARRIVAL, MQ_MSG_TINY, tag, 0, tinylen);
     return rc;
 }
 
+/*
+ * Unexpected eager messages that don't fit in max_sysbuf_bytes are refused
+ * with MQ_RET_UNEXP_NO_RESOURCES and held back by the ptl.  The stamp
+ * changes whenever a refused message may have become acceptable (buffers
+ * released, budget raised or a receive posted), so a ptl that has to present
+ * it again can skip retries that would fail.
+ */
+PSMI_ALWAYS_INLINE(
+uint64_t
+psmi_mq_sysbuf_retry_stamp(psm_mq_t mq))
+{
+    return mq->sysbuf_gen + mq->expected_seq;
+}
+
+/* One message is always let in so that a budget smaller than a message can't
+ * stall the receiver, and loopback messages have nowhere to wait. */
+PSMI_ALWAYS_INLINE(
+int
+psmi_mq_sysbuf_admits(psm_mq_t mq, psm_epaddr_t epaddr, uint32_t nbytes))
+{
+    return nbytes == 0 || mq->cur_sysbuf_bytes == 0 ||
+	   mq->cur_sysbuf_bytes + nbytes <= mq->max_sysbuf_bytes ||
+	   epaddr->epid == mq->ep->epid;
+}
+
 PSMI_ALWAYS_INLINE(
 void
 psmi_mq_stats_rts_account(psm_mq_req_t req))
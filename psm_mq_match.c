@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2006-2010. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Structure-of-arrays matching backend.
+ *
+ * The hash index in psm_mq_internal.h takes care of receives that select the
+ * hashed tag bits, but wildcard receives and wildcard probes of the
+ * unexpected queue still have to walk an ordered list, one cache miss per
+ * request.  When enabled, this backend shadows both ordered lists with
+ * contiguous tag (and tagsel) arrays so that the walk becomes a linear scan
+ * that can test several entries per instruction.  The lists remain the
+ * authoritative queues; the arrays only answer "which is the first match".
+ */
+
+/* intrinsics headers must come before psm_user.h bans malloc/free */
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 5)
+#define PSMI_MQ_SOA_X86
+#include <immintrin.h>
+#endif
+
+#include "psm_user.h"
+#include "psm_mq_internal.h"
+
+#define MQ_SOA_INIT_SIZE    1024
+#define MQ_SOA_COMPACT_MIN  64
+
+static uint32_t
+mq_soa_find_scalar(const uint64_t *tags, const uint64_t *tagsels,
+		   uint64_t tag, uint64_t tagsel, uint32_t i, uint32_t end)
+{
+    if (tagsels != NULL) {
+	for (; i < end; i++)
+	    if (!((tag ^ tags[i]) & tagsels[i]))
+		return i;
+    }
+    else {
+	for (; i < end; i++)
+	    if (!((tag ^ tags[i]) & tagsel))
+		return i;
+    }
+    return end;
+}
+
+#ifdef PSMI_MQ_SOA_X86
+__attribute__((target("sse4.1")))
+static uint32_t
+mq_soa_find_sse41(const uint64_t *tags, const uint64_t *tagsels,
+		  uint64_t tag, uint64_t tagsel, uint32_t i, uint32_t end)
+{
+    const __m128i vtag = _mm_set1_epi64x((long long) tag);
+    const __m128i vsel = _mm_set1_epi64x((long long) tagsel);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s0 = vsel, s1 = vsel;
+    int mask;
+
+    for (; i + 4 <= end; i += 4) {
+	__m128i t0 = _mm_loadu_si128((const __m128i *) &tags[i]);
+	__m128i t1 = _mm_loadu_si128((const __m128i *) &tags[i+2]);
+	if (tagsels != NULL) {
+	    s0 = _mm_loadu_si128((const __m128i *) &tagsels[i]);
+	    s1 = _mm_loadu_si128((const __m128i *) &tagsels[i+2]);
+	}
+	t0 = _mm_cmpeq_epi64(_mm_and_si128(_mm_xor_si128(t0, vtag), s0), zero);
+	t1 = _mm_cmpeq_epi64(_mm_and_si128(_mm_xor_si128(t1, vtag), s1), zero);
+	mask = _mm_movemask_pd(_mm_castsi128_pd(t0)) |
+	       (_mm_movemask_pd(_mm_castsi128_pd(t1)) << 2);
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return mq_soa_find_scalar(tags, tagsels, tag, tagsel, i, end);
+}
+
+__attribute__((target("avx2")))
+static uint32_t
+mq_soa_find_avx2(const uint64_t *tags, const uint64_t *tagsels,
+		 uint64_t tag, uint64_t tagsel, uint32_t i, uint32_t end)
+{
+    const __m256i vtag = _mm256_set1_epi64x((long long) tag);
+    const __m256i vsel = _mm256_set1_epi64x((long long) tagsel);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i s0 = vsel, s1 = vsel;
+    int mask;
+
+    for (; i + 8 <= end; i += 8) {
+	__m256i t0 = _mm256_loadu_si256((const __m256i *) &tags[i]);
+	__m256i t1 = _mm256_loadu_si256((const __m256i *) &tags[i+4]);
+	if (tagsels != NULL) {
+	    s0 = _mm256_loadu_si256((const __m256i *) &tagsels[i]);
+	    s1 = _mm256_loadu_si256((const __m256i *) &tagsels[i+4]);
+	}
+	t0 = _mm256_cmpeq_epi64(
+		_mm256_and_si256(_mm256_xor_si256(t0, vtag), s0), zero);
+	t1 = _mm256_cmpeq_epi64(
+		_mm256_and_si256(_mm256_xor_si256(t1, vtag), s1), zero);
+	mask = _mm256_movemask_pd(_mm256_castsi256_pd(t0)) |
+	       (_mm256_movemask_pd(_mm256_castsi256_pd(t1)) << 4);
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return mq_soa_find_scalar(tags, tagsels, tag, tagsel, i, end);
+}
+#endif /* PSMI_MQ_SOA_X86 */
+
+static uint32_t
+mq_soa_select(mq_soa_find_fn_t *fn)
+{
+#ifdef PSMI_MQ_SOA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	*fn = mq_soa_find_avx2;
+	return MQ_MATCH_SOA_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+	*fn = mq_soa_find_sse41;
+	return MQ_MATCH_SOA_SSE41;
+    }
+#endif
+    *fn = mq_soa_find_scalar;
+    return MQ_MATCH_SOA;
+}
+
+static void
+mq_soa_free(struct mqsoa *soa)
+{
+    if (soa->tag != NULL)
+	psmi_free(soa->tag);
+    if (soa->tagsel != NULL)
+	psmi_free(soa->tagsel);
+    if (soa->req != NULL)
+	psmi_free(soa->req);
+    memset(soa, 0, sizeof(*soa));
+}
+
+/* Move the live window to the front of (possibly new) arrays of size slots,
+ * dropping tombstones on the way. */
+static int
+mq_soa_resize(psm_mq_t mq, struct mqsoa *soa, int has_tagsel, uint32_t size)
+{
+    uint64_t *tag, *tagsel = NULL;
+    psm_mq_req_t *req;
+    uint32_t i, j;
+
+    if (size == soa->size) {
+	tag = soa->tag;
+	tagsel = soa->tagsel;
+	req = soa->req;
+    }
+    else {
+	tag = psmi_malloc(mq->ep, UNDEFINED, size * sizeof(uint64_t));
+	req = psmi_malloc(mq->ep, UNDEFINED, size * sizeof(psm_mq_req_t));
+	if (has_tagsel)
+	    tagsel = psmi_malloc(mq->ep, UNDEFINED, size * sizeof(uint64_t));
+	if (tag == NULL || req == NULL || (has_tagsel && tagsel == NULL)) {
+	    if (tag != NULL)
+		psmi_free(tag);
+	    if (req != NULL)
+		psmi_free(req);
+	    if (tagsel != NULL)
+		psmi_free(tagsel);
+	    return -1;
+	}
+    }
+
+    for (i = soa->head, j = 0; i < soa->tail; i++) {
+	if (soa->req[i] == NULL)
+	    continue;
+	tag[j] = soa->tag[i];
+	if (has_tagsel)
+	    tagsel[j] = soa->tagsel[i];
+	req[j] = soa->req[i];
+	req[j]->soa_idx = j;
+	j++;
+    }
+
+    if (tag != soa->tag) {
+	if (soa->tag != NULL)
+	    psmi_free(soa->tag);
+	if (soa->tagsel != NULL)
+	    psmi_free(soa->tagsel);
+	if (soa->req != NULL)
+	    psmi_free(soa->req);
+	soa->tag = tag;
+	soa->tagsel = tagsel;
+	soa->req = req;
+	soa->size = size;
+    }
+    soa->head = 0;
+    soa->tail = j;
+    soa->ndead = 0;
+    return 0;
+}
+
+void __recvpath
+psmi_mq_soa_append(psm_mq_t mq, struct mqsoa *soa, psm_mq_req_t req)
+{
+    uint32_t idx;
+
+    if_pf (soa->tail == soa->size) {
+	uint32_t live = soa->tail - soa->head - soa->ndead;
+	uint32_t size = soa->size;
+	if (live >= size / 2)
+	    size *= 2;
+	if (mq_soa_resize(mq, soa, soa->tagsel != NULL, size)) {
+	    /* The lists are complete on their own, so running out of memory
+	     * only costs us the faster scans. */
+	    _IPATH_INFO("Out of memory growing SoA match arrays to %u entries, "
+			"reverting to list matching\n", size);
+	    psmi_mq_soa_enable(mq, 0);
+	    return;
+	}
+    }
+
+    idx = soa->tail++;
+    soa->tag[idx] = req->tag;
+    if (soa->tagsel != NULL)
+	soa->tagsel[idx] = req->tagsel;
+    soa->req[idx] = req;
+    req->soa_idx = idx;
+}
+
+void __recvpath
+psmi_mq_soa_remove(psm_mq_t mq, struct mqsoa *soa, psm_mq_req_t req)
+{
+    uint32_t idx = req->soa_idx;
+
+    psmi_assert(idx < soa->tail && soa->req[idx] == req);
+
+    /* Tombstone: the entry may still be reported as a candidate by a scan
+     * but is rejected on its NULL req.  Inverting the tag makes that rare. */
+    soa->req[idx] = NULL;
+    soa->tag[idx] = ~soa->tag[idx];
+    if (soa->tagsel != NULL)
+	soa->tagsel[idx] = ~0ULL;
+
+    if (idx == soa->head) {
+	soa->head++;
+	while (soa->head < soa->tail && soa->req[soa->head] == NULL) {
+	    soa->head++;
+	    soa->ndead--;
+	}
+	if (soa->head == soa->tail)
+	    soa->head = soa->tail = 0;
+    }
+    else if (++soa->ndead >= MQ_SOA_COMPACT_MIN &&
+	     soa->ndead * 2 >= soa->tail - soa->head)
+	mq_soa_resize(mq, soa, soa->tagsel != NULL, soa->size);
+}
+
+/*
+ * Return the first live entry matching tag.  For the expected queue each
+ * entry carries its own tagsel; for the unexpected queue tagsel is the
+ * probe's.
+ */
+psm_mq_req_t __recvpath
+psmi_mq_soa_match(psm_mq_t mq, struct mqsoa *soa, uint64_t tag,
+		  uint64_t tagsel, uint64_t *nsearch)
+{
+    uint32_t i = soa->head;
+    uint32_t end = soa->tail;
+
+    while ((i = mq->soa_find(soa->tag, soa->tagsel, tag, tagsel, i, end)) 
+	    < end) 
+    {
+	if (soa->req[i] != NULL) {
+	    *nsearch += i - soa->head + 1;
+	    return soa->req[i];
+	}
+	i++;
+    }
+    *nsearch += end - soa->head;
+    return NULL;
+}
+
+psm_error_t
+psmi_mq_soa_enable(psm_mq_t mq, int enable)
+{
+    psm_mq_req_t req;
+
+    mq->match_backend = MQ_MATCH_LIST;
+    mq_soa_free(&mq->expected_soa);
+    mq_soa_free(&mq->unexpected_soa);
+    if (!enable)
+	return PSM_OK;
+
+    if (mq_soa_resize(mq, &mq->expected_soa, 1, MQ_SOA_INIT_SIZE) ||
+	mq_soa_resize(mq, &mq->unexpected_soa, 0, MQ_SOA_INIT_SIZE)) 
+    {
+	mq_soa_free(&mq->expected_soa);
+	mq_soa_free(&mq->unexpected_soa);
+	return psmi_handle_error(mq->ep, PSM_NO_MEMORY,
+		"Couldn't allocate memory for SoA match arrays");
+    }
+    mq->match_backend = mq_soa_select(&mq->soa_find);
+
+    /* Seed the arrays with whatever is already queued */
+    for (req = mq->expected_q.first; req != NULL &&
+	 mq->match_backend != MQ_MATCH_LIST; req = req->next)
+	psmi_mq_soa_append(mq, &mq->expected_soa, req);
+    for (req = mq->unexpected_q.first; req != NULL &&
+	 mq->match_backend != MQ_MATCH_LIST; req = req->next)
+	psmi_mq_soa_append(mq, &mq->unexpected_soa, req);
+
+    _IPATH_VDBG("SoA matching enabled, backend=%u\n", mq->match_backend);
+    return PSM_OK;
+}
@@ -43,8 +43,13 @@ psmi_mq_req_copy(psm_mq_req_t req, psm_epaddr_t epaddr, const void *buf,
     uint32_t msglen_this = min(msglen_left, nbytes);
     uint8_t *msgptr = (uint8_t *)req->buf + req->recv_msgoff;
     
-    VALGRIND_MAKE_MEM_DEFINED(msgptr, msglen_this);
-    psmi_mq_mtucpy(msgptr, buf, msglen_this);
+    if_pf (req->type & MQE_TYPE_IOV)
+	psmi_mq_iov_scatter(req->iov, req->iovcnt, req->recv_msgoff, buf, 
+			    msglen_this);
+    else {
+	VALGRIND_MAKE_MEM_DEFINED(msgptr, msglen_this);
+	psmi_mq_mtucpy(msgptr, buf, msglen_this);
+    }
     
     req->recv_msgoff += msglen_this;
     req->send_msgoff += nbytes;
@@ -88,7 +93,7 @@ psmi_mq_handle_data(psm_mq_req_t req, psm_epaddr_t epaddr,
 #endif
 	if (req->state == MQ_STATE_MATCHED) {
 	    req->state = MQ_STATE_COMPLETE;
-	    mq_qq_append(&mq->completed_q, req);
+	    mq_complete_append(mq, req);
 	}
 	else { /* MQ_STATE_UNEXP */
 	    req->state = MQ_STATE_COMPLETE;
@@ -112,17 +117,22 @@ psmi_mq_handle_rts(psm_mq_t mq, uint64_t tag,
     int rc;
 
     PSMI_PLOCK_ASSERT();
+    PSMI_MQ_TRACE(mq, MQ_TRACE_RTS, 0, tag, 0, send_msglen);
 
-    req = mq_req_match(&(mq->expected_q), tag, 1);
+    req = mq_req_match_expected(mq, tag);
 
     if (req) { /* we have a match, no need to callback */
 	msglen = mq_set_msglen(req, req->buf_len, send_msglen);
-	req->type = MQE_TYPE_RECV;
+	req->type = MQE_TYPE_RECV | 
+	    (req->type & (MQE_TYPE_CALLBACK | MQE_TYPE_IOV));
 	req->state = MQ_STATE_MATCHED;
 	req->tag = tag;
 	req->recv_msgoff = 0;
 	req->rts_peer = peer;
 	req->rts_sbuf = send_buf;
+	PSMI_MQ_HIST_RNDV(req);
+	if_pf (req->type & MQE_TYPE_IOV) /* transports want one buffer */
+	    req->buf = psmi_mq_iov_stage_recv(mq, req, msglen);
 	*req_o = req; /* yes match */
 	rc = MQ_RET_MATCH_OK;
     }
@@ -140,7 +150,8 @@ psmi_mq_handle_rts(psm_mq_t mq, uint64_t tag,
 	req->recv_msgoff = 0;
 	req->rts_peer = peer;
 	req->rts_sbuf = send_buf;
-	mq_sq_append(&mq->unexpected_q, req);
+	PSMI_MQ_HIST_RNDV(req);
+	mq_unexpected_append(mq, req);
 	*req_o = req; /* no match, will callback */
 	rc = MQ_RET_UNEXP_OK;
     }
@@ -159,8 +170,14 @@ psmi_mq_handle_rts_complete(psm_mq_req_t req)
 
     /* Stats on rendez-vous messages */
     psmi_mq_stats_rts_account(req);
+    if_pf (req->type & MQE_TYPE_IOV && req->stage_buf != NULL) {
+	psmi_mq_iov_scatter(req->iov, req->iovcnt, 0, req->stage_buf, 
+			    req->recv_msglen);
+	psmi_free(req->stage_buf);
+	req->buf = req->stage_buf = NULL;
+    }
     req->state = MQ_STATE_COMPLETE;
-    mq_qq_append(&mq->completed_q, req);
+    mq_complete_append(mq, req);
 #ifdef PSM_VALGRIND
     if (MQE_TYPE_IS_RECV(req->type))
 	PSM_VALGRIND_DEFINE_MQ_RECV(req->buf, req->buf_len, req->recv_msglen);
@@ -172,6 +189,48 @@ psmi_mq_handle_rts_complete(psm_mq_req_t req)
     return;
 }
 
+/*
+ * A sender cancels a rendezvous send.  Dequeue its RTS if no receive has
+ * matched it yet; is_sender tells whether an RTS from peer belongs to the
+ * cancelled send, as identified by the ptl.  Returns the dequeued request
+ * for the ptl to release, or NULL if the RTS has already been matched.
+ */
+psm_mq_req_t
+psmi_mq_handle_rts_cancel(psm_mq_t mq, uint64_t tag, psm_epaddr_t peer,
+			  mq_rts_sender_fn_t is_sender, uintptr_t sender)
+{
+    psm_mq_req_t req;
+
+    PSMI_PLOCK_ASSERT();
+
+    for (req = mq->unexpected_htab[mq_hash_tag(mq, tag)].first; 
+	 req != NULL; req = req->hnext) {
+	if (req->state == MQ_STATE_UNEXP_RV && req->tag == tag &&
+	    req->rts_peer == peer && is_sender(req, sender))
+	    break;
+    }
+    if (req != NULL)
+	mq_unexpected_remove(mq, req);
+
+    _IPATH_VDBG("from=%s mqtag=%" PRIx64" cancelled=%s (req=%p)\n",
+		psmi_epaddr_get_name(peer->epid), tag, 
+		req != NULL ? "YES" : "NO", req);
+    return req;
+}
+
+/* The receiver answered a cancel, a send that wasn't cancelled proceeds */
+void
+psmi_mq_handle_send_cancel(psm_mq_req_t req, int cancelled)
+{
+    req->type &= ~MQE_TYPE_CANCELLING;
+    if (cancelled) {
+	req->type |= MQE_TYPE_CANCELLED;
+	req->recv_msglen = 0;
+	req->state = MQ_STATE_COMPLETE;
+	mq_complete_append(req->mq, req);
+    }
+}
+
 /* Not exposed in public psm, but may extend parts of PSM 2.1 to support
  * this feature before 2.3 */
 psm_mq_unexpected_callback_fn_t
@@ -201,10 +260,25 @@ psmi_mq_handle_envelope_unexpected(
 	mq->unexpected_callback(mq,mode,epaddr,tag,send_msglen,payload,paylen);
 	return MQ_RET_UNEXP_OK;
     }
+
+    /* Over budget, the ptl leaves the message with its sender and presents
+     * it again later.  Nothing is allocated before this check so that the
+     * retry finds the MQ in the same state. */
+    if_pf (!psmi_mq_sysbuf_admits(mq, epaddr, send_msglen)) {
+	_IPATH_VDBG("from=%s mqtag=%" PRIx64 " len=%d exceeds limit of %llu "
+		    "sysbuf_bytes (%llu in use)\n", 
+		    psmi_epaddr_get_name(epaddr->epid), tag, send_msglen, 
+		    (unsigned long long) mq->max_sysbuf_bytes,
+		    (unsigned long long) mq->cur_sysbuf_bytes);
+	mq->stats.rx_unexp_deferred++;
+	return MQ_RET_UNEXP_NO_RESOURCES;
+    }
+
     req = psmi_mq_req_alloc(mq, MQE_TYPE_RECV);
     psmi_assert(req != NULL);
 
     req->tag = tag;
+    PSMI_MQ_HIST_MODE(req, mode);
     req->recv_msgoff = 0;
     req->recv_msglen = req->send_msglen = req->buf_len = msglen = send_msglen;
 
@@ -212,13 +286,6 @@ psmi_mq_handle_envelope_unexpected(
 		"from=%s match=NO (req=%p) mode=%x mqtag=%" PRIx64
 		" send_msglen=%d\n", psmi_epaddr_get_name(epaddr->epid), 
 		req, mode, tag, send_msglen);
-#if 0
-    if (mq->cur_sysbuf_bytes+msglen > mq->max_sysbuf_bytes) {
-		_IPATH_VDBG("req=%p with len=%d exceeds limit of %llu sysbuf_bytes\n",
-			req, msglen, (unsigned long long) mq->max_sysbuf_bytes);
-		return MQ_RET_UNEXP_NO_RESOURCES;
-    }
-#endif
     switch (mode) {
 	case MQ_MSG_TINY:
 	    if (msglen > 0) {
@@ -252,13 +319,61 @@ psmi_mq_handle_envelope_unexpected(
 	    psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
 			    "Internal error, unknown packet 0x%x", mode);
     }
-    mq_sq_append(&mq->unexpected_q, req);
+    mq_unexpected_append(mq, req);
     mq->stats.rx_sys_bytes += msglen;
     mq->stats.rx_sys_num++;
 
     return MQ_RET_UNEXP_OK;
 }
 
+/*
+ * An aggregated message is accepted whole or refused whole, since the ptl can
+ * only leave it with the sender as one unit.  Its records are charged to the
+ * unexpected budget as if none of them matched.
+ */
+int __recvpath
+psmi_mq_handle_batch(psm_mq_t mq, psm_epaddr_t epaddr, 
+		     const void *payload, uint32_t paylen)
+{
+    const uint8_t *p = (const uint8_t *) payload;
+    const struct mq_batch_rec *rec;
+    uint64_t max_sysbuf_bytes;
+    uint32_t off, nbytes = 0;
+
+    for (off = 0; off + sizeof(*rec) <= paylen; 
+	 off += MQ_BATCH_RECLEN(rec->len)) {
+	rec = (const struct mq_batch_rec *) (p + off);
+	nbytes += rec->len;
+    }
+    psmi_assert(off == paylen);
+
+    if_pf (!psmi_mq_sysbuf_admits(mq, epaddr, nbytes)) {
+	_IPATH_VDBG("from=%s batch of %d bytes exceeds limit of %llu "
+		    "sysbuf_bytes (%llu in use)\n", 
+		    psmi_epaddr_get_name(epaddr->epid), nbytes,
+		    (unsigned long long) mq->max_sysbuf_bytes,
+		    (unsigned long long) mq->cur_sysbuf_bytes);
+	mq->stats.rx_unexp_deferred++;
+	return MQ_RET_UNEXP_NO_RESOURCES;
+    }
+
+    max_sysbuf_bytes = mq->max_sysbuf_bytes;
+    mq->max_sysbuf_bytes = ~(0ULL);
+    for (off = 0; off < paylen; off += MQ_BATCH_RECLEN(rec->len)) {
+	rec = (const struct mq_batch_rec *) (p + off);
+	if (rec->len <= 8)
+	    psmi_mq_handle_tiny_envelope(mq, epaddr, rec->tag, rec + 1, 
+					 rec->len);
+	else
+	    psmi_mq_handle_envelope(mq, MQ_MSG_SHORT, epaddr, rec->tag, 
+				    (union psmi_egrid) 0U, rec->len, rec + 1, 
+				    rec->len);
+    }
+    mq->max_sysbuf_bytes = max_sysbuf_bytes;
+
+    return MQ_RET_UNEXP_OK;
+}
+
 /* 
  * This handles the regular (i.e. non-rendezvous MPI envelopes) 
  */
@@ -273,11 +388,12 @@ psmi_mq_handle_envelope(psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 
     psmi_assert(epaddr != NULL);
 
-    req = mq_req_match(&(mq->expected_q), tag, 1);
+    req = mq_req_match_expected(mq, tag);
 
     if (req) { /* we have a match */
 	psmi_assert(MQE_TYPE_IS_RECV(req->type));
 	req->tag = tag;
+	PSMI_MQ_HIST_MODE(req, mode);
 	msglen = mq_set_msglen(req, req->buf_len, send_msglen);
 
 	_IPATH_VDBG("from=%s match=YES (req=%p) mode=%x mqtag=%"
@@ -287,16 +403,19 @@ psmi_mq_handle_envelope(psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 	switch(mode) {
 	    case MQ_MSG_TINY:
 		PSM_VALGRIND_DEFINE_MQ_RECV(req->buf, req->buf_len, msglen);
-		mq_copy_tiny((uint32_t *)req->buf, (uint32_t *)payload, msglen);
+		if_pf (req->type & MQE_TYPE_IOV)
+		    mq_req_copy_in(req, 0, payload, msglen);
+		else
+		    mq_copy_tiny((uint32_t *)req->buf, (uint32_t *)payload, msglen);
 		req->state = MQ_STATE_COMPLETE;
-		mq_qq_append(&mq->completed_q, req);
+		mq_complete_append(mq, req);
 		break;
 
 	    case MQ_MSG_SHORT: /* message fits in 1 payload */
 		PSM_VALGRIND_DEFINE_MQ_RECV(req->buf, req->buf_len, msglen);
-		psmi_mq_mtucpy(req->buf, payload, msglen);
+		mq_req_copy_in(req, 0, payload, msglen);
 		req->state = MQ_STATE_COMPLETE;
-		mq_qq_append(&mq->completed_q, req);
+		mq_complete_append(mq, req);
 		break;
 
 	    case MQ_MSG_LONG:
@@ -319,12 +438,16 @@ psmi_mq_handle_envelope(psm_mq_t mq, uint16_t mode, psm_epaddr_t epaddr,
 	mq->stats.rx_user_num++;
 
 	rc = MQ_RET_MATCH_OK;
+	PSMI_MQ_TRACE(mq, MQ_TRACE_ARRIVAL, mode, tag, 0, send_msglen);
 	if (mode == MQ_MSG_LONG)
 	    return rc;
     }
-    else
+    else {
 	rc =  psmi_mq_handle_envelope_unexpected(mq, mode, epaddr, tag,
 		    egrid, send_msglen, payload, paylen);
+	if (rc != MQ_RET_UNEXP_NO_RESOURCES)
+	    PSMI_MQ_TRACE(mq, MQ_TRACE_ARRIVAL, mode, tag, 0, send_msglen);
+    }
 
     return rc;
 }
@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2006-2010. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * MQ traces and their replay.
+ *
+ * A library built with PSM_MQ_TRACE=1 writes the receives, probes and
+ * arrivals seen by each MQ to PSM_MQ_TRACE_FILE.<pid>, one event per line:
+ *
+ *     <event> <mode> <tag> <tagsel> <length>
+ *
+ * with the events defined as MQ_TRACE_* in psm_mq_internal.h.  Running any
+ * PSM program with PSM_MQ_REPLAY=<trace> replays the trace in psm_init
+ * against a private MQ with no endpoint behind it, so that only matching and
+ * the unexpected buffer allocator are measured.  Eager arrivals come with
+ * their whole payload, long ones included, and rendezvous requests complete
+ * as soon as they are matched.  The time spent on each kind of event and the
+ * distribution of queue depths are reported, the trace can be replayed
+ * PSM_MQ_REPLAY_ITERS times in a row.
+ */
+
+#include "psm_user.h"
+#include "psm_mq_internal.h"
+
+#ifdef PSM_MQ_TRACE
+void
+psmi_mq_trace_init(psm_mq_t mq)
+{
+    union psmi_envvar_val env_trace;
+    char path[PATH_MAX];
+
+    psmi_getenv("PSM_MQ_TRACE_FILE",
+		"Record MQ receives and arrivals to <file>.<pid> (empty for "
+		"no trace)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) "", &env_trace);
+    if (env_trace.e_str == NULL || *env_trace.e_str == '\0')
+	return;
+
+    snprintf(path, sizeof path, "%s.%d", env_trace.e_str, (int) getpid());
+    mq->trace_fp = fopen(path, "w");
+    if (mq->trace_fp == NULL)
+	_IPATH_INFO("Couldn't open MQ trace file %s: %s\n", path, 
+		    strerror(errno));
+    else
+	_IPATH_VDBG("Tracing MQ to %s\n", path);
+}
+
+void
+psmi_mq_trace_fini(psm_mq_t mq)
+{
+    if (mq->trace_fp != NULL) {
+	fclose(mq->trace_fp);
+	mq->trace_fp = NULL;
+    }
+}
+
+void
+psmi_mq_trace_record(psm_mq_t mq, int ev, uint16_t mode, uint64_t tag, 
+		     uint64_t tagsel, uint32_t len)
+{
+    fprintf(mq->trace_fp, "%c %u %" PRIx64 " %" PRIx64 " %u\n", ev, 
+	    (unsigned) mode, tag, tagsel, len);
+}
+#endif
+
+struct mq_trace_ev {
+    uint64_t	tag;
+    uint64_t	tagsel;
+    uint32_t	len;
+    uint16_t	mode;
+    char	ev;
+};
+
+enum mq_replay_op {
+    MQ_REPLAY_POST = 0,
+    MQ_REPLAY_PROBE,
+    MQ_REPLAY_MPROBE,
+    MQ_REPLAY_ARRIVAL_EXP,
+    MQ_REPLAY_ARRIVAL_UNEXP,
+    MQ_REPLAY_RTS_EXP,
+    MQ_REPLAY_RTS_UNEXP,
+    MQ_REPLAY_NUM_OPS
+};
+
+static const char *mq_replay_op_names[MQ_REPLAY_NUM_OPS] = {
+    "irecv", "iprobe", "improbe+imrecv", "arrival expected", 
+    "arrival unexpected", "rts expected", "rts unexpected"
+};
+
+struct mq_replay {
+    psm_mq_t	mq;
+    psm_epaddr_t epaddr;
+    void       *sbuf;	    /* payload of every arrival */
+    void       *rbuf;	    /* where every receive lands */
+
+    struct mq_trace_ev **deferred; /* arrivals refused for lack of sysbufs */
+    uint32_t	ndeferred;
+
+    uint64_t	nexp;	    /* posted receives waiting for a message */
+    uint64_t	nunexp;	    /* messages waiting for a receive */
+    uint64_t	deferrals;
+
+    uint64_t	num[MQ_REPLAY_NUM_OPS];
+    uint64_t	cycles[MQ_REPLAY_NUM_OPS];
+    uint64_t	exp_depth[PSM_MQ_HIST_BUCKETS];
+    uint64_t	unexp_depth[PSM_MQ_HIST_BUCKETS];
+};
+
+static
+int
+mq_trace_load(const char *path, struct mq_trace_ev **evo, uint32_t *nevo,
+	      uint32_t *maxleno)
+{
+    struct mq_trace_ev *evs = NULL, *tmp;
+    uint32_t nev = 0, nalloc = 0, maxlen = 8, lineno = 0;
+    unsigned long long tag, tagsel;
+    unsigned mode, len;
+    char line[256], ev;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	_IPATH_INFO("Couldn't open MQ trace %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+	lineno++;
+	if (sscanf(line, "%c %u %llx %llx %u", &ev, &mode, &tag, &tagsel, 
+		   &len) != 5 || strchr("PQMAR", ev) == NULL) {
+	    _IPATH_INFO("Skipping malformed line %u of MQ trace %s\n", 
+			lineno, path);
+	    continue;
+	}
+	if (nev == nalloc) {
+	    nalloc = nalloc ? nalloc * 2 : 4096;
+	    tmp = psmi_malloc(PSMI_EP_NONE, UNDEFINED, nalloc * sizeof(*evs));
+	    if (tmp == NULL) {
+		_IPATH_INFO("Out of memory loading MQ trace %s\n", path);
+		fclose(fp);
+		if (evs != NULL)
+		    psmi_free(evs);
+		return -1;
+	    }
+	    if (evs != NULL) {
+		memcpy(tmp, evs, nev * sizeof(*evs));
+		psmi_free(evs);
+	    }
+	    evs = tmp;
+	}
+	evs[nev].ev = ev;
+	evs[nev].mode = (uint16_t) mode;
+	evs[nev].tag = (uint64_t) tag;
+	evs[nev].tagsel = (uint64_t) tagsel;
+	evs[nev].len = len;
+	maxlen = max(maxlen, len);
+	nev++;
+    }
+    fclose(fp);
+
+    *evo = evs;
+    *nevo = nev;
+    *maxleno = maxlen;
+    return 0;
+}
+
+/* Rendezvous data moves as soon as a receive matches the request */
+static
+psm_error_t
+mq_replay_rts_callback(psm_mq_req_t req, int was_posted)
+{
+    psmi_mq_handle_rts_complete(req);
+    return PSM_OK;
+}
+
+/* Completed receives are freed without being timed, like the application
+ * would test them */
+static
+void
+mq_replay_reap(psm_mq_t mq)
+{
+    psm_mq_req_t req;
+
+    while ((req = mq->completed_q.first) != NULL) {
+	mq_qq_remove(&mq->completed_q, req);
+	psmi_mq_req_free(req);
+    }
+}
+
+static
+int
+mq_replay_arrival(struct mq_replay *rp, struct mq_trace_ev *e)
+{
+    psm_mq_t mq = rp->mq;
+    psm_mq_req_t req;
+    uint64_t t0;
+    int rc, op;
+
+    t0 = get_cycles();
+    if (e->ev == MQ_TRACE_RTS) {
+	rc = psmi_mq_handle_rts(mq, e->tag, (uintptr_t) rp->sbuf, e->len, 
+				rp->epaddr, mq_replay_rts_callback, &req);
+	if (rc == MQ_RET_MATCH_OK)
+	    psmi_mq_handle_rts_complete(req);
+	op = rc == MQ_RET_MATCH_OK ? MQ_REPLAY_RTS_EXP : MQ_REPLAY_RTS_UNEXP;
+    }
+    else if (e->mode == MQ_MSG_TINY) {
+	rc = psmi_mq_handle_tiny_envelope(mq, rp->epaddr, e->tag, rp->sbuf, 
+					  e->len);
+	op = rc == MQ_RET_MATCH_OK ? MQ_REPLAY_ARRIVAL_EXP : 
+				     MQ_REPLAY_ARRIVAL_UNEXP;
+    }
+    else {
+	rc = psmi_mq_handle_envelope(mq, MQ_MSG_SHORT, rp->epaddr, e->tag, 
+				     (union psmi_egrid) 0U, e->len, rp->sbuf, 
+				     e->len);
+	op = rc == MQ_RET_MATCH_OK ? MQ_REPLAY_ARRIVAL_EXP : 
+				     MQ_REPLAY_ARRIVAL_UNEXP;
+    }
+    if (rc == MQ_RET_UNEXP_NO_RESOURCES)
+	return rc;
+
+    rp->cycles[op] += get_cycles() - t0;
+    rp->num[op]++;
+    if (rc == MQ_RET_MATCH_OK)
+	rp->nexp--;
+    else
+	rp->nunexp++;
+    return rc;
+}
+
+/* Refused arrivals are presented again in order once receives have released
+ * system buffers */
+static
+void
+mq_replay_retry(struct mq_replay *rp)
+{
+    uint32_t i;
+
+    for (i = 0; i < rp->ndeferred; i++)
+	if (mq_replay_arrival(rp, rp->deferred[i]) == MQ_RET_UNEXP_NO_RESOURCES)
+	    break;
+    if (i > 0) {
+	memmove(rp->deferred, rp->deferred + i, 
+		(rp->ndeferred - i) * sizeof(*rp->deferred));
+	rp->ndeferred -= i;
+    }
+}
+
+static
+void
+mq_replay_event(struct mq_replay *rp, struct mq_trace_ev *e)
+{
+    psm_mq_t mq = rp->mq;
+    psm_mq_req_t req;
+    uint64_t t0;
+
+    rp->exp_depth[psmi_mq_hist_bucket(rp->nexp)]++;
+    rp->unexp_depth[psmi_mq_hist_bucket(rp->nunexp)]++;
+
+    switch (e->ev) {
+      case MQ_TRACE_POST:
+	t0 = get_cycles();
+	req = psmi_mq_replay_irecv(mq, e->tag, e->tagsel, rp->rbuf, e->len);
+	rp->cycles[MQ_REPLAY_POST] += get_cycles() - t0;
+	rp->num[MQ_REPLAY_POST]++;
+	if (req->state == MQ_STATE_POSTED)
+	    rp->nexp++;
+	else
+	    rp->nunexp--;
+	break;
+
+      case MQ_TRACE_PROBE:
+	t0 = get_cycles();
+	psmi_mq_replay_probe(mq, e->tag, e->tagsel, 0);
+	rp->cycles[MQ_REPLAY_PROBE] += get_cycles() - t0;
+	rp->num[MQ_REPLAY_PROBE]++;
+	break;
+
+      case MQ_TRACE_MPROBE:
+	t0 = get_cycles();
+	req = psmi_mq_replay_probe(mq, e->tag, e->tagsel, 1);
+	if (req != NULL)
+	    psmi_mq_replay_imrecv(mq, req, rp->rbuf, req->send_msglen);
+	rp->cycles[MQ_REPLAY_MPROBE] += get_cycles() - t0;
+	rp->num[MQ_REPLAY_MPROBE]++;
+	if (req != NULL)
+	    rp->nunexp--;
+	break;
+
+      default: /* MQ_TRACE_ARRIVAL, MQ_TRACE_RTS */
+	if (rp->ndeferred > 0 || 
+	    mq_replay_arrival(rp, e) == MQ_RET_UNEXP_NO_RESOURCES) {
+	    rp->deferred[rp->ndeferred++] = e;
+	    rp->deferrals++;
+	}
+	break;
+    }
+
+    mq_replay_reap(mq);
+    if (rp->ndeferred > 0 && e->ev != MQ_TRACE_ARRIVAL && 
+	e->ev != MQ_TRACE_RTS)
+	mq_replay_retry(rp);
+}
+
+static
+void
+mq_replay_report_depth(const char *name, const uint64_t *hist)
+{
+    int b;
+
+    for (b = 0; b < PSM_MQ_HIST_BUCKETS; b++)
+	if (hist[b])
+	    _IPATH_INFO("%s depth %s%llu: %llu\n", name, 
+			b ? "< " : "= ", b ? 1ULL << b : 0ULL,
+			(unsigned long long) hist[b]);
+}
+
+psm_error_t
+psmi_mq_trace_replay(const char *path)
+{
+    union psmi_envvar_val env_iters;
+    struct mq_trace_ev *evs = NULL;
+    struct mq_replay rp;
+    psm_ep_t ep = NULL;
+    psm_error_t err;
+    uint32_t nev, maxlen, i, it;
+    uint64_t ns;
+
+    psmi_getenv("PSM_MQ_REPLAY_ITERS", 
+		"Number of times PSM_MQ_REPLAY replays its trace",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) 1, &env_iters);
+
+    if (mq_trace_load(path, &evs, &nev, &maxlen))
+	return PSM_PARAM_ERR;
+
+    memset(&rp, 0, sizeof rp);
+    ep = (psm_ep_t) psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1, 
+				sizeof(struct psm_ep));
+    rp.epaddr = (psm_epaddr_t) psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1,
+					   sizeof(struct psm_epaddr));
+    rp.sbuf = psmi_calloc(PSMI_EP_NONE, UNDEFINED, 1, maxlen);
+    rp.rbuf = psmi_malloc(PSMI_EP_NONE, UNDEFINED, maxlen);
+    rp.deferred = psmi_malloc(PSMI_EP_NONE, UNDEFINED, 
+			      (nev + 1) * sizeof(*rp.deferred));
+    if (ep == NULL || rp.epaddr == NULL || rp.sbuf == NULL || 
+	rp.rbuf == NULL || rp.deferred == NULL) {
+	err = PSM_NO_MEMORY;
+	goto fail;
+    }
+
+    /* The endpoint is only there for the MQ to look at, arrivals come from
+     * a remote peer so that they are subject to max_sysbuf_bytes */
+    ep->epid = 1;
+    ep->memmode = psmi_parse_memmode();
+    ep->doorbell = &ep->doorbell_local;
+    rp.epaddr->epid = 2;
+    rp.epaddr->ep = ep;
+
+    if ((err = psmi_mq_malloc(ep, &rp.mq)))
+	goto fail;
+    psmi_mq_initialize_defaults(rp.mq);
+#ifdef PSM_MQ_TRACE
+    psmi_mq_trace_fini(rp.mq); /* don't trace the replay */
+#endif
+
+    PSMI_PLOCK();
+    for (it = 0; it < env_iters.e_uint; it++)
+	for (i = 0; i < nev; i++)
+	    mq_replay_event(&rp, &evs[i]);
+    PSMI_PUNLOCK();
+
+    _IPATH_INFO("Replayed %u events from %s %u time(s), %u arrivals "
+		"still deferred, %llu deferrals\n", nev, path, 
+		env_iters.e_uint, rp.ndeferred, 
+		(unsigned long long) rp.deferrals);
+    for (i = 0; i < MQ_REPLAY_NUM_OPS; i++) {
+	if (rp.num[i] == 0)
+	    continue;
+	ns = cycles_to_nanosecs(rp.cycles[i]);
+	_IPATH_INFO("%-20s %10llu ops %10.1f ns/op\n", mq_replay_op_names[i], 
+		    (unsigned long long) rp.num[i], (double) ns / rp.num[i]);
+    }
+    _IPATH_INFO("searched %llu posted receives, %llu unexpected messages\n",
+		(unsigned long long) rp.mq->stats.rx_exp_search_len,
+		(unsigned long long) rp.mq->stats.rx_unexp_search_len);
+    mq_replay_report_depth("expected", rp.exp_depth);
+    mq_replay_report_depth("unexpected", rp.unexp_depth);
+
+    psmi_mq_free(rp.mq);
+    err = PSM_OK;
+
+fail:
+    if (err)
+	_IPATH_INFO("Couldn't replay MQ trace %s: %s\n", path, 
+		    psm_error_get_string(err));
+    if (rp.deferred != NULL)
+	psmi_free(rp.deferred);
+    if (rp.rbuf != NULL)
+	psmi_free(rp.rbuf);
+    if (rp.sbuf != NULL)
+	psmi_free(rp.sbuf);
+    if (rp.epaddr != NULL)
+	psmi_free(rp.epaddr);
+    if (ep != NULL)
+	psmi_free(ep);
+    if (evs != NULL)
+	psmi_free(evs);
+    return err;
+}
@@ -43,11 +43,17 @@
 psm_mq_req_t __sendpath
 psmi_mq_req_alloc(psm_mq_t mq, uint32_t type)
 {
-    psm_mq_req_t req;
+    psm_mq_req_t req, owner = NULL;
 
     psmi_assert(type == MQE_TYPE_RECV || type == MQE_TYPE_SEND);
 
-    if (type == MQE_TYPE_SEND)
+    /* A persistent request being started posts its own request */
+    if_pf (mq->req_reuse != NULL && (mq->req_reuse->type & type)) {
+	req = mq->req_reuse;
+	owner = req->pers_owner;
+	mq->req_reuse = NULL;
+    }
+    else if (type == MQE_TYPE_SEND)
 	req = psmi_mpool_get(mq->sreq_pool);
     else
 	req = psmi_mpool_get(mq->rreq_pool);
@@ -67,6 +73,8 @@ psmi_mq_req_alloc(psm_mq_t mq, uint32_t type)
 	req->testwait_callback = NULL;
 	req->rts_peer = NULL;
 	req->ptl_req_ptr = NULL;
+	req->stage_buf = NULL;
+	req->pers_owner = owner;
 	return req;
     }
     else { /* we're out of reqs */
@@ -104,7 +112,7 @@ psmi_mq_req_init(psm_mq_t mq)
 	    goto fail;
 				    
 	if ((mq->sreq_pool = psmi_mpool_create(sizeof(struct psm_mq_req), 
-				chunksz, maxsz, 0, DESCRIPTORS,
+				chunksz, maxsz, PSMI_MPOOL_ALIGN, DESCRIPTORS,
 				NULL, NULL)) == NULL) 
 	{
 	    err = PSM_NO_MEMORY;
@@ -123,8 +131,8 @@ psmi_mq_req_init(psm_mq_t mq)
 	    goto fail;
 
 	if ((mq->rreq_pool = 
-	    psmi_mpool_create(sizeof(struct psm_mq_req), chunksz, maxsz, 0,
-			      DESCRIPTORS, NULL, NULL)) == NULL) {
+	    psmi_mpool_create(sizeof(struct psm_mq_req), chunksz, maxsz, 
+			      PSMI_MPOOL_ALIGN, DESCRIPTORS, NULL, NULL)) == NULL) {
 	    err = PSM_NO_MEMORY;
 	    goto fail;
 	}
@@ -174,198 +182,526 @@ psmi_mq_sysbuf_free(psm_mq_t mq, void *ptr)
 }
 
 #else
-#define MM_FLAG_NONE  0
-#define MM_FLAG_TRANSIENT  0x1
-#define MM_NUM_OF_POOLS 7
-
-typedef struct _mem_block_ctrl mem_block_ctrl; 
-typedef struct _mem_ctrl mem_ctrl;
-
-struct _mem_ctrl {
-    mem_block_ctrl *free_list;
-    uint32_t total_alloc;
-    uint32_t current_available;
-    uint32_t block_size;
-    uint32_t flags;
-    uint32_t replenishing_rate;
-};
+/*
+ * Per-MQ slab allocator.  Each size class carves its blocks out of
+ * page-aligned chunks obtained with mmap (optionally from hugetlbfs), so that
+ * chunks left entirely free after a burst of unexpected traffic can be
+ * unmapped again.  A block is preceded by a small header that points back to
+ * its chunk while it is handed out and links it on the chunk's free list
+ * otherwise.  Payloads are cache-line aligned.
+ *
+ * Frees never unmap anything themselves: when a class ends up holding more
+ * than free_hiwat free blocks with at least one empty chunk, trimming is
+ * flagged and carried out later from the idle path of psm_mq_ipeek, which
+ * releases empty chunks down to free_lowat.
+ */
+#define MQ_SYSBUF_ALIGN		    64
+#define MQ_SYSBUF_MIN_CLASS	    256
+#define MQ_SYSBUF_CHUNK_MIN_BLOCKS  8
+#define MQ_SYSBUF_CHUNK_DEFAULT	    65536
+#define MQ_SYSBUF_HUGEPAGE_SZ	    (2UL<<20)
 
-struct _mem_block_ctrl {
+struct mqsysbuf_block {
     union {
-        mem_ctrl *mem_handler;
-        mem_block_ctrl *next;
+	struct mqsysbuf_chunk *chunk;	/* handed out, NULL when transient */
+	struct mqsysbuf_block *next;	/* on its chunk's free list */
     };
+    uint32_t nbytes;			/* charged to cur_sysbuf_bytes */
     char _redzone[PSM_VALGRIND_REDZONE_SZ];
 };
 
-static uint32_t block_sizes[] = {256, 512, 1024, 2048, 4096, 8192, (uint32_t)-1};
-static uint32_t replenishing_rate[] = {128, 64, 32, 16, 8, 4, 0};
-static mem_ctrl handler_index[MM_NUM_OF_POOLS];
-static int      mem_ctrl_is_init = 0;
-static uint64_t mem_ctrl_total_bytes = 0;
+struct mqsysbuf_chunk {
+    struct mqsysbuf_chunk  *next;
+    struct mqsysbuf_chunk **pprev;
+    struct mqsysbuf_class  *sbc;
+    struct mqsysbuf_block  *free_list;
+    uint32_t		    nblocks;
+    uint32_t		    nfree;
+    uint32_t		    ncarved;	/* blocks ever handed out of the chunk */
+    uint32_t		    is_huge;
+    size_t		    bytes;	/* mapped length */
+};
+
+/* Offset of the first block header, chosen so that payloads are aligned */
+#define MQ_SYSBUF_FIRST_BLOCK						\
+	(PSMI_ALIGNUP(sizeof(struct mqsysbuf_chunk) +			\
+		      sizeof(struct mqsysbuf_block), MQ_SYSBUF_ALIGN) -	\
+	 sizeof(struct mqsysbuf_block))
+
+PSMI_ALWAYS_INLINE(
+void
+sysbuf_chunk_insert(struct mqsysbuf_chunk **head, struct mqsysbuf_chunk *chunk))
+{
+    chunk->next = *head;
+    chunk->pprev = head;
+    if (*head != NULL)
+	(*head)->pprev = &chunk->next;
+    *head = chunk;
+}
+
+PSMI_ALWAYS_INLINE(
+void
+sysbuf_chunk_remove(struct mqsysbuf_chunk *chunk))
+{
+    *chunk->pprev = chunk->next;
+    if (chunk->next != NULL)
+	chunk->next->pprev = chunk->pprev;
+}
+
+static
+void
+sysbuf_class_setup(psm_mq_t mq, struct mqsysbuf_class *sbc, uint32_t block_size)
+{
+    struct mqsysbuf *sb = &mq->sysbuf;
+    size_t bytes;
+
+    memset(sbc, 0, sizeof(*sbc));
+    sbc->block_size = block_size;
+    sbc->block_stride = PSMI_ALIGNUP(sizeof(struct mqsysbuf_block) + 
+				     block_size + PSM_VALGRIND_REDZONE_SZ,
+				     MQ_SYSBUF_ALIGN);
+
+    bytes = MQ_SYSBUF_FIRST_BLOCK + 
+	    (size_t) MQ_SYSBUF_CHUNK_MIN_BLOCKS * sbc->block_stride;
+    if (bytes < sb->chunk_bytes)
+	bytes = sb->chunk_bytes;
+    sbc->chunk_bytes = PSMI_ALIGNUP(bytes, PSMI_PAGESIZE);
+    sbc->blocks_per_chunk = 
+	(sbc->chunk_bytes - MQ_SYSBUF_FIRST_BLOCK) / sbc->block_stride;
+
+    sbc->free_hiwat = sb->hiwat_chunks * sbc->blocks_per_chunk;
+    sbc->free_lowat = sb->lowat_chunks * sbc->blocks_per_chunk;
+}
+
+static
+struct mqsysbuf_chunk *
+sysbuf_chunk_alloc(psm_mq_t mq, struct mqsysbuf_class *sbc)
+{
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_chunk *chunk;
+    size_t bytes = sbc->chunk_bytes;
+    void *addr = MAP_FAILED;
+    int is_huge = 0;
+
+#ifdef MAP_HUGETLB
+    if (sb->use_hugepages) {
+	size_t hbytes = PSMI_ALIGNUP(bytes, MQ_SYSBUF_HUGEPAGE_SZ);
+	addr = mmap(NULL, hbytes, PROT_READ | PROT_WRITE, 
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED) {
+	    bytes = hbytes;
+	    is_huge = 1;
+	}
+	else {
+	    /* Don't keep retrying on every refill */
+	    _IPATH_VDBG("No hugepages for unexpected buffers (%s), "
+			"using regular pages\n", strerror(errno));
+	    sb->use_hugepages = 0;
+	}
+    }
+#endif
+
+    if (addr == MAP_FAILED) {
+	addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+	    return NULL;
+    }
+
+    chunk = (struct mqsysbuf_chunk *) addr;
+    chunk->sbc = sbc;
+    chunk->free_list = NULL;
+    chunk->nblocks = (bytes - MQ_SYSBUF_FIRST_BLOCK) / sbc->block_stride;
+    chunk->nfree = chunk->nblocks;
+    chunk->ncarved = 0;
+    chunk->is_huge = is_huge;
+    chunk->bytes = bytes;
+    sysbuf_chunk_insert(&sbc->avail, chunk);
+
+    sbc->nchunks++;
+    sbc->nempty++;
+    sbc->nblocks += chunk->nblocks;
+    sbc->nfree += chunk->nblocks;
+    sb->mapped_bytes += bytes;
+    psmi_log_memstats(UNEXPECTED_BUFFERS, bytes);
+
+    return chunk;
+}
+
+static
+void
+sysbuf_chunk_release(psm_mq_t mq, struct mqsysbuf_class *sbc,
+		     struct mqsysbuf_chunk *chunk)
+{
+    size_t bytes = chunk->bytes;
+
+    if (chunk->nfree == chunk->nblocks)
+	sbc->nempty--;
+    sbc->nchunks--;
+    sbc->nblocks -= chunk->nblocks;
+    sbc->nfree -= chunk->nfree;
+    mq->sysbuf.mapped_bytes -= bytes;
+
+    sysbuf_chunk_remove(chunk);
+    munmap(chunk, bytes);
+    psmi_log_memstats(UNEXPECTED_BUFFERS, -((int64_t) bytes));
+}
 
 void psmi_mq_sysbuf_init(psm_mq_t mq)
 {
-    int i;
+    struct mqsysbuf *sb = &mq->sysbuf;
+    union psmi_envvar_val env_classes, env_chunk, env_wmarks, env_huge;
+    int vals[MQ_SYSBUF_MAX_CLASSES];
+    int i, n;
 
-    if (mem_ctrl_is_init)
+    if (sb->is_init)
 	return;
-    mem_ctrl_is_init = 1;
-
-    for (i=0; i < MM_NUM_OF_POOLS; i++) {
-        handler_index[i].block_size = block_sizes[i];
-        handler_index[i].current_available = 0;
-        handler_index[i].free_list = NULL;
-        handler_index[i].total_alloc = 0;
-        handler_index[i].replenishing_rate = replenishing_rate[i];
-
-	if (block_sizes[i] == -1) {
-	    psmi_assert_always(replenishing_rate[i] == 0);
-	    handler_index[i].flags = MM_FLAG_TRANSIENT;
+
+    psmi_getenv("PSM_MQ_SYSBUF_CHUNK", 
+		"Minimum size of the chunks unexpected buffers are carved from",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) MQ_SYSBUF_CHUNK_DEFAULT, &env_chunk);
+    sb->chunk_bytes = env_chunk.e_uint;
+
+    psmi_getenv("PSM_MQ_SYSBUF_HUGEPAGES", 
+		"Back unexpected buffer chunks with hugepages when available",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_YESNO,
+		PSMI_ENVVAR_VAL_NO, &env_huge);
+    sb->use_hugepages = env_huge.e_uint;
+
+    /* Trim a class above hiwat free chunks' worth of blocks, down to lowat */
+    sb->hiwat_chunks = 4;
+    sb->lowat_chunks = 1;
+    if (!psmi_getenv("PSM_MQ_SYSBUF_WATERMARKS", 
+		"Free chunks per buffer class to trim above and down to (hi:lo)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) "4:1", &env_wmarks)) {
+	vals[0] = sb->hiwat_chunks;
+	vals[1] = sb->lowat_chunks;
+	psmi_parse_str_tuples(env_wmarks.e_str, 2, vals);
+	if (vals[0] >= 0 && vals[1] >= 0 && vals[1] <= vals[0]) {
+	    sb->hiwat_chunks = vals[0];
+	    sb->lowat_chunks = vals[1];
 	}
-	else {
-	    psmi_assert_always(replenishing_rate[i] > 0);
-	    handler_index[i].flags = MM_FLAG_NONE;
+	else
+	    _IPATH_INFO("Ignoring PSM_MQ_SYSBUF_WATERMARKS=%s, "
+			"expected hi:lo with lo <= hi\n", env_wmarks.e_str);
+    }
+
+    /* Size classes either come from the environment or double from
+     * MQ_SYSBUF_MIN_CLASS up to the eager thresholds */
+    sb->nclasses = 0;
+    sb->fixed_classes = 0;
+    if (!psmi_getenv("PSM_MQ_SYSBUF_CLASSES", 
+		"Unexpected buffer size classes (colon-separated byte sizes)",
+		PSMI_ENVVAR_LEVEL_HIDDEN, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) "", &env_classes)) {
+	memset(vals, 0, sizeof(vals));
+	n = psmi_parse_str_tuples(env_classes.e_str, MQ_SYSBUF_MAX_CLASSES, 
+				  vals);
+	for (i = 0; i < MQ_SYSBUF_MAX_CLASSES && n > 0; i++) {
+	    if (vals[i] <= 0 || (sb->nclasses > 0 && (uint32_t) vals[i] <= 
+		    sb->class[sb->nclasses-1].block_size))
+		continue;
+	    sysbuf_class_setup(mq, &sb->class[sb->nclasses++], vals[i]);
 	}
+	sb->fixed_classes = (sb->nclasses > 0);
     }
+    if (sb->nclasses == 0) {
+	sysbuf_class_setup(mq, &sb->class[sb->nclasses++], MQ_SYSBUF_MIN_CLASS);
+	sb->is_init = 1;
+	psmi_mq_sysbuf_set_eager_max(mq, 
+	    max(mq->ipath_thresh_rv, mq->shm_thresh_rv));
+    }
+
+    sb->mapped_bytes = 0;
+    sb->transient_num = 0;
+    sb->trim_pending = 0;
+    sb->is_init = 1;
 
     VALGRIND_CREATE_MEMPOOL(mq, PSM_VALGRIND_REDZONE_SZ, 
 				PSM_VALGRIND_MEM_UNDEFINED);
+}
 
-    /* Hit once on each block size so we have a pool that's allocated */
-    for (i=0; i < MM_NUM_OF_POOLS; i++) {
-	void *ptr;
-	if (block_sizes[i] == -1)
-	    continue;
-	ptr = psmi_mq_sysbuf_alloc(mq, block_sizes[i]);
-	psmi_mq_sysbuf_free(mq, ptr);
+/* Extend the default classes when the eager thresholds grow.  Classes are
+ * never removed since buffers from them may still be handed out. */
+void
+psmi_mq_sysbuf_set_eager_max(psm_mq_t mq, uint32_t nbytes)
+{
+    struct mqsysbuf *sb = &mq->sysbuf;
+    uint32_t size;
+
+    if (!sb->is_init || sb->fixed_classes)
+	return;
+
+    size = sb->class[sb->nclasses-1].block_size;
+    while (size < nbytes && sb->nclasses < MQ_SYSBUF_MAX_CLASSES) {
+	size <<= 1;
+	sysbuf_class_setup(mq, &sb->class[sb->nclasses++], size);
     }
 }
 
 void 
-psmi_mq_sysbuf_fini(psm_mq_t mq)  // free all buffers that is currently not used
+psmi_mq_sysbuf_fini(psm_mq_t mq)
 { 
-    mem_block_ctrl *block;
-    int i;
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_class *sbc;
+    uint32_t i;
 
-    if (mem_ctrl_is_init == 0)
+    if (!sb->is_init)
 	return;
 
     VALGRIND_DESTROY_MEMPOOL(mq);
 
-    for (i=0; i < MM_NUM_OF_POOLS; i++) {
-	while ((block = handler_index[i].free_list) != NULL) {
-	    handler_index[i].free_list = block->next;
-	    psmi_free(block);
+    for (i = 0; i < sb->nclasses; i++) {
+	sbc = &sb->class[i];
+	while (sbc->avail != NULL)
+	    sysbuf_chunk_release(mq, sbc, sbc->avail);
+	while (sbc->full != NULL)
+	    sysbuf_chunk_release(mq, sbc, sbc->full);
+    }
+    sb->is_init = 0;
+}
+
+/* Hand empty chunks back to the OS in every class above its high watermark,
+ * keeping at least free_lowat free blocks */
+void
+psmi_mq_sysbuf_trim(psm_mq_t mq)
+{
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_class *sbc;
+    struct mqsysbuf_chunk *chunk, *next;
+    uint32_t i;
+
+    sb->trim_pending = 0;
+    for (i = 0; i < sb->nclasses; i++) {
+	sbc = &sb->class[i];
+	if (sbc->nfree <= sbc->free_hiwat)
+	    continue;
+	for (chunk = sbc->avail; chunk != NULL && sbc->nempty > 0; 
+	     chunk = next) {
+	    next = chunk->next;
+	    if (chunk->nfree == chunk->nblocks &&
+		sbc->nfree - chunk->nfree >= sbc->free_lowat) {
+		sysbuf_chunk_release(mq, sbc, chunk);
+		sbc->ntrimmed++;
+	    }
 	}
     }
-    mem_ctrl_is_init = 0;
 }
 
 void
 psmi_mq_sysbuf_getinfo(psm_mq_t mq, char *buf, size_t len)
 {
-    snprintf(buf, len-1, "Sysbuf consumption: %"PRIu64" bytes\n",
-	    mem_ctrl_total_bytes);
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_class *sbc;
+    size_t off;
+    uint32_t i;
+
+    off = snprintf(buf, len, "Sysbuf consumption: %"PRIu64" bytes in chunks, "
+		   "%u oversized buffers\n", sb->mapped_bytes, sb->transient_num);
+    for (i = 0; i < sb->nclasses && off < len; i++) {
+	sbc = &sb->class[i];
+	off += snprintf(buf + off, len - off, 
+		 "  %7u bytes: %u chunks, %u blocks, %u used, %u free, "
+		 "%"PRIu64" allocs, %"PRIu64" chunks trimmed\n", 
+		 sbc->block_size, sbc->nchunks, sbc->nblocks, 
+		 sbc->nblocks - sbc->nfree, sbc->nfree, 
+		 sbc->nalloc, sbc->ntrimmed);
+    }
     buf[len-1] = '\0';
     return;
 }
 
+static
+void *
+sysbuf_alloc_transient(psm_mq_t mq, uint32_t alloc_size)
+{
+    struct mqsysbuf_block *block;
+
+    block = psmi_malloc(mq->ep, UNEXPECTED_BUFFERS, 
+			sizeof(struct mqsysbuf_block) + alloc_size + 
+			PSM_VALGRIND_REDZONE_SZ);
+    if (block == NULL)
+	return NULL;
+    block->chunk = NULL;
+    block->nbytes = alloc_size;
+    block++;
+    mq->sysbuf.transient_num++;
+    mq->cur_sysbuf_bytes += alloc_size;
+    VALGRIND_MEMPOOL_ALLOC(mq, block, alloc_size);
+    return block;
+}
+
 void * 
 psmi_mq_sysbuf_alloc(psm_mq_t mq, uint32_t alloc_size)
 {
-    mem_ctrl *mm_handler = handler_index;
-    mem_block_ctrl *new_block;
-    int replenishing;
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_class *sbc;
+    struct mqsysbuf_chunk *chunk;
+    struct mqsysbuf_block *block;
+    uint32_t i;
 
-    /* There is a timing race with ips initialization, fix later.
-     * XXX */
-    if (!mem_ctrl_is_init)
+    if_pf (!sb->is_init)
 	psmi_mq_sysbuf_init(mq);
 
     mq->stats.rx_sysbuf_num++;
     mq->stats.rx_sysbuf_bytes += alloc_size;
-    
-    while (mm_handler->block_size < alloc_size) 
-        mm_handler++;
-
-    replenishing = mm_handler->replenishing_rate;
-                          
-    if (mm_handler->current_available == 0) { // allocate more buffers
-        if (mm_handler->flags & MM_FLAG_TRANSIENT) {
-	    uint32_t newsz = alloc_size + sizeof(mem_block_ctrl)
-			     + PSM_VALGRIND_REDZONE_SZ;
-            new_block = psmi_malloc(mq->ep, UNEXPECTED_BUFFERS, newsz);
-
-            if (new_block) {
-		new_block->mem_handler = mm_handler;
-                new_block++;
-                mm_handler->total_alloc++;
-		mem_ctrl_total_bytes += newsz;
-		VALGRIND_MEMPOOL_ALLOC(mq, new_block, alloc_size);
-            }
-            return new_block;
-        }
-
-        do {
-	    uint32_t newsz = mm_handler->block_size + sizeof(mem_block_ctrl) +
-			     PSM_VALGRIND_REDZONE_SZ;
-
-            new_block = psmi_malloc(mq->ep, UNEXPECTED_BUFFERS, newsz);
-	    mem_ctrl_total_bytes += newsz;
-
-            if (new_block) {
-                mm_handler->current_available++;
-                mm_handler->total_alloc++;
-
-                new_block->next = mm_handler->free_list;
-                mm_handler->free_list = new_block;
-            }
-            
-        } while (--replenishing && new_block);
-    }
-
-    if (mm_handler->current_available) {
-        mm_handler->current_available--;
-
-       new_block = mm_handler->free_list;
-       mm_handler->free_list = new_block->next;
 
-       new_block->mem_handler = mm_handler;
-       new_block++;
+    for (i = 0; i < sb->nclasses; i++)
+	if (sb->class[i].block_size >= alloc_size)
+	    break;
+    if_pf (i == sb->nclasses)
+	return sysbuf_alloc_transient(mq, alloc_size);
+    sbc = &sb->class[i];
 
-       VALGRIND_MEMPOOL_ALLOC(mq, new_block, mm_handler->block_size);
-       return new_block;
+    if_pf ((chunk = sbc->avail) == NULL) {
+	if ((chunk = sysbuf_chunk_alloc(mq, sbc)) == NULL)
+	    return NULL;
     }
 
-    return NULL;
+    if (chunk->free_list != NULL) {
+	block = chunk->free_list;
+	chunk->free_list = block->next;
+    }
+    else /* first use of this block, pages are touched lazily */
+	block = (struct mqsysbuf_block *) ((uintptr_t) chunk + 
+		 MQ_SYSBUF_FIRST_BLOCK + 
+		 (size_t) chunk->ncarved++ * sbc->block_stride);
+
+    if (chunk->nfree == chunk->nblocks)
+	sbc->nempty--;
+    if (--chunk->nfree == 0) {
+	sysbuf_chunk_remove(chunk);
+	sysbuf_chunk_insert(&sbc->full, chunk);
+    }
+    sbc->nfree--;
+    sbc->nalloc++;
+
+    block->chunk = chunk;
+    block->nbytes = sbc->block_size;
+    block++;
+    mq->cur_sysbuf_bytes += sbc->block_size;
+    VALGRIND_MEMPOOL_ALLOC(mq, block, sbc->block_size);
+    return block;
 }       
 
 void psmi_mq_sysbuf_free(psm_mq_t mq, void * mem_to_free)
 {
-    mem_block_ctrl * block_to_free;
-    mem_ctrl *mm_handler;
+    struct mqsysbuf *sb = &mq->sysbuf;
+    struct mqsysbuf_block *block;
+    struct mqsysbuf_chunk *chunk;
+    struct mqsysbuf_class *sbc;
+
+    psmi_assert_always(sb->is_init);
 
-    psmi_assert_always(mem_ctrl_is_init);
+    block = (struct mqsysbuf_block *) mem_to_free - 1;
+    chunk = block->chunk;
 
-    block_to_free = (mem_block_ctrl *)mem_to_free - 1;
-    mm_handler = block_to_free->mem_handler;
+    /* Room in the budget, messages that were pushed back may fit now */
+    mq->cur_sysbuf_bytes -= block->nbytes;
+    mq->sysbuf_gen++;
 
     VALGRIND_MEMPOOL_FREE(mq, mem_to_free);
 
-    if (mm_handler->flags & MM_FLAG_TRANSIENT) {
-        psmi_free(block_to_free);
-    } else {
-        block_to_free->next = mm_handler->free_list;
-        mm_handler->free_list = block_to_free;
+    if_pf (chunk == NULL) {
+	sb->transient_num--;
+	psmi_free(block);
+	return;
+    }
 
-        mm_handler->current_available++;
+    sbc = chunk->sbc;
+    block->next = chunk->free_list;
+    chunk->free_list = block;
+    if (chunk->nfree++ == 0) {
+	sysbuf_chunk_remove(chunk);
+	sysbuf_chunk_insert(&sbc->avail, chunk);
+    }
+    sbc->nfree++;
+
+    if (chunk->nfree == chunk->nblocks) {
+	sbc->nempty++;
+	if (sbc->nfree > sbc->free_hiwat)
+	    sb->trim_pending = 1;
     }
 
     return;
 }
 #endif
 
+/*
+ * iovec sends and receives.  Eager data is copied straight between the
+ * iovecs and packet payloads; transports that need a contiguous buffer get a
+ * staging sysbuf instead.
+ */
+void
+psmi_mq_iov_scatter(const struct iovec *iov, uint32_t iovcnt, uint32_t off, 
+		    const void *src, uint32_t nbytes)
+{
+    const uint8_t *s = (const uint8_t *) src;
+    uint32_t i, n;
+
+    for (i = 0; i < iovcnt && off >= iov[i].iov_len; i++)
+	off -= iov[i].iov_len;
+    for (; i < iovcnt && nbytes > 0; i++, off = 0) {
+	n = min(nbytes, (uint32_t) iov[i].iov_len - off);
+	psmi_mq_mtucpy((uint8_t *) iov[i].iov_base + off, s, n);
+	s += n;
+	nbytes -= n;
+    }
+}
+
+void
+psmi_mq_iov_gather(void *dst, const struct iovec *iov, uint32_t iovcnt, 
+		   uint32_t off, uint32_t nbytes)
+{
+    uint8_t *d = (uint8_t *) dst;
+    uint32_t i, n;
+
+    for (i = 0; i < iovcnt && off >= iov[i].iov_len; i++)
+	off -= iov[i].iov_len;
+    for (; i < iovcnt && nbytes > 0; i++, off = 0) {
+	n = min(nbytes, (uint32_t) iov[i].iov_len - off);
+	psmi_mq_mtucpy(d, (const uint8_t *) iov[i].iov_base + off, n);
+	d += n;
+	nbytes -= n;
+    }
+}
+
+/*
+ * Staging buffers are not unexpected data, they come from the heap and stay
+ * out of the sysbuf budget.  A staged buffer is always released with
+ * psmi_free.
+ */
+void *
+psmi_mq_iov_stage(psm_mq_t mq, const struct iovec *iov, uint32_t iovcnt, 
+		  uint32_t nbytes)
+{
+    void *buf = psmi_malloc(mq->ep, UNDEFINED, nbytes ? nbytes : 1);
+    if (buf == NULL)
+	psmi_handle_error(PSMI_EP_NORETURN, PSM_NO_MEMORY,
+	    "Couldn't allocate %u bytes to stage an iovec message", nbytes);
+    psmi_mq_iov_gather(buf, iov, iovcnt, 0, nbytes);
+    return buf;
+}
+
+/* Rendezvous receives into iovecs land in one contiguous buffer, scattered
+ * at completion.  If there's no memory for it the request is failed and
+ * receives no data, which the transports handle like any truncation. */
+void *
+psmi_mq_iov_stage_recv(psm_mq_t mq, psm_mq_req_t req, uint32_t nbytes)
+{
+    void *buf = NULL;
+
+    if (nbytes > 0 &&
+	(buf = psmi_malloc(mq->ep, UNDEFINED, nbytes)) == NULL) {
+	req->recv_msglen = 0;
+	req->error_code = PSM_NO_MEMORY;
+    }
+    req->stage_buf = buf;
+    return buf;
+}
+
 /*
  * Hooks to plug into QLogic MPI stats
  */
@@ -393,6 +729,85 @@ void psmi_mq_stats_callback(struct mpspawn_stats_req_args *args)
     entry[7] = mqstats.rx_sys_bytes;
 }
 
+#ifdef PSM_MQ_HISTOGRAMS
+/* Histograms are summarized by their median and 99th percentile, reported as
+ * the upper bound of the bucket where each falls */
+static
+uint64_t
+psmi_mq_hist_percentile(const uint64_t *buckets, int pct)
+{
+    uint64_t total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < PSM_MQ_HIST_BUCKETS; i++)
+	total += buckets[i];
+    if (total == 0)
+	return 0;
+    for (i = 0; i < PSM_MQ_HIST_BUCKETS - 1; i++) {
+	sum += buckets[i];
+	if (sum * 100 >= total * pct)
+	    break;
+    }
+    return i ? (1ULL << i) - 1 : 0;
+}
+
+static
+void psmi_mq_hist_stats_callback(struct mpspawn_stats_req_args *args)
+{
+    uint64_t *entry = args->stats;
+    psm_mq_t mq = (psm_mq_t) args->context;
+    int i;
+
+    if (args->num < 2 * PSM_MQ_NUM_HISTS)
+        return;
+
+    for (i = 0; i < PSM_MQ_NUM_HISTS; i++) {
+	entry[2*i]   = psmi_mq_hist_percentile(mq->hist[i], 50);
+	entry[2*i+1] = psmi_mq_hist_percentile(mq->hist[i], 99);
+    }
+}
+
+static
+void
+psmi_mq_hist_stats_register(psm_mq_t mq, mpspawn_stats_add_fn add_fn)
+{
+    char *desc[2 * PSM_MQ_NUM_HISTS];
+    uint16_t flags[2 * PSM_MQ_NUM_HISTS];
+    int i;
+    struct mpspawn_stats_add_args mp_add;
+
+    for (i = 0; i < 2 * PSM_MQ_NUM_HISTS; i++)
+        flags[i] = MPSPAWN_STATS_REDUCTION_ALL;
+
+    desc[0]  = "Send bytes, median";
+    desc[1]  = "Send bytes, 99th pct";
+    desc[2]  = "Recv bytes, median";
+    desc[3]  = "Recv bytes, 99th pct";
+    desc[4]  = "Tiny recv ns, median";
+    desc[5]  = "Tiny recv ns, 99th pct";
+    desc[6]  = "Short recv ns, median";
+    desc[7]  = "Short recv ns, 99th pct";
+    desc[8]  = "Eager long recv ns, median";
+    desc[9]  = "Eager long recv ns, 99th pct";
+    desc[10] = "Rendezvous recv ns, median";
+    desc[11] = "Rendezvous recv ns, 99th pct";
+    desc[12] = "Expected search, median";
+    desc[13] = "Expected search, 99th pct";
+    desc[14] = "Unexpect search, median";
+    desc[15] = "Unexpect search, 99th pct";
+
+    mp_add.version = MPSPAWN_STATS_VERSION;
+    mp_add.num = 2 * PSM_MQ_NUM_HISTS;
+    mp_add.header = "MPI Histogram Summary (max,min @ rank)";
+    mp_add.req_fn = psmi_mq_hist_stats_callback;
+    mp_add.desc = desc;
+    mp_add.flags = flags;
+    mp_add.context = mq;
+
+    add_fn(&mp_add);
+}
+#endif
+
 void
 psmi_mq_stats_register(psm_mq_t mq, mpspawn_stats_add_fn add_fn)
 {
@@ -425,4 +840,8 @@ psmi_mq_stats_register(psm_mq_t mq, mpspawn_stats_add_fn add_fn)
     mp_add.context = mq;
 
     add_fn(&mp_add);
+
+#ifdef PSM_MQ_HISTOGRAMS
+    psmi_mq_hist_stats_register(mq, add_fn);
+#endif
 }
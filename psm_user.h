@@ -36,6 +36,7 @@
 
 #include <inttypes.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #include "psm.h"
 #include "psm_mq.h"
@@ -70,6 +71,9 @@ int psmi_isinitialized();
 
 psm_error_t psmi_poll_internal(psm_ep_t ep, int poll_amsh);
 psm_error_t psmi_mq_wait_internal(psm_mq_req_t *ireq);
+void	    psmi_mq_run_callbacks(psm_mq_t mq);
+void	    psmi_mq_batch_poll(psm_mq_t mq);
+psm_error_t psmi_mq_trace_replay(const char *path);
 
 /*
  * Default setting for Receive thread
@@ -154,6 +154,23 @@ struct ptl_ctl
     psm_error_t (*mq_isend)(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t dest, 
 			    uint32_t flags, uint64_t stag, const void *buf, uint32_t len, 
 			    void *ctxt, psm_mq_req_t *req);
+    /* Optional, for PTLs that gather iovecs themselves.  When NULL, the MQ
+     * stages iovec sends into a contiguous buffer for mq_isend. */
+    psm_error_t (*mq_isendv)(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t dest, 
+			     uint32_t flags, uint64_t stag, 
+			     const struct iovec *iov, uint32_t iovcnt, 
+			     uint32_t len, void *ctxt, psm_mq_req_t *req);
+
+    /* Optional, asks the receiver of a rendezvous send to drop its RTS.
+     * The answer comes back through psmi_mq_handle_send_cancel. */
+    psm_error_t (*mq_cancel)(ptl_t *ptl, psm_mq_req_t req);
+
+    /* Optional, sends packed tiny messages as one MQ_MSG_BATCH message.  A
+     * ptl may split buf at record boundaries.  *nsent is set to the bytes
+     * of the leading records that went out, all of len on success. */
+    psm_error_t (*mq_send_batch)(ptl_t *ptl, psm_epaddr_t dest, 
+				 const void *buf, uint32_t len, 
+				 uint32_t *nsent);
 
     int (*epaddr_stats_num)(void);
     int	(*epaddr_stats_init)(char *desc[], uint16_t *flags);
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2006-2010. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include "psm_user.h"
+#include "psm_am_internal.h"
+#include "kcopyrw.h"
+#include "cmarw.h"
+
+/*
+ * Calibration of the shm eager-to-rendezvous switchover.
+ *
+ * An eager message goes through the medium fifo one packet at a time and the
+ * receiver copies it out of each packet.  A rendezvous message first pays for
+ * the RTS/CTS handshake, then either for a single kernel-assisted copy or for
+ * the same two copies through the larger packets of the long fifo.  Both
+ * schemes are replayed between this thread and a helper thread over private
+ * memory for a sweep of message sizes, and the threshold is put where
+ * rendezvous becomes and stays cheaper.
+ *
+ * Results are kept in a small text file, one "hosttype threshold" line per
+ * kind of node, so that later jobs on the same kind of node skip the sweep.
+ * The default file is per user.  Symlinks and files owned by someone else are
+ * never read or written, and thresholds outside the swept range are ignored.
+ */
+
+#define CALIB_SLOTS	    8
+#define CALIB_MIN_SZ	    1024
+#define CALIB_MAX_SZ	    (1024*1024)
+#define CALIB_REPS	    8
+#define CALIB_FILE_DEFAULT  "/tmp/psm_shm_rndv_calibration"	/* .<uid> */
+
+#define CALIB_OP_IDLE	    0
+#define CALIB_OP_EAGER	    1
+#define CALIB_OP_RNDV	    2
+#define CALIB_OP_EXIT	    3
+
+struct calib_slot {
+    volatile uint32_t	full;
+    uint32_t		len;
+    uint8_t		pad[56];
+};
+
+struct calib_ctl {
+    volatile uint32_t	op __attribute__ ((aligned(64)));
+    uint32_t		len;
+    volatile uint32_t	rts __attribute__ ((aligned(64)));
+    volatile uint32_t	cts __attribute__ ((aligned(64)));
+    volatile uint32_t	fin __attribute__ ((aligned(64)));
+    struct calib_slot	slot[CALIB_SLOTS];
+
+    uint32_t		med_sz;	    /* eager packet payload */
+    uint32_t		long_sz;    /* rendezvous packet payload */
+    int			kassist;
+    uint8_t		*src;	    /* sender's buffer */
+    uint8_t		*dst;	    /* receiver's buffer */
+    uint8_t		*fifo;	    /* CALIB_SLOTS packets of long_sz */
+};
+
+PSMI_ALWAYS_INLINE(
+void
+calib_spin(volatile uint32_t *word, uint32_t val))
+{
+    uint32_t n = 0;
+    while (*word != val)
+	if ((++n & 0x3ff) == 0)
+	    sched_yield();
+}
+
+/* Sender side of a packetized copy through the fifo */
+static void
+calib_push(struct calib_ctl *c, uint32_t len, uint32_t pktsz)
+{
+    uint32_t off, i = 0;
+    struct calib_slot *s;
+
+    for (off = 0; off < len; off += pktsz, i = (i + 1) % CALIB_SLOTS) {
+	s = &c->slot[i];
+	calib_spin(&s->full, 0);
+	s->len = min(pktsz, len - off);
+	memcpy(c->fifo + i * c->long_sz, c->src + off, s->len);
+	ips_wmb();
+	s->full = 1;
+    }
+}
+
+/* Receiver side of a packetized copy through the fifo */
+static void
+calib_pop(struct calib_ctl *c, uint32_t len, uint32_t pktsz)
+{
+    uint32_t off, i = 0;
+    struct calib_slot *s;
+
+    for (off = 0; off < len; off += pktsz, i = (i + 1) % CALIB_SLOTS) {
+	s = &c->slot[i];
+	calib_spin(&s->full, 1);
+	memcpy(c->dst + off, c->fifo + i * c->long_sz, s->len);
+	ips_mb();
+	s->full = 0;
+    }
+}
+
+static void *
+calib_sender(void *arg)
+{
+    struct calib_ctl *c = (struct calib_ctl *) arg;
+    uint32_t op;
+
+    for (;;) {
+	uint32_t n = 0;
+	while ((op = c->op) == CALIB_OP_IDLE)
+	    if ((++n & 0x3ff) == 0)
+		sched_yield();
+	ips_rmb();
+
+	if (op == CALIB_OP_EXIT)
+	    break;
+	else if (op == CALIB_OP_EAGER)
+	    calib_push(c, c->len, c->med_sz);
+	else {
+	    c->rts = 1;
+	    calib_spin(&c->cts, 1);
+	    c->cts = 0;
+	    if (!c->kassist)
+		calib_push(c, c->len, c->long_sz);
+	    calib_spin(&c->fin, 1);
+	    c->fin = 0;
+	}
+	ips_mb();
+	c->op = CALIB_OP_IDLE;
+    }
+    return NULL;
+}
+
+/* One message of len bytes, timed at the receiver, in nanoseconds */
+static uint64_t
+calib_run(struct calib_ctl *c, uint32_t op, uint32_t len)
+{
+    uint64_t t_start;
+
+    c->len = len;
+    ips_wmb();
+    t_start = get_cycles();
+    c->op = op;
+
+    if (op == CALIB_OP_EAGER)
+	calib_pop(c, len, c->med_sz);
+    else {
+	calib_spin(&c->rts, 1);
+	c->rts = 0;
+	ips_wmb();
+	c->cts = 1;
+	if (c->kassist == PSMI_KASSIST_CMA) {
+	    if (cma_get(getpid(), c->src, c->dst, len) != len)
+		c->kassist = -1;
+	}
+	else if (c->kassist) {
+	    if (kcopy_get(psmi_kcopy_fd, getpid(), c->src, c->dst, len) != len)
+		c->kassist = -1;
+	}
+	else
+	    calib_pop(c, len, c->long_sz);
+	ips_wmb();
+	c->fin = 1;
+    }
+    calib_spin(&c->op, CALIB_OP_IDLE);
+    return cycles_to_nanosecs(get_cycles() - t_start);
+}
+
+static uint64_t
+calib_best(struct calib_ctl *c, uint32_t op, uint32_t len)
+{
+    uint64_t t, t_best = ~0ULL;
+    int i;
+
+    for (i = -2; i < CALIB_REPS; i++) { /* two warm-up rounds */
+	t = calib_run(c, op, len);
+	if (i >= 0 && t < t_best)
+	    t_best = t;
+    }
+    return t_best;
+}
+
+/* Interpolated size where rendezvous becomes and stays cheaper, or 0 */
+static uint32_t
+calib_sweep(struct calib_ctl *c)
+{
+    int64_t diff, diff_prev = 0;
+    uint32_t len, len_prev = 0, thresh = 0;
+
+    for (len = CALIB_MIN_SZ; len <= CALIB_MAX_SZ; len <<= 1) {
+	uint64_t t_eager = calib_best(c, CALIB_OP_EAGER, len);
+	uint64_t t_rndv = calib_best(c, CALIB_OP_RNDV, len);
+	if (c->kassist < 0)
+	    return 0;
+
+	_IPATH_PRDBG("shm calibration len=%d eager=%lluns rndv=%lluns\n", len,
+		     (unsigned long long) t_eager, (unsigned long long) t_rndv);
+	diff = (int64_t) t_rndv - (int64_t) t_eager;
+	if (diff > 0)
+	    thresh = 0;
+	else if (thresh == 0) {
+	    if (len_prev == 0)
+		thresh = len;
+	    else
+		thresh = len_prev + (uint32_t) 
+		    ((uint64_t) (len - len_prev) * diff_prev / 
+		     (diff_prev - diff));
+	}
+	len_prev = len;
+	diff_prev = diff;
+    }
+    return thresh ? thresh : CALIB_MAX_SZ;
+}
+
+/* Nodes with the same processor, processor count, copy assist and shm packet
+ * sizes share a calibration */
+static void
+calib_hosttype(char *buf, size_t len, int kassist, uint32_t med_sz, 
+	       uint32_t long_sz)
+{
+    char line[256], model[128] = "unknown";
+    char *p;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/cpuinfo", "r")) != NULL) {
+	while (fgets(line, sizeof line, fp) != NULL) {
+	    if (strncmp(line, "model name", 10) == 0 && 
+		(p = strchr(line, ':')) != NULL) {
+		p += strspn(p, ": \t");
+		snprintf(model, sizeof model, "%s", p);
+		break;
+	    }
+	}
+	fclose(fp);
+    }
+    for (p = model; *p; p++)
+	if (*p == ' ' || *p == '\t' || *p == '\n')
+	    *p = *(p+1) ? '_' : '\0';
+
+    snprintf(buf, len, "%s/%ld/%s/%u/%u", model, 
+	     sysconf(_SC_NPROCESSORS_ONLN),
+	     kassist == PSMI_KASSIST_CMA ? "cma" : 
+	     kassist ? "kcopy" : "nokcopy", med_sz, long_sz);
+}
+
+/* Only a regular file of ours is trusted, never through a symlink */
+static int
+calib_file_open(const char *path, int flags)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, flags | O_NOFOLLOW, 0644)) < 0)
+	return -1;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+	_IPATH_PRDBG("Ignoring shm calibration file %s, not a regular file "
+		     "owned by uid %d\n", path, (int) geteuid());
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static uint32_t
+calib_file_lookup(const char *path, const char *hosttype)
+{
+    char line[512], key[384];
+    unsigned int thresh;
+    uint32_t found = 0;
+    FILE *fp;
+    int fd;
+
+    if ((fd = calib_file_open(path, O_RDONLY)) < 0)
+	return 0;
+    if ((fp = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	return 0;
+    }
+    while (fgets(line, sizeof line, fp) != NULL) {
+	if (sscanf(line, "%383s %u", key, &thresh) == 2 && 
+	    strcmp(key, hosttype) == 0 && 
+	    thresh >= CALIB_MIN_SZ && thresh <= CALIB_MAX_SZ) {
+	    found = thresh;
+	    break;
+	}
+    }
+    fclose(fp);
+    return found;
+}
+
+static void
+calib_file_store(const char *path, const char *hosttype, uint32_t thresh)
+{
+    char line[512];
+    int fd, n;
+
+    /* A single appending write, concurrent ranks at worst add duplicates */
+    n = snprintf(line, sizeof line, "%s %u\n", hosttype, thresh);
+    if ((fd = calib_file_open(path, O_WRONLY | O_CREAT | O_APPEND)) < 0)
+	return;
+    if (write(fd, line, n) != n)
+	_IPATH_PRDBG("Couldn't save shm calibration to %s\n", path);
+    close(fd);
+}
+
+/*
+ * Returns the measured threshold, or 0 if calibration is disabled or not
+ * possible on this node.
+ */
+uint32_t
+psmi_shm_calibrate_rv_thresh(uint32_t med_sz, uint32_t long_sz, int kassist)
+{
+    union psmi_envvar_val env_calib, env_file;
+    struct calib_ctl *c = NULL;
+    pthread_t tid;
+    char hosttype[384];
+    static char default_path[PATH_MAX];
+    const char *path;
+    uint32_t thresh = 0;
+
+    psmi_getenv("PSM_MQ_RNDV_SHM_CALIBRATE", 
+		"Measure the shm eager-to-rendezvous switchover at startup",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		PSMI_ENVVAR_VAL_NO, &env_calib);
+    if (!env_calib.e_uint)
+	return 0;
+
+    snprintf(default_path, sizeof default_path, CALIB_FILE_DEFAULT ".%d", 
+	     (int) geteuid());
+    psmi_getenv("PSM_MQ_RNDV_SHM_CALIBRATE_FILE", 
+		"File caching shm calibrations per host type (empty for none)",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_STR,
+		(union psmi_envvar_val) (char *) default_path, &env_file);
+    path = env_file.e_str;
+
+    calib_hosttype(hosttype, sizeof hosttype, kassist, med_sz, long_sz);
+    if (*path && (thresh = calib_file_lookup(path, hosttype))) {
+	_IPATH_PRDBG("shm rendezvous threshold %d from %s\n", thresh, path);
+	return thresh;
+    }
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+	_IPATH_PRDBG("Skipping shm calibration on a single processor\n");
+	return 0;
+    }
+
+    c = (struct calib_ctl *) psmi_calloc(NULL, UNDEFINED, 1, sizeof(*c));
+    if (c == NULL)
+	goto fail;
+    c->med_sz = med_sz;
+    c->long_sz = long_sz;
+    c->kassist = kassist;
+    c->src = (uint8_t *) psmi_malloc(NULL, UNDEFINED, CALIB_MAX_SZ);
+    c->dst = (uint8_t *) psmi_malloc(NULL, UNDEFINED, CALIB_MAX_SZ);
+    c->fifo = (uint8_t *) psmi_malloc(NULL, UNDEFINED, CALIB_SLOTS * long_sz);
+    if (c->src == NULL || c->dst == NULL || c->fifo == NULL)
+	goto fail;
+    memset(c->src, 0xa5, CALIB_MAX_SZ);
+    memset(c->dst, 0, CALIB_MAX_SZ);
+
+    if (pthread_create(&tid, NULL, calib_sender, c))
+	goto fail;
+    thresh = calib_sweep(c);
+    c->op = CALIB_OP_EXIT;
+    pthread_join(tid, NULL);
+
+    if (thresh) {
+	_IPATH_PRDBG("shm rendezvous threshold calibrated to %d (%s)\n", 
+		     thresh, hosttype);
+	if (*path)
+	    calib_file_store(path, hosttype, thresh);
+    }
+
+fail:
+    if (c != NULL) {
+	if (c->src != NULL)
+	    psmi_free(c->src);
+	if (c->dst != NULL)
+	    psmi_free(c->dst);
+	if (c->fifo != NULL)
+	    psmi_free(c->fifo);
+	psmi_free(c);
+    }
+    return thresh;
+}
@@ -40,6 +40,7 @@
 #include "psm_mq_internal.h"
 #include "psm_am_internal.h"
 #include "kcopyrw.h"
+#include "cmarw.h"
 
 /*
  * Shared memory Active Messages, implementation derived from
@@ -61,7 +62,20 @@
 #define QREADYMED  3
 #define QREADYLONG 4
 
-#define QISEMPTY(flag) (flag<QREADY)
+/*
+ * Senders reserve slots without taking a lock, as in Vyukov's bounded queue.
+ * The tail counts reservations and slot i serves tickets i, i+cnt, i+2*cnt...
+ * Above its state, the flag of a slot holds the low 24 bits of the ticket it
+ * waits for (free) or serves (used or ready).  The receiver frees a slot for
+ * the ticket one lap later, and a sender that finds a slot still waiting for
+ * the previous lap knows the queue is full.
+ */
+#define QSTATE_MASK	    0xff
+#define QSTATE(flag)	    ((flag) & QSTATE_MASK)
+#define QSEQ(flag)	    ((flag) >> 8)
+#define QFLAG(seq,state)    (((uint32_t)(seq) << 8) | (state))
+
+#define QISEMPTY(flag) (QSTATE(flag)<QREADY)
 #ifdef __powerpc__
 #  define _QMARK_FLAG_FENCE()  asm volatile("lwsync" : : : "memory")
 #elif defined(__x86_64__) || defined(__i386__)
@@ -75,9 +89,10 @@
         (pkt_ptr)->flag = (_flag);               \
         } while (0)
 
-#define QMARKFREE(pkt_ptr)  _QMARK_FLAG(pkt_ptr, QFREE)
-#define QMARKREADY(pkt_ptr) _QMARK_FLAG(pkt_ptr, QREADY)
-#define QMARKUSED(pkt_ptr)  _QMARK_FLAG(pkt_ptr, QUSED)
+#define QMARKFREE(pkt_ptr,cnt)  \
+	_QMARK_FLAG(pkt_ptr, QFLAG(QSEQ((pkt_ptr)->flag) + (cnt), QFREE))
+#define QMARKREADY(pkt_ptr) \
+	_QMARK_FLAG(pkt_ptr, QFLAG(QSEQ((pkt_ptr)->flag), QREADY))
 
 #define AMFMT_SYSTEM       1
 #define AMFMT_SHORT_INLINE 2
@@ -159,11 +174,10 @@ typedef struct am_ctl_qhdr {
     uint32_t    head;		/* Touched only by 1 consumer */
     uint8_t	_pad0[64-4];
 
-    pthread_spinlock_t  lock;
-    uint32_t    tail;		/* XXX candidate for fetch-and-incr */
-    uint32_t    elem_cnt;
+    uint32_t    tail;		/* Next ticket, advanced by compare-and-swap */
+    uint32_t    elem_cnt;	/* Power of two */
     uint32_t    elem_sz;
-    uint8_t     _pad1[64-3*4-sizeof(pthread_spinlock_t)];
+    uint8_t     _pad1[64-3*4];
 }
 am_ctl_qhdr_t;
 PSMI_STRICT_SIZE_DECL(am_ctl_qhdr_t,128);
@@ -171,6 +185,40 @@ PSMI_STRICT_SIZE_DECL(am_ctl_qhdr_t,128);
 /* Each block reserves some space at the beginning to store auxiliary data */
 #define AMSH_BLOCK_HEADER_SIZE  4096
 
+/* Peers set a byte after queueing to the owner, which clears it before
+ * looking at that queue, so an idle poll reads nothing but this word.  There
+ * is a byte per queue, rather than a bit, so that setting one takes a plain
+ * store instead of a locked read-modify-write. */
+typedef union am_ctl_pending {
+    uint64_t	any;
+    uint8_t	q[8];
+}
+am_ctl_pending_t;
+
+#define AMSH_PENDING_REQ    0	/* shared request fifo */
+#define AMSH_PENDING_REP    1	/* shared reply fifo */
+#define AMSH_PENDING_RING   2	/* some request ring, see ring_pending */
+
+/* Auxiliary data: the owner's doorbell, rung by peers that queue packets */
+typedef struct am_ctl_blockaux {
+    struct psmi_doorbell doorbell;
+
+    volatile am_ctl_pending_t pending __attribute__ ((aligned(64)));
+
+    /* A sender sets its byte after queueing to its request ring and the owner
+     * clears it before draining, so polls only visit rings with packets */
+    volatile uint8_t	ring_pending[PTL_AMSH_MAX_LOCAL_PROCS]
+			    __attribute__ ((aligned(64)));
+    /* Who each request ring was set up for, written by the owner on connect */
+    volatile psm_epid_t	ring_epid[PTL_AMSH_MAX_LOCAL_PROCS]
+			    __attribute__ ((aligned(64)));
+    /* Set by the owner while it holds parked requests from a sender, which
+     * queues no more MQ requests to the shared fifo until it is cleared */
+    volatile uint8_t	mq_hold[PTL_AMSH_MAX_LOCAL_PROCS]
+			    __attribute__ ((aligned(64)));
+}
+am_ctl_blockaux_t;
+
 /* Each process has a reply qhdr and a request qhdr */
 typedef struct am_ctl_blockhdr {
     volatile am_ctl_qhdr_t    shortq;
@@ -213,9 +261,27 @@ struct amsh_qdirectory {
     am_pkt_bulk_t  	*qrepFifoLong;
     am_pkt_bulk_t  	*qrepFifoHuge;
 
+    am_pkt_short_t	*qreqRings;
+
+    am_ctl_blockaux_t	*aux;
+    struct psmi_doorbell *doorbell;
+
     int			kcopy_pid;
 } __attribute__ ((aligned(8)));
 
+/* Fifo geometry of every block in the segment, counts are powers of two and
+ * sizes are payload bytes */
+struct amsh_geometry {
+    uint32_t	    short_cnt;
+    uint32_t	    med_cnt;
+    uint32_t	    long_cnt;
+    uint32_t	    huge_cnt;	/* reply fifo, requests get an eighth */
+    uint32_t	    med_sz;
+    uint32_t	    long_sz;
+    uint32_t	    huge_sz;
+    uint32_t	    rings;	/* per-sender request rings, PSM_SHM_SPSC */
+};
+
 /* The first shared memory page is a control page to support each endpoint
  * independently adding themselves to the shared memory segment. */
 struct am_ctl_dirpage {
@@ -228,13 +294,16 @@ struct am_ctl_dirpage {
     uint32_t        amsh_features[PTL_AMSH_MAX_LOCAL_PROCS];
     int             num_attached; /* 0..MAX_LOCAL_PROCS-1 */
     int		    max_idx;
+    struct amsh_geometry geometry; /* set by the master */
 
     psm_epid_t      shmidx_map_epid[PTL_AMSH_MAX_LOCAL_PROCS];
     int		    kcopy_minor;
     int		    kcopy_pids[PTL_AMSH_MAX_LOCAL_PROCS];
+    uintptr_t	    cma_cookies[PTL_AMSH_MAX_LOCAL_PROCS]; /* see below */
 };
 
 #define AMSH_HAVE_KCOPY	0x01
+#define AMSH_HAVE_CMA	0x02
 
 /* List of context-specific shared variables */
 static struct amsh_qdirectory *amsh_qdir;
@@ -248,9 +317,37 @@ static int	 amsh_max_idx = -1;  /* max directory idx seen so far */
 static int       amsh_shmidx = -1;   /* last used shmidx */
 
 int psmi_kcopy_fd = -1; /* when using kcopy */
+int psmi_kassist = PSMI_KASSIST_OFF;
+
+/* Holds our pid at the address published in cma_cookies, so that peers can
+ * check that cross-memory attach lets them into this process */
+static pid_t amsh_cma_cookie;
 int psmi_shm_mq_rv_thresh = PSMI_MQ_RV_THRESH_NO_KCOPY;
 
 static am_pkt_short_t amsh_empty_shortpkt = { 0 };
+static am_ctl_pending_t amsh_empty_pending = { 0 };
+
+/* A request the MQ had no buffer space for, copied out of the shared fifo
+ * with its payload so that the fifo keeps moving.  Later MQ requests from the
+ * same sender are parked behind it to keep them in order, and the sender is
+ * told through mq_hold to stop queueing them until the list has drained, so
+ * that a list never holds more than what was in flight in the fifo. */
+typedef
+struct amsh_parked {
+    struct amsh_parked *next;
+    uint16_t    handleridx;
+    uint16_t    nargs;
+    uint32_t    len;
+    psm_amarg_t args[NSHORT_ARGS];
+    uint8_t     payload[0];
+}
+amsh_parked_t;
+
+/* Handlers whose requests must stay in order with the eager MQ traffic */
+#define AMSH_HIDX_IS_MQ(hidx)                   \
+        ((hidx) == mq_handler_hidx ||           \
+         (hidx) == mq_handler_data_hidx ||      \
+         (hidx) == mq_handler_rtscancel_hidx)
 
 /******************************************
  * Per-endpoint structures (ep-local)
@@ -269,21 +366,38 @@ struct ptl {
     int                    shmidx; 
     am_ctl_qshort_cache_t  reqH;
     am_ctl_qshort_cache_t  repH;
+    volatile am_ctl_pending_t *pending;
     psm_epaddr_t	   shmidx_map_epaddr[PTL_AMSH_MAX_LOCAL_PROCS];
     int                    zero_polls;
     int                    amsh_only_polls;
+    int                    nparked;  /* senders with parked requests */
+    struct {
+        amsh_parked_t     *first;
+        amsh_parked_t    **lastp;
+        uint64_t           retry_stamp;  /* when first was refused */
+    }                      parked[PTL_AMSH_MAX_LOCAL_PROCS];
 
     pthread_mutex_t        connect_lock;
     int                    connect_phase;
     int                    connect_to;
     int                    connect_from;
+
+    int                    ring_enabled;   /* segment has request rings */
+    struct {
+        uint16_t           tx_on;    /* requests to the peer use our ring */
+        uint16_t           tx_tail;  /* next slot of our ring at the peer */
+        uint16_t           rx_head;  /* next slot of the peer's ring here */
+        uint16_t           rx_deferred;     /* rx_head was left in place */
+        uint64_t           rx_retry_stamp;
+    }                      ring[PTL_AMSH_MAX_LOCAL_PROCS];
 };
 
 /******************************************
  * Shared fifo element counts and sizes
  ******************************************
- * These values are context-wide, they can only be set early on and can't be *
- * modified at runtime.  All endpoints are expected to use the same values.
+ * These values are context-wide.  The process that creates the segment takes
+ * them from its environment and publishes them in the control page, every
+ * process that attaches uses what it finds there.
  */
 typedef
 struct amsh_qinfo {
@@ -307,31 +421,42 @@ amsh_qinfo_t;
 /* When do we start using the "huge" buffers -- at 1MB */
 #define AMSH_HUGE_BYTES 1024*1024
 
-#define AMMED_SZ    2048
-#define AMLONG_SZ   8192
-#define AMHUGE_SZ   (524288+sizeof(am_pkt_bulk_t)) /* 512k + E */
-
-static const amsh_qinfo_t amsh_qcounts =
-        { 1024, 256, 16, 1, 1024, 256, 16, 8 };
+#define AMSH_SHORT_CNT_DEFAULT	1024
+#define AMSH_MED_CNT_DEFAULT	256
+#define AMSH_LONG_CNT_DEFAULT	16
+#define AMSH_HUGE_CNT_DEFAULT	8
+#define AMSH_MED_SZ_DEFAULT	2048
+#define AMSH_LONG_SZ_DEFAULT	8192	/* including the bulk packet header */
+#define AMSH_HUGE_SZ_DEFAULT	524288
 
-static const amsh_qinfo_t amsh_qelemsz =
-        { sizeof(am_pkt_short_t), AMMED_SZ+64, AMLONG_SZ, AMHUGE_SZ, 
-          sizeof(am_pkt_short_t), AMMED_SZ+64, AMLONG_SZ, AMHUGE_SZ };
+/* Mediums carry MQ batches, see MQ_BATCH_BYTES */
+#define AMSH_MED_SZ_MIN		1024
+#define AMSH_MED_SZ_MAX		65536
 
+static amsh_qinfo_t amsh_qcounts;
+static amsh_qinfo_t amsh_qelemsz;
 static amsh_qinfo_t amsh_qsizes;
+static uint32_t	    amsh_med_sz; /* medium payload */
+static uintptr_t    amsh_rings_size; /* AMSH_RINGS_SIZE or 0 without rings */
+
+/* Optionally, each receiver block also has one request ring per local sender,
+ * set up when that sender connects.  A ring only ever has one producer and
+ * one consumer, which keep their index to themselves, so neither side needs
+ * more than the slot flags.  Blocks only have room for them when the first
+ * local process turned them on, and their pages are only touched once a
+ * sender connects. */
+#define AMSH_RING_SLOTS	    128
+#define AMSH_RINGS_SIZE	    PSMI_ALIGNUP(PTL_AMSH_MAX_LOCAL_PROCS * \
+				AMSH_RING_SLOTS * sizeof(am_pkt_short_t), \
+				PSMI_PAGESIZE)
 
 /* we use this internally to break up packets into MTUs */
-static const amsh_qinfo_t amsh_qpkt_max =
-        { NSHORT_ARGS*8, AMMED_SZ, AMLONG_SZ-sizeof(am_pkt_bulk_t),
-                                   AMHUGE_SZ-sizeof(am_pkt_bulk_t),
-          NSHORT_ARGS*8, AMMED_SZ, AMLONG_SZ-sizeof(am_pkt_bulk_t),
-                                   AMHUGE_SZ-sizeof(am_pkt_bulk_t),
-        };
-
-/* We expose max sizes for the AM ptl.  */
+static amsh_qinfo_t amsh_qpkt_max;
+
+/* We expose max sizes for the AM ptl, the mediums follow the geometry */
 struct psm_am_max_sizes psmi_am_max_sizes = 
-        { 6, AMMED_SZ, (uint32_t) -1,
-             AMMED_SZ, (uint32_t) -1 };
+        { 6, AMSH_MED_SZ_DEFAULT, (uint32_t) -1,
+             AMSH_MED_SZ_DEFAULT, (uint32_t) -1 };
 
 /*
  * Macro expansion trickery to handle 6 different fifo types:
@@ -348,7 +473,7 @@ struct psm_am_max_sizes psmi_am_max_sizes =
         
 static psm_error_t am_remap_segment(ptl_t *ptl, int max_idx);
 static psm_error_t amsh_poll(ptl_t *ptl, int replyonly);
-static void process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq);
+static int process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq);
 static void amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, 
                               void *buf, size_t len);
 
@@ -361,13 +486,23 @@ static const char * psmi_kcopy_getmode(int mode);
 static inline void
 am_ctl_qhdr_init(volatile am_ctl_qhdr_t *q, int elem_cnt, int elem_sz)
 {
-    pthread_spin_init(&q->lock, PTHREAD_PROCESS_SHARED);
+    psmi_assert_always(elem_cnt > 0 && (elem_cnt & (elem_cnt-1)) == 0);
     q->head = 0;
     q->tail = 0;
     q->elem_cnt = elem_cnt;
     q->elem_sz  = elem_sz;
 }
 
+/* Slot i starts out free for ticket i */
+static void
+am_ctl_shortpkt_init(am_pkt_short_t *base_ptr, int nelems)
+{
+    int i;
+
+    for (i = 0; i < nelems; i++)
+        base_ptr[i].flag = QFLAG(i, QFREE);
+}
+
 static void
 am_ctl_bulkpkt_init(am_pkt_bulk_t *base_ptr, size_t elemsz, int nelems)
 {
@@ -377,6 +512,7 @@ am_ctl_bulkpkt_init(am_pkt_bulk_t *base_ptr, size_t elemsz, int nelems)
 
     for (i = 0; i < nelems; i++, bulkptr += elemsz) {
         bulkpkt = (am_pkt_bulk_t *) bulkptr;
+        bulkpkt->flag = QFLAG(i, QFREE);
         bulkpkt->idx = i;
     }
 }
@@ -394,7 +530,7 @@ am_ctl_sizeof_block()
         _PA(reqFifoHuge) + 
         PSMI_ALIGNUP(sizeof(am_ctl_blockhdr_t), PSMI_PAGESIZE) + /*reqctrl block*/
         _PA(repFifoShort) + _PA(repFifoMed) + _PA(repFifoLong) + 
-        _PA(repFifoHuge),
+        _PA(repFifoHuge) + amsh_rings_size,
       PSMI_PAGESIZE); /* align to page size */
 }
 #undef _PA
@@ -460,6 +596,90 @@ amsh_mmap_fault(int sig)
       exit(1); /* XXX revisit this... there's probably a better way to exit */
 }
 
+/* One dimension of the fifo geometry, the default is kept unless the value is
+ * a power of two within range */
+static
+uint32_t
+amsh_geometry_getenv(const char *name, const char *descr, uint32_t def,
+		     uint32_t min, uint32_t max)
+{
+    union psmi_envvar_val env;
+
+    psmi_getenv(name, descr, PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_UINT,
+		(union psmi_envvar_val) def, &env);
+    if (env.e_uint < min || env.e_uint > max || 
+	(env.e_uint & (env.e_uint - 1))) {
+	_IPATH_INFO("Ignoring %s=%u, it must be a power of two from %u to %u\n",
+		    name, env.e_uint, min, max);
+	return def;
+    }
+    return env.e_uint;
+}
+
+static
+void
+amsh_geometry_getenv_all(struct amsh_geometry *g)
+{
+    union psmi_envvar_val env;
+
+    g->short_cnt = amsh_geometry_getenv("PSM_SHM_SHORT_SLOTS",
+		    "PSM Shared Memory short packets per fifo",
+		    AMSH_SHORT_CNT_DEFAULT, 16, 65536);
+    g->med_cnt = amsh_geometry_getenv("PSM_SHM_MED_SLOTS",
+		    "PSM Shared Memory medium packets per fifo",
+		    AMSH_MED_CNT_DEFAULT, 8, 65536);
+    g->long_cnt = amsh_geometry_getenv("PSM_SHM_LONG_SLOTS",
+		    "PSM Shared Memory long packets per fifo",
+		    AMSH_LONG_CNT_DEFAULT, 2, 4096);
+    g->huge_cnt = amsh_geometry_getenv("PSM_SHM_HUGE_SLOTS",
+		    "PSM Shared Memory huge packets per reply fifo",
+		    AMSH_HUGE_CNT_DEFAULT, 1, 256);
+    g->med_sz = amsh_geometry_getenv("PSM_SHM_MED_SIZE",
+		    "PSM Shared Memory medium packet payload",
+		    AMSH_MED_SZ_DEFAULT, AMSH_MED_SZ_MIN, AMSH_MED_SZ_MAX);
+    g->long_sz = amsh_geometry_getenv("PSM_SHM_LONG_SIZE",
+		    "PSM Shared Memory long packet size",
+		    AMSH_LONG_SZ_DEFAULT, 4096, 1024*1024);
+    g->huge_sz = amsh_geometry_getenv("PSM_SHM_HUGE_SIZE",
+		    "PSM Shared Memory huge packet payload",
+		    AMSH_HUGE_SZ_DEFAULT, 65536, 16*1024*1024);
+    psmi_getenv("PSM_SHM_SPSC",
+		"PSM Shared Memory gives each local sender its own "
+		"request ring",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		PSMI_ENVVAR_VAL_NO, &env);
+    g->rings = env.e_uint;
+}
+
+static
+void
+amsh_geometry_set(const struct amsh_geometry *g)
+{
+    amsh_qcounts.qreqFifoShort = amsh_qcounts.qrepFifoShort = g->short_cnt;
+    amsh_qcounts.qreqFifoMed   = amsh_qcounts.qrepFifoMed   = g->med_cnt;
+    amsh_qcounts.qreqFifoLong  = amsh_qcounts.qrepFifoLong  = g->long_cnt;
+    amsh_qcounts.qreqFifoHuge  = max(g->huge_cnt / 8, 1);
+    amsh_qcounts.qrepFifoHuge  = g->huge_cnt;
+
+    amsh_qelemsz.qreqFifoShort = amsh_qelemsz.qrepFifoShort = 
+	sizeof(am_pkt_short_t);
+    amsh_qelemsz.qreqFifoMed   = amsh_qelemsz.qrepFifoMed   = g->med_sz + 64;
+    amsh_qelemsz.qreqFifoLong  = amsh_qelemsz.qrepFifoLong  = g->long_sz;
+    amsh_qelemsz.qreqFifoHuge  = amsh_qelemsz.qrepFifoHuge  = 
+	g->huge_sz + sizeof(am_pkt_bulk_t);
+
+    amsh_qpkt_max.qreqFifoShort = amsh_qpkt_max.qrepFifoShort = NSHORT_ARGS*8;
+    amsh_qpkt_max.qreqFifoMed   = amsh_qpkt_max.qrepFifoMed   = g->med_sz;
+    amsh_qpkt_max.qreqFifoLong  = amsh_qpkt_max.qrepFifoLong  = 
+	g->long_sz - sizeof(am_pkt_bulk_t);
+    amsh_qpkt_max.qreqFifoHuge  = amsh_qpkt_max.qrepFifoHuge  = g->huge_sz;
+
+    amsh_med_sz = g->med_sz;
+    amsh_rings_size = g->rings ? AMSH_RINGS_SIZE : 0;
+    psmi_am_max_sizes.request_short = g->med_sz;
+    psmi_am_max_sizes.request_long  = g->med_sz;
+}
+
 /**
  * Attach endpoint shared-memory.
  *
@@ -471,7 +691,8 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
     int ismaster = 1;
     int i;
     int use_kcopy;
-    union psmi_envvar_val env_kcopy;
+    union psmi_envvar_val env_kcopy, env_cma;
+    struct amsh_geometry geometry;
     int shmidx;
     int kcopy_minor = -1;
     char shmbuf[256];
@@ -535,6 +756,14 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 
     use_kcopy = (psmi_kcopy_mode != PSMI_KCOPY_MODE_OFF);
 
+    psmi_getenv("PSM_SHM_CMA",
+		"PSM Shared Memory kcopy mode falls back to cross-memory "
+		"attach without the kcopy module",
+		PSMI_ENVVAR_LEVEL_USER, PSMI_ENVVAR_TYPE_YESNO,
+		PSMI_ENVVAR_VAL_YES, &env_cma);
+
+    amsh_geometry_getenv_all(&geometry);
+
     segsz = psmi_amsh_segsize(0); /* segsize with no procs attached yet */ 
     amsh_shmfd = shm_open(amsh_keyname, 
                           O_RDWR | O_CREAT | O_EXCL | O_TRUNC, S_IRWXU);
@@ -622,6 +851,7 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 	for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i++) {
 	    amsh_dirpage->shmidx_map_epid[i] = 0;
 	    amsh_dirpage->kcopy_pids[i] = 0;
+	    amsh_dirpage->cma_cookies[i] = 0;
 	}
 	if (use_kcopy)
 	    psmi_kcopy_fd = psmi_kcopy_find_minor(&kcopy_minor);
@@ -632,6 +862,7 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 	    amsh_dirpage->kcopy_minor = kcopy_minor;
 	else
 	    amsh_dirpage->kcopy_minor = -1;
+	amsh_dirpage->geometry = geometry;
 	ips_mb();
 	amsh_dirpage->is_init = 1;
 	_IPATH_PRDBG("Mapped and initalized shm object control page at %p,"
@@ -647,7 +878,20 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 		     "%p, size=%d, kcopy minor is %d (mode=%s)\n", 
 		     mapptr, (int) segsz, kcopy_minor,
 		    psmi_kcopy_getmode(psmi_kcopy_mode));
-    }
+	if (memcmp(&geometry, &amsh_dirpage->geometry, sizeof(geometry)))
+	    _IPATH_INFO("Shared memory fifo sizes or rings in the environment "
+			"differ from those of the first local process, using "
+			"the latter\n");
+    }
+    amsh_geometry_set(&amsh_dirpage->geometry);
+    _IPATH_PRDBG("Shared fifos: %u short, %ux%u medium, %ux%u long, "
+		 "%ux%u huge, %.2f MB per process%s\n", 
+		 amsh_dirpage->geometry.short_cnt, 
+		 amsh_dirpage->geometry.med_cnt, amsh_dirpage->geometry.med_sz,
+		 amsh_dirpage->geometry.long_cnt, amsh_dirpage->geometry.long_sz,
+		 amsh_dirpage->geometry.huge_cnt, amsh_dirpage->geometry.huge_sz,
+		 (am_ctl_sizeof_block() - amsh_rings_size) / 1048576.0,
+		 amsh_rings_size ? " plus request rings" : "");
 
     /* 
      * First safe point where we can try to attach to the segment.
@@ -662,6 +906,7 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 	if (amsh_dirpage->shmidx_map_epid[i] == 0) {
 	    amsh_dirpage->shmidx_map_epid[i] = 1;
             amsh_dirpage->psm_verno[i] = PSMI_VERNO;
+	    amsh_dirpage->amsh_features[i] = 0;
 	    amsh_dirpage->kcopy_pids[i] = (int) getpid();
 	    if (kcopy_minor == -1 && use_kcopy) {
 		kcopy_minor = amsh_dirpage->kcopy_minor;
@@ -677,10 +922,23 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
 		kcopy_abi(psmi_kcopy_fd) != -1) 
 	    {
 		amsh_dirpage->amsh_features[i] |= AMSH_HAVE_KCOPY;
+		psmi_kassist = PSMI_KASSIST_KCOPY;
 		psmi_shm_mq_rv_thresh = PSMI_MQ_RV_THRESH_KCOPY;
 	    }
-	    else
+	    /* Without the module, stock kernels can still copy between
+	     * processes that are allowed to ptrace each other. */
+	    else if (use_kcopy && env_cma.e_uint && cma_available()) {
+		amsh_cma_cookie = getpid();
+		amsh_dirpage->cma_cookies[i] = (uintptr_t) &amsh_cma_cookie;
+		amsh_dirpage->amsh_features[i] |= AMSH_HAVE_CMA;
+		psmi_kassist = PSMI_KASSIST_CMA;
+		psmi_shm_mq_rv_thresh = PSMI_MQ_RV_THRESH_KCOPY;
+		_IPATH_PRDBG("No kcopy module, using cross-memory attach\n");
+	    }
+	    else {
+		psmi_kassist = PSMI_KASSIST_OFF;
 		psmi_shm_mq_rv_thresh = PSMI_MQ_RV_THRESH_NO_KCOPY;
+	    }
             amsh_shmidx = shmidx = *shmidx_o = i;
             _IPATH_PRDBG("Grabbed shmidx %d\n", shmidx);
             amsh_dirpage->num_attached++;
@@ -689,6 +947,14 @@ psmi_shm_attach(const psm_uuid_t uuid_key, int *shmidx_o)
     }
     pthread_mutex_unlock((pthread_mutex_t *) &(amsh_dirpage->lock));
 
+    /* Optionally replace the static threshold with a measured one */
+    if (shmidx != -1) {
+	uint32_t thresh = psmi_shm_calibrate_rv_thresh(amsh_med_sz, 
+			    amsh_qpkt_max.qreqFifoLong, psmi_kassist);
+	if (thresh)
+	    psmi_shm_mq_rv_thresh = thresh;
+    }
+
     /* install the old sighandler back */
     signal(SIGSEGV, old_handler_segv);
     signal(SIGBUS, old_handler_bus);
@@ -779,8 +1045,12 @@ amsh_init_segment(ptl_t *ptl)
     if ((err = am_remap_segment(ptl, shmidx)) != PSM_OK) 
 	goto fail_with_lock;
 
+    /* touch all of my pages, but leave the rings to the senders that use
+     * them.  A previous process at this shmidx may have left ring slots
+     * behind, amsh_ring_setup starts each ring over when its sender
+     * connects and before the sender is told to use it. */
     memset((void *)(amsh_blockbase + am_ctl_sizeof_block() * shmidx),
-	   0, am_ctl_sizeof_block()); /* touch all of my pages */
+	   0, am_ctl_sizeof_block() - amsh_rings_size);
 
     am_update_directory(ptl, shmidx);
     am_ctl_qhdr_init(&amsh_qdir[shmidx].qreqH->shortq, 
@@ -800,7 +1070,11 @@ amsh_init_segment(ptl_t *ptl)
     am_ctl_qhdr_init(&amsh_qdir[shmidx].qrepH->hugebulkq, 
                      amsh_qcounts.qrepFifoHuge, amsh_qelemsz.qrepFifoHuge);
 
-    /* Set bulkidx in every bulk packet */
+    /* Set ticket in every packet and bulkidx in every bulk packet */
+    am_ctl_shortpkt_init(amsh_qdir[shmidx].qreqFifoShort, 
+                         amsh_qcounts.qreqFifoShort);
+    am_ctl_shortpkt_init(amsh_qdir[shmidx].qrepFifoShort, 
+                         amsh_qcounts.qrepFifoShort);
     am_ctl_bulkpkt_init(amsh_qdir[shmidx].qreqFifoMed, amsh_qelemsz.qreqFifoMed,
                         amsh_qcounts.qreqFifoMed);
     am_ctl_bulkpkt_init(amsh_qdir[shmidx].qreqFifoLong, amsh_qelemsz.qreqFifoLong,
@@ -940,6 +1214,24 @@ am_hdrcache_update_short(int shmidx,
  * @param epaddr Endpoint address for which to update local directory.
  */
 	
+/* The ptrace checks of cross-memory attach (e.g. Yama) may keep us out of a
+ * peer even though the kernel has the syscalls, try reading its cookie. */
+static
+int
+amsh_cma_reachable(int shmidx)
+{
+    pid_t pid = (pid_t) amsh_dirpage->kcopy_pids[shmidx];
+    pid_t cookie = 0;
+
+    if (cma_get(pid, (const void *) amsh_dirpage->cma_cookies[shmidx], 
+		&cookie, sizeof(cookie)) == sizeof(cookie) && cookie == pid)
+	return 1;
+
+    _IPATH_PRDBG("No cross-memory attach to pid %d, shm rendezvous to it "
+		 "will copy through the fifos\n", (int) pid);
+    return 0;
+}
+
 static
 void
 am_update_directory(ptl_t *ptl, int shmidx)
@@ -950,11 +1242,21 @@ am_update_directory(ptl_t *ptl, int shmidx)
     base_this = amsh_blockbase + am_ctl_sizeof_block() * shmidx + 
                 AMSH_BLOCK_HEADER_SIZE;
 
-    if (amsh_dirpage->amsh_features[shmidx] & AMSH_HAVE_KCOPY)
+    /* Single copies need the peer to use the same mechanism as we do */
+    if (psmi_kassist == PSMI_KASSIST_KCOPY &&
+	amsh_dirpage->amsh_features[shmidx] & AMSH_HAVE_KCOPY)
+	amsh_qdir[shmidx].kcopy_pid = amsh_dirpage->kcopy_pids[shmidx];
+    else if (psmi_kassist == PSMI_KASSIST_CMA &&
+	     amsh_dirpage->amsh_features[shmidx] & AMSH_HAVE_CMA &&
+	     amsh_cma_reachable(shmidx))
 	amsh_qdir[shmidx].kcopy_pid = amsh_dirpage->kcopy_pids[shmidx];
     else
 	amsh_qdir[shmidx].kcopy_pid = 0;
 
+    amsh_qdir[shmidx].aux = (am_ctl_blockaux_t *)
+	(base_this - AMSH_BLOCK_HEADER_SIZE);
+    amsh_qdir[shmidx].doorbell = &amsh_qdir[shmidx].aux->doorbell;
+
     /* Request queues */
     amsh_qdir[shmidx].qreqH = (am_ctl_blockhdr_t *) base_this;
     amsh_qdir[shmidx].qreqFifoShort = (am_pkt_short_t *)
@@ -981,6 +1283,10 @@ am_update_directory(ptl_t *ptl, int shmidx)
 	((uintptr_t) amsh_qdir[shmidx].qrepFifoMed + amsh_qsizes.qrepFifoMed);
     amsh_qdir[shmidx].qrepFifoHuge = (am_pkt_bulk_t *)
 	((uintptr_t) amsh_qdir[shmidx].qrepFifoLong + amsh_qsizes.qrepFifoLong);
+
+    /* Per-sender request rings */
+    amsh_qdir[shmidx].qreqRings = (am_pkt_short_t *)
+	((uintptr_t) amsh_qdir[shmidx].qrepFifoHuge + amsh_qsizes.qrepFifoHuge);
     
     _IPATH_VDBG("shmidx=%d Request Hdr=%p,Pkt=%p,Med=%p,Long=%p,Huge=%p\n", 
                 shmidx,
@@ -994,14 +1300,17 @@ am_update_directory(ptl_t *ptl, int shmidx)
                 amsh_qdir[shmidx].qrepFifoHuge);
 
     /* If we're updating our shmidx, we update our cached pointers */
-    if (ptl->shmidx == shmidx)
+    if (ptl->shmidx == shmidx) {
 	am_hdrcache_update_short(shmidx, 
                                  (am_ctl_qshort_cache_t *) &ptl->reqH, 
                                  (am_ctl_qshort_cache_t *) &ptl->repH); 
+	ptl->ep->doorbell = amsh_qdir[shmidx].doorbell;
+	ptl->pending = &amsh_qdir[shmidx].aux->pending;
+    }
 
     /* Sanity check */
     uintptr_t base_next = 
-	(uintptr_t) amsh_qdir[shmidx].qrepFifoHuge + amsh_qsizes.qrepFifoHuge;
+	(uintptr_t) amsh_qdir[shmidx].qreqRings + amsh_rings_size;
 
     psmi_assert_always(base_next - base_this <= am_ctl_sizeof_block());
 }
@@ -1366,6 +1675,10 @@ amsh_ep_connreq_poll(ptl_t *ptl, struct ptl_connection_req *req)
                     }
                 } 
                 req->epaddr[i] = epaddr;
+                /* Connects go through the shared fifo, the peer sets up our
+                 * ring while it handles them */
+                ptl->ring[shmidx].tx_on = 0;
+                ptl->ring[shmidx].tx_tail = 0;
                 req->args[0].u32w0 = PSMI_AM_CONN_REQ;
                 req->args[0].u32w1 = ptl->connect_phase;
                 req->args[1].u64w0 = (uint64_t) ptl->epid;
@@ -1543,51 +1856,34 @@ amsh_ep_disconnect(ptl_t *ptl, int force, int numep,
                 (psm_epaddr_t *) array_of_epaddr, timeout_ns);
 }
 
-#undef CSWAP
-PSMI_ALWAYS_INLINE(
-int32_t 
-cswap(volatile int32_t *p, int32_t old_value, int32_t new_value))
-{
-  asm volatile ("lock cmpxchg %2, %0" :
-                "+m" (*p), "+a" (old_value) :
-                "r" (new_value) :
-                "memory");
-  return old_value;
-}
-
+/* Returns NULL if the queue is full, a slot is only reserved once it's free
+ * so that a full queue never holds up the receiver */
 PSMI_ALWAYS_INLINE(
 am_pkt_short_t *
 am_ctl_getslot_pkt_inner(volatile am_ctl_qhdr_t *shq, am_pkt_short_t *pkt0)
 )
 {
-    am_pkt_short_t *pkt;
-    uint32_t idx;
-#ifndef CSWAP
-    pthread_spin_lock(&shq->lock);
-    idx = shq->tail;
-    pkt = (am_pkt_short_t *)((uintptr_t) pkt0 + idx * shq->elem_sz);
-    if (pkt->flag == QFREE) {
-        ips_sync_reads();
-        pkt->flag = QUSED;
-        shq->tail += 1;
-        if (shq->tail == shq->elem_cnt)
-            shq->tail = 0;
-    } else {
-        pkt = 0;
+    volatile am_pkt_short_t *pkt;
+    uint32_t tail, flag;
+    int32_t dif;
+
+    for (;;) {
+        tail = shq->tail;
+        pkt = (am_pkt_short_t *)((uintptr_t) pkt0 + 
+                (tail & (shq->elem_cnt - 1)) * shq->elem_sz);
+        flag = pkt->flag;
+        /* How many tickets ahead of ours the slot is, modulo 2^24 */
+        dif = (int32_t) ((flag & ~QSTATE_MASK) - QFLAG(tail, 0));
+        if (dif < 0) /* still serving the previous lap */
+            return NULL;
+        else if (dif == 0 && QSTATE(flag) == QFREE &&
+                 ips_cmpxchg(&shq->tail, tail, tail + 1) == tail)
+            break;
+        /* else another sender took the ticket, try the next one */
     }
-    pthread_spin_unlock(&shq->lock);
-#else
-    uint32_t idx_next;
-    do {
-        idx = shq->tail;
-        idx_next = (idx+1 == shq->elem_cnt) ? 0 : idx+1;
-    } while (cswap(&shq->tail, idx, idx_next) != idx);
-
-    pkt = (am_pkt_short_t *)((uintptr_t) pkt0 + idx * shq->elem_sz);
-    while (cswap(&pkt->flag, QFREE, QUSED) !=  QFREE)
-        ;
-#endif
-    return pkt;
+    ips_sync_reads();
+    pkt->flag = QFLAG(tail, QUSED);
+    return (am_pkt_short_t *) pkt;
 }
 
 /* This is safe because 'flag' is at the same offset on both pkt and bulkpkt */
@@ -1666,6 +1962,23 @@ am_ctl_getslot_huge(int shmidx, int is_reply)
     return am_ctl_getslot_bulkpkt_inner(shq, pkt0);
 }
 
+/* Our ring at shmidx has a single producer, us, so the next slot is either
+ * free or the ring is full */
+PSMI_ALWAYS_INLINE(
+am_pkt_short_t *
+am_ctl_getslot_ring(ptl_t *ptl, int shmidx))
+{
+    am_pkt_short_t *pkt = amsh_qdir[shmidx].qreqRings + 
+        ptl->shmidx * AMSH_RING_SLOTS + ptl->ring[shmidx].tx_tail;
+
+    if (QSTATE(((volatile am_pkt_short_t *) pkt)->flag) != QFREE)
+        return NULL;
+    ips_sync_reads();
+    ptl->ring[shmidx].tx_tail = 
+        (ptl->ring[shmidx].tx_tail + 1) & (AMSH_RING_SLOTS - 1);
+    return pkt;
+}
+
 psmi_handlertab_t psmi_allhandlers[] = { 
     { 0 },
     { amsh_conn_handler },
@@ -1673,14 +1986,16 @@ psmi_handlertab_t psmi_allhandlers[] = {
     { psmi_am_mq_handler_data },
     { psmi_am_mq_handler_rtsmatch },
     { psmi_am_mq_handler_rtsdone },
-    { psmi_am_handler }
+    { psmi_am_handler },
+    { psmi_am_mq_handler_rtscancel },
+    { psmi_am_mq_handler_rtscancel_ack }
 };
 
 PSMI_ALWAYS_INLINE(
 void 
 advance_head(volatile am_ctl_qshort_cache_t *hdr))
 {
-    QMARKFREE(hdr->head);
+    QMARKFREE(hdr->head, hdr->end - hdr->base);
     hdr->head++;
     if (hdr->head == hdr->end)
         hdr->head = hdr->base;
@@ -1689,23 +2004,198 @@ advance_head(volatile am_ctl_qshort_cache_t *hdr))
 #define AMSH_ZERO_POLLS_BEFORE_YIELD    64
 #define AMSH_POLLS_BEFORE_PSM_POLL      16
 
-/* XXX this can be made faster.  Instead of checking the flag of the head, keep
- * a cached copy of the integer value of the tail and compare it against the
- * previous one we saw.
- */
+/* Copy a request from the shared fifo to its sender's parked list and
+ * release its medium payload.  Only short requests reach MQ handlers.
+ * Returns 0 if there was no memory, the request then stays in the fifo. */
+static
+int
+amsh_park(ptl_t *ptl, am_pkt_short_t *pkt)
+{
+    int shmidx = pkt->shmidx;
+    am_pkt_bulk_t *bulkpkt = NULL;
+    amsh_parked_t *p;
+    uint32_t len;
+
+    if (pkt->type == AMFMT_SHORT) {
+        bulkpkt = (am_pkt_bulk_t *) 
+            ((uintptr_t) amsh_qdir[ptl->shmidx].qreqFifoMed +
+             pkt->bulkidx * amsh_qelemsz.qreqFifoMed);
+        len = bulkpkt->len;
+    }
+    else {
+        psmi_assert_always(pkt->type == AMFMT_SHORT_INLINE);
+        len = pkt->length;
+    }
+
+    p = (amsh_parked_t *) 
+        psmi_malloc(ptl->ep, UNEXPECTED_BUFFERS, sizeof(amsh_parked_t) + len);
+    if_pf (p == NULL)
+        return 0;
+    p->next = NULL;
+    p->handleridx = pkt->handleridx;
+    p->nargs = pkt->nargs;
+    p->len = len;
+    memcpy(p->args, pkt->args, pkt->nargs * sizeof(psm_amarg_t));
+    if (bulkpkt != NULL) {
+        psmi_mq_mtucpy(p->payload, bulkpkt->payload, len);
+        QMARKFREE(bulkpkt, amsh_qcounts.qreqFifoMed);
+    }
+    else if (len > 0)
+        memcpy(p->payload, &pkt->args[pkt->nargs], len);
+
+    if (ptl->parked[shmidx].first == NULL) {
+        ptl->parked[shmidx].lastp = &ptl->parked[shmidx].first;
+        ptl->nparked++;
+        amsh_qdir[ptl->shmidx].aux->mq_hold[shmidx] = 1;
+    }
+    *(ptl->parked[shmidx].lastp) = p;
+    ptl->parked[shmidx].lastp = &p->next;
+    _IPATH_VDBG("parked hidx=%d len=%d from shmidx=%d\n", 
+                p->handleridx, len, shmidx);
+    return 1;
+}
+
+/* Drop whatever is parked for the sender at shmidx and let it send again */
+static
+void
+amsh_parked_drop(ptl_t *ptl, int shmidx)
+{
+    amsh_parked_t *p;
+
+    if (ptl->parked[shmidx].first == NULL)
+        return;
+    while ((p = ptl->parked[shmidx].first) != NULL) {
+        ptl->parked[shmidx].first = p->next;
+        psmi_free(p);
+    }
+    ptl->nparked--;
+    amsh_qdir[ptl->shmidx].aux->mq_hold[shmidx] = 0;
+}
+
+/* Run the parked requests of every sender whose first one was refused before
+ * the MQ last made room, in order, up to one that is refused again.  Returns
+ * non-zero if any request ran. */
+static
+int
+amsh_run_parked(ptl_t *ptl)
+{
+    amsh_am_token_t tok;
+    amsh_parked_t *p;
+    uint64_t stamp;
+    int i, progress = 0;
+
+    tok.ptl = ptl;
+    tok.mq = ptl->ep->mq;
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS && ptl->nparked; i++) {
+        stamp = psmi_mq_sysbuf_retry_stamp(ptl->ep->mq);
+        if ((p = ptl->parked[i].first) == NULL || 
+            ptl->parked[i].retry_stamp == stamp)
+            continue;
+        tok.tok.epaddr_from = ptl->shmidx_map_epaddr[i];
+        tok.shmidx = i;
+        do {
+            tok.deferred = 0;
+            ((psmi_handler_fn_t) psmi_allhandlers[p->handleridx].fn)(&tok, 
+                p->args, p->nargs, p->len > 0 ? (void *) p->payload : NULL, 
+                p->len);
+            if (tok.deferred) {
+                ptl->parked[i].retry_stamp = 
+                    psmi_mq_sysbuf_retry_stamp(ptl->ep->mq);
+                break;
+            }
+            progress = 1;
+            ptl->parked[i].first = p->next;
+            psmi_free(p);
+        } while ((p = ptl->parked[i].first) != NULL);
+        if (p == NULL) {
+            ptl->nparked--;
+            amsh_qdir[ptl->shmidx].aux->mq_hold[i] = 0;
+        }
+    }
+    return progress;
+}
+
+/* Drain the request rings of the senders that flagged theirs as pending, the
+ * caller has already cleared AMSH_PENDING_RING.  A ring whose head the MQ had
+ * no room for is left alone, flagged, until the MQ makes room, the others are
+ * drained as usual.  Returns non-zero if any packet was processed. */
+static
+int
+amsh_poll_rings(ptl_t *ptl)
+{
+    volatile uint8_t *pending = amsh_qdir[ptl->shmidx].aux->ring_pending;
+    volatile am_pkt_short_t *pkt;
+    int i, j, head, progress = 0;
+
+    /* Look at the pending bytes 8 at a time, it's one cache line for all */
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i += 8) {
+        if (*((volatile uint64_t *) &pending[i]) == 0)
+            continue;
+        for (j = i; j < i + 8; j++) {
+            if (!pending[j])
+                continue;
+            if_pf (ptl->ring[j].rx_deferred) {
+                if (ptl->ring[j].rx_retry_stamp == 
+                    psmi_mq_sysbuf_retry_stamp(ptl->ep->mq)) {
+                    ptl->pending->q[AMSH_PENDING_RING] = 1;
+                    continue;
+                }
+                ptl->ring[j].rx_deferred = 0;
+            }
+            /* Clear before looking at the ring, a sender that queues after
+             * our last look will see the byte clear and set it again */
+            pending[j] = 0;
+            ips_mb();
+
+            head = ptl->ring[j].rx_head;
+            pkt = amsh_qdir[ptl->shmidx].qreqRings + j*AMSH_RING_SLOTS + head;
+            while (!QISEMPTY(pkt->flag)) {
+                ips_sync_reads();
+                if_pf (!process_packet(ptl, (am_pkt_short_t *) pkt, 1)) {
+                    /* The ring itself holds the rest of this sender's
+                     * requests back, retry its head once there's room */
+                    pending[j] = 1;
+                    ptl->pending->q[AMSH_PENDING_RING] = 1;
+                    ptl->ring[j].rx_deferred = 1;
+                    ptl->ring[j].rx_retry_stamp = 
+                        psmi_mq_sysbuf_retry_stamp(ptl->ep->mq);
+                    break;
+                }
+                QMARKFREE(pkt, AMSH_RING_SLOTS);
+                progress = 1;
+                head = (head + 1) & (AMSH_RING_SLOTS - 1);
+                pkt = amsh_qdir[ptl->shmidx].qreqRings + 
+                      j*AMSH_RING_SLOTS + head;
+            }
+            ptl->ring[j].rx_head = head;
+        }
+    }
+    return progress;
+}
+
+/* Queues are only looked at once a peer has flagged them in our pending word.
+ * A flag is cleared before its queue is drained, with a fence in between, and
+ * peers fence between queueing and checking the flag, so either we see the
+ * packet or the peer sees the flag clear and sets it again. */
 PSMI_ALWAYS_INLINE(
 psm_error_t
 amsh_poll_internal_inner(ptl_t *ptl, int replyonly, int is_internal))
 {
     psm_error_t err = PSM_OK_NO_PROGRESS;
+    am_ctl_pending_t pending;
+
+    pending.any = ptl->pending->any;
+
     /* poll replies */
-    if (!QISEMPTY(ptl->repH.head->flag)) {
-        do {
+    if (pending.q[AMSH_PENDING_REP]) {
+        ptl->pending->q[AMSH_PENDING_REP] = 0;
+        ips_mb();
+        while (!QISEMPTY(ptl->repH.head->flag)) {
             ips_sync_reads();
             process_packet(ptl, (am_pkt_short_t *) ptl->repH.head, 0);
 	    advance_head(&ptl->repH);
             err = PSM_OK;
-        } while (!QISEMPTY(ptl->repH.head->flag));
+        }
     }
 
     if (!replyonly) {
@@ -1715,13 +2205,39 @@ amsh_poll_internal_inner(ptl_t *ptl, int replyonly, int is_internal))
             psmi_am_reqq_drain();
             err = PSM_OK;
         }
-        if (!QISEMPTY(ptl->reqH.head->flag)) {
-            do {
+        /* A request the MQ had no buffer space for is parked with its
+         * sender's later MQ requests, everything else keeps flowing.  If
+         * even that isn't possible the fifo waits, with its flag set. */
+        if_pf (ptl->nparked && amsh_run_parked(ptl))
+            err = PSM_OK;
+        if (pending.q[AMSH_PENDING_REQ]) {
+            ptl->pending->q[AMSH_PENDING_REQ] = 0;
+            ips_mb();
+            while (!QISEMPTY(ptl->reqH.head->flag)) {
+                am_pkt_short_t *pkt = (am_pkt_short_t *) ptl->reqH.head;
+                int taken = 1;
                 ips_sync_reads();
-                process_packet(ptl, (am_pkt_short_t *) ptl->reqH.head, 1);
+                if_pf (ptl->parked[pkt->shmidx].first != NULL &&
+                       AMSH_HIDX_IS_MQ(pkt->handleridx))
+                    taken = amsh_park(ptl, pkt);
+                else if_pf (!process_packet(ptl, pkt, 1)) {
+                    if ((taken = amsh_park(ptl, pkt)))
+                        ptl->parked[pkt->shmidx].retry_stamp = 
+                            psmi_mq_sysbuf_retry_stamp(ptl->ep->mq);
+                }
+                if_pf (!taken) {
+                    ptl->pending->q[AMSH_PENDING_REQ] = 1;
+                    break;
+                }
 	        advance_head(&ptl->reqH);
                 err = PSM_OK;
-            } while (!QISEMPTY(ptl->reqH.head->flag));
+            }
+        }
+        if (pending.q[AMSH_PENDING_RING]) {
+            ptl->pending->q[AMSH_PENDING_RING] = 0;
+            ips_mb();
+            if (amsh_poll_rings(ptl))
+                err = PSM_OK;
         }
     }
 
@@ -1783,9 +2299,15 @@ am_send_pkt_short(ptl_t *ptl, uint32_t destidx, uint32_t bulkidx,
 {
     int i;
     volatile am_pkt_short_t *pkt;
+    am_ctl_blockaux_t *aux;
+    int use_ring = !isreply && ptl->ring[destidx].tx_on;
 
-    AMSH_POLL_UNTIL(ptl, isreply,
-        (pkt = am_ctl_getslot_pkt(destidx, isreply)) != NULL);
+    if (use_ring)
+        AMSH_POLL_UNTIL(ptl, isreply,
+            (pkt = am_ctl_getslot_ring(ptl, destidx)) != NULL);
+    else
+        AMSH_POLL_UNTIL(ptl, isreply,
+            (pkt = am_ctl_getslot_pkt(destidx, isreply)) != NULL);
 
     /* got a free pkt... fill it in */
     pkt->bulkidx = bulkidx;
@@ -1802,6 +2324,25 @@ am_send_pkt_short(ptl_t *ptl, uint32_t destidx, uint32_t bulkidx,
                 pkt->flag, pkt->nargs, src, (int) len, (int) handleridx,
                 src != NULL ?  *((uint32_t *)src): 0); 
     QMARKREADY(pkt);
+
+    /* Flag pkt for the peer's polls, and wake the peer if it sleeps in a
+     * wait, it may have just missed pkt */
+    ips_mb();
+    aux = amsh_qdir[destidx].aux;
+    if (use_ring) {
+        /* A ring flagged before is still flagged in the pending word */
+        if (!aux->ring_pending[ptl->shmidx]) {
+            aux->ring_pending[ptl->shmidx] = 1;
+            ips_wmb();
+            aux->pending.q[AMSH_PENDING_RING] = 1;
+        }
+    }
+    else {
+        int q = isreply ? AMSH_PENDING_REP : AMSH_PENDING_REQ;
+        if (!aux->pending.q[q])
+            aux->pending.q[q] = 1;
+    }
+    psmi_doorbell_ring(&aux->doorbell);
 }
 
 /* It's probably unlikely that the alloca below is problematic, but
@@ -1810,13 +2351,27 @@ am_send_pkt_short(ptl_t *ptl, uint32_t destidx, uint32_t bulkidx,
 #define ALLOCA_AS_SCRATCH 0
 
 #if ALLOCA_AS_SCRATCH
-static char amsh_medscratch[AMMED_SZ];
+static char amsh_medscratch[AMSH_MED_SZ_MAX];
 #endif
 
 #define amsh_shm_copy_short psmi_mq_mtucpy
 #define amsh_shm_copy_long  psmi_mq_mtucpy
 #define amsh_shm_copy_huge  psmi_memcpyo
 
+/* Copy a short payload in from src, which may be an iovec cursor */
+PSMI_ALWAYS_INLINE(
+void
+amsh_copy_src(void *dst, const void *src, uint32_t len, int flags))
+{
+    if_pf (flags & AM_FLAG_SRC_IOV) {
+        struct am_iov_src *isrc = (struct am_iov_src *) src;
+        psmi_mq_iov_gather(dst, isrc->iov, isrc->iovcnt, isrc->off, len);
+        isrc->off += len;
+    }
+    else
+        amsh_shm_copy_short(dst, src, len);
+}
+
 PSMI_ALWAYS_INLINE(
 int
 psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
@@ -1842,11 +2397,12 @@ psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
         tok.ptl = ptl;
         tok.mq = ptl->ep->mq;
         tok.shmidx = ptl->shmidx;
+        tok.deferred = 0;
         if (len > 0) {
             if (AM_IS_LONG(amtype))
                 bufa = dst;
             else {
-                psmi_assert_always(len <= AMMED_SZ);
+                psmi_assert_always(len <= amsh_med_sz);
 #if ALLOCA_AS_SCRATCH
                 bufa = (void *) amsh_medscratch;
 #else
@@ -1854,7 +2410,7 @@ psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
 #endif
             }
             psmi_assert(bufa != NULL);
-            amsh_shm_copy_short((void *) bufa, src, len);
+            amsh_copy_src((void *) bufa, src, len, flags);
         }
         else
             bufa = NULL;
@@ -1865,6 +2421,14 @@ psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
         return 1;
     }
 
+    /* The receiver has MQ requests of ours parked, queue no more of them
+     * through the shared fifo until it has taken those.  A request ring
+     * holds them back by itself. */
+    if_pf (!is_reply && AMSH_HIDX_IS_MQ(hidx) && !ptl->ring[destidx].tx_on &&
+           amsh_qdir[destidx].aux->mq_hold[ptl->shmidx])
+        AMSH_POLL_UNTIL(ptl, is_reply, 
+            !amsh_qdir[destidx].aux->mq_hold[ptl->shmidx]);
+
     switch (amtype) {
         case AMREQUEST_SHORT:
         case AMREPLY_SHORT:
@@ -1872,6 +2436,13 @@ psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
                 /* Payload fits in args packet */
                 type = AMFMT_SHORT_INLINE;
                 bulkidx = len;
+                if_pf (flags & AM_FLAG_SRC_IOV) {
+                    uint32_t tiny[NSHORT_ARGS*2];
+                    amsh_copy_src(tiny, src, len, flags);
+                    am_send_pkt_short(ptl, destidx, bulkidx, type, nargs, hidx,
+                                      args, tiny, len, is_reply);
+                    break;
+                }
             }
             else {
                 psmi_assert(len < amsh_qelemsz.qreqFifoMed);
@@ -1893,7 +2464,8 @@ psmi_amsh_generic_inner(uint32_t amtype, ptl_t *ptl, psm_epaddr_t epaddr,
                 bulkpkt->len = len;
                 _IPATH_VDBG("bulkpkt %p flag is %d from idx %d\n", 
                     bulkpkt, bulkpkt->flag, destidx);
-                amsh_shm_copy_short((void*) bulkpkt->payload, src, (uint32_t) len);
+                amsh_copy_src((void*) bulkpkt->payload, src, (uint32_t) len, 
+                              flags);
                 QMARKREADY(bulkpkt);
             }
             am_send_pkt_short(ptl, destidx, bulkidx, type, nargs, hidx,
@@ -2095,8 +2667,11 @@ psmi_am_reqq_add(int amtype, ptl_t *ptl, psm_epaddr_t epaddr,
     psmi_am_reqq_fifo.lastp = &nreq->next;
 }
 
+/* Returns 0 if the handler deferred the packet, which is then left as it is
+ * with its medium payload for the caller to retry or park (only short
+ * requests can be deferred this way) */
 static 
-void
+int
 process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
 {
     amsh_am_token_t    tok;
@@ -2107,11 +2682,13 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
     tok.ptl = ptl;
     tok.mq = ptl->ep->mq;
     tok.shmidx = shmidx;
+    tok.deferred = 0;
 
     uint16_t hidx = (uint16_t) pkt->handleridx;
     int myshmidx = ptl->shmidx;
     int shmidx_l = AMSH_BULK_PUSH ? myshmidx : shmidx;
     uint32_t bulkidx = pkt->bulkidx;
+    uint32_t bulkcnt;
     uintptr_t bulkptr;
     am_pkt_bulk_t *bulkpkt;
 
@@ -2126,6 +2703,8 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
 
         fn(&tok, pkt->args, pkt->nargs, pkt->length > 0 ? 
            (void *) &pkt->args[pkt->nargs] : NULL, pkt->length);
+        if_pf (tok.deferred)
+            return 0;
     }
     else {
         int isend = 0;
@@ -2134,10 +2713,12 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
                 if (isreq) {
                     bulkptr = (uintptr_t) amsh_qdir[myshmidx].qreqFifoMed;
                     bulkptr += bulkidx * amsh_qelemsz.qreqFifoMed;
+                    bulkcnt = amsh_qcounts.qreqFifoMed;
                 }
                 else {
                     bulkptr = (uintptr_t) amsh_qdir[myshmidx].qrepFifoMed;
                     bulkptr += bulkidx * amsh_qelemsz.qrepFifoMed;
+                    bulkcnt = amsh_qcounts.qrepFifoMed;
                 }
                 break;
 
@@ -2147,10 +2728,12 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
                 if (isreq) {
                     bulkptr = (uintptr_t) amsh_qdir[shmidx_l].qreqFifoLong;
                     bulkptr += bulkidx * amsh_qelemsz.qreqFifoLong;
+                    bulkcnt = amsh_qcounts.qreqFifoLong;
                 }
                 else {
                     bulkptr = (uintptr_t) amsh_qdir[shmidx_l].qrepFifoLong;
                     bulkptr += bulkidx * amsh_qelemsz.qrepFifoLong;
+                    bulkcnt = amsh_qcounts.qrepFifoLong;
                 }
                 break;
 
@@ -2160,14 +2743,17 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
                 if (isreq) {
                     bulkptr = (uintptr_t) amsh_qdir[shmidx_l].qreqFifoHuge;
                     bulkptr += bulkidx * amsh_qelemsz.qreqFifoHuge;
+                    bulkcnt = amsh_qcounts.qreqFifoHuge;
                 }
                 else {
                     bulkptr = (uintptr_t) amsh_qdir[shmidx_l].qrepFifoHuge;
                     bulkptr += bulkidx * amsh_qelemsz.qrepFifoHuge;
+                    bulkcnt = amsh_qcounts.qrepFifoHuge;
                 }
                 break;
             default:
                 bulkptr = 0;
+                bulkcnt = 0;
                 psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
                     "Unknown/unhandled packet type 0x%x", pkt->type);
         }
@@ -2177,11 +2763,13 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
                     "from_idx=%d pkt=%p/%p hidx=%d\n",
                     ptl->ep, ptl->ep->mq, pkt->type, bulkidx, pkt->flag, 
                     bulkpkt->flag, pkt->nargs, shmidx, pkt, bulkpkt, hidx);
-        psmi_assert(bulkpkt->flag == QREADY);
+        psmi_assert(QSTATE(bulkpkt->flag) == QREADY);
         if (pkt->type == AMFMT_SHORT) {
                 fn(&tok, pkt->args, pkt->nargs, 
                     (void *) bulkpkt->payload, bulkpkt->len);
-            QMARKFREE(bulkpkt);
+            if_pf (tok.deferred) /* keep the payload for the retry */
+                return 0;
+            QMARKFREE(bulkpkt, bulkcnt);
         }
         else {
             if (pkt->type == AMFMT_HUGE || pkt->type == AMFMT_HUGE_END)
@@ -2201,14 +2789,15 @@ process_packet(ptl_t *ptl, am_pkt_short_t *pkt, int isreq)
                 size_t len = (size_t) (bulkpkt->dest_off + bulkpkt->len);
                 for (i = 0; i < nargs; i++)
                     args[i] = pkt->args[i];
-                QMARKFREE(bulkpkt);
+                QMARKFREE(bulkpkt, bulkcnt);
                 fn(&tok, args, nargs, dest, len);
             }
             else 
-                QMARKFREE(bulkpkt);
+                QMARKFREE(bulkpkt, bulkcnt);
         }
     }
-    return;
+    psmi_assert(!tok.deferred);
+    return 1;
 }
 
 static
@@ -2231,19 +2820,52 @@ amsh_mq_rndv(ptl_t *ptl, psm_mq_t mq, psm_mq_req_t req,
     req->buf_len = len;
     req->send_msglen = len;
     req->send_msgoff = 0;
+    req->rts_peer = epaddr;
 
     psmi_amsh_short_request(ptl, epaddr, mq_handler_hidx, args, 4, NULL, 0, 0);
 
     return err;
 }
 
+static
+psm_error_t
+amsh_mq_cancel(ptl_t *ptl, psm_mq_req_t req)
+{
+    psm_amarg_t args[2];
+
+    args[0].u64w0 = req->tag;
+    args[1].u64w0 = (uint64_t)(uintptr_t) req;
+    psmi_amsh_short_request(ptl, req->rts_peer, mq_handler_rtscancel_hidx, 
+			    args, 2, NULL, 0, 0);
+    return PSM_OK;
+}
+
+/* The records of a batch are copied into a single medium packet */
+static
+psm_error_t
+amsh_mq_send_batch(ptl_t *ptl, psm_epaddr_t epaddr, const void *buf, 
+		   uint32_t len, uint32_t *nsent)
+{
+    psm_amarg_t args[2];
+
+    psmi_assert(len <= psmi_am_max_sizes.request_short);
+    args[0].u32w0 = MQ_MSG_BATCH;
+    args[0].u32w1 = len;
+    args[1].u64 = 0;
+    psmi_amsh_short_request(ptl, epaddr, mq_handler_hidx, args, 2, 
+			    buf, len, 0);
+    *nsent = len;
+    return PSM_OK;
+}
+
 /*
  * All shared am mq sends, req can be NULL
  */
 PSMI_ALWAYS_INLINE(
 psm_error_t
 amsh_mq_send_inner(ptl_t *ptl, psm_mq_t mq, psm_mq_req_t req, psm_epaddr_t epaddr, 
-                   uint32_t flags, uint64_t tag, const void *ubuf, uint32_t len))
+                   uint32_t flags, uint64_t tag, const void *ubuf, uint32_t len,
+                   int amflags))
 {
     psm_amarg_t args[2];
     psm_error_t err = PSM_OK;
@@ -2257,7 +2879,7 @@ amsh_mq_send_inner(ptl_t *ptl, psm_mq_t mq, psm_mq_req_t req, psm_epaddr_t epadd
 	args[1].u64 = tag;
 
 	psmi_amsh_short_request(ptl, epaddr, mq_handler_hidx, args, 2, 
-				ubuf, len, 0);
+				ubuf, len, amflags);
     }
     else if (flags & PSM_MQ_FLAG_SENDSYNC)
         goto do_rendezvous;
@@ -2265,20 +2887,22 @@ amsh_mq_send_inner(ptl_t *ptl, psm_mq_t mq, psm_mq_req_t req, psm_epaddr_t epadd
 	uint32_t bytes_left = len;
 	uint32_t bytes_this = min(bytes_left, psmi_am_max_sizes.request_short);
 	uint8_t *buf = (uint8_t *)ubuf;
+	/* An iovec cursor advances itself */
+	int stride = !(amflags & AM_FLAG_SRC_IOV);
 	args[0].u32w0 = MQ_MSG_LONG;
         args[0].u32w1 = len;
 	args[1].u64 = tag;
 	psmi_amsh_short_request(ptl, epaddr, mq_handler_hidx, args, 2, 
-				buf, bytes_this, 0);
+				buf, bytes_this, amflags);
 	bytes_left -= bytes_this;
-	buf += bytes_this;
+	buf += stride * bytes_this;
 	while (bytes_left) {
 	    bytes_this = min(bytes_left, psmi_am_max_sizes.request_short);
 	    /* Here we kind of bend the rules, and assume that shared-memory
 	     * active messages are delivered in order */
 	    psmi_amsh_short_request(ptl, epaddr, mq_handler_data_hidx, args, 
-				    2, buf, bytes_this, 0);
-	    buf += bytes_this;
+				    2, buf, bytes_this, amflags);
+	    buf += stride * bytes_this;
 	    bytes_left -= bytes_this;
 	}
     }
@@ -2302,7 +2926,7 @@ do_rendezvous:
     /* All eager async sends are always "all done" */
     if (req != NULL) {
         req->state = MQ_STATE_COMPLETE;
-        mq_qq_append(&mq->completed_q, req);
+        mq_complete_append(mq, req);
     }
 
     mq->stats.tx_num++;
@@ -2331,7 +2955,55 @@ amsh_mq_isend(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags,
         psmi_epaddr_get_name(ptl->epid),
         psmi_epaddr_get_name(epaddr->epid), ubuf, len, tag);
 
-    amsh_mq_send_inner(ptl, mq, req, epaddr, flags, tag, ubuf, len);
+    amsh_mq_send_inner(ptl, mq, req, epaddr, flags, tag, ubuf, len, 0);
+
+    *req_o = req;
+    return PSM_OK;
+}
+
+/*
+ * Eager iovec sends gather straight into the packet payloads, rendezvous
+ * sends go out of a staged copy.
+ */
+static
+psm_error_t
+amsh_mq_isendv(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags, 
+	       uint64_t tag, const struct iovec *iov, uint32_t iovcnt, 
+	       uint32_t len, void *context, psm_mq_req_t *req_o)
+{
+    struct am_iov_src src;
+    psm_mq_req_t req;
+    psm_error_t err;
+    void *buf;
+
+    if (flags || len > mq->shm_thresh_rv) {
+	buf = psmi_mq_iov_stage(mq, iov, iovcnt, len);
+	err = amsh_mq_isend(ptl, mq, epaddr, flags, tag, buf, len, context, 
+			    req_o);
+	if (err == PSM_OK)
+	    mq_req_set_stage(mq, *req_o, buf);
+	else
+	    psmi_free(buf);
+	return err;
+    }
+
+    req = psmi_mq_req_alloc(mq, MQE_TYPE_SEND);
+    if_pf (req == NULL)
+        return PSM_NO_MEMORY;
+
+    req->send_msglen = len;
+    req->tag = tag;
+    req->context = context;
+
+    _IPATH_VDBG("[ishrtv][%s->%s][n=%d][l=%d][t=%"PRIx64"]\n", 
+        psmi_epaddr_get_name(ptl->epid),
+        psmi_epaddr_get_name(epaddr->epid), iovcnt, len, tag);
+
+    src.iov = iov;
+    src.iovcnt = iovcnt;
+    src.off = 0;
+    amsh_mq_send_inner(ptl, mq, req, epaddr, flags, tag, &src, len, 
+		       AM_FLAG_SRC_IOV);
 
     *req_o = req;
     return PSM_OK;
@@ -2342,7 +3014,7 @@ psm_error_t
 amsh_mq_send(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags, 
 	      uint64_t tag, const void *ubuf, uint32_t len)
 {
-    amsh_mq_send_inner(ptl, mq, NULL, epaddr, flags, tag, ubuf, len);
+    amsh_mq_send_inner(ptl, mq, NULL, epaddr, flags, tag, ubuf, len, 0);
 
     _IPATH_VDBG("[shrt][%s->%s][n=0][b=%p][l=%d][t=%"PRIx64"]\n", 
         psmi_epaddr_get_name(ptl->epid),
@@ -2428,6 +3100,24 @@ psmi_kcopy_getmode(int mode)
  * arg2 => version.
  * arg3 => pointer to error for replies.
  */
+/* (Re)start the request ring of the sender at shmidx from its first slot */
+static
+void
+amsh_ring_setup(ptl_t *ptl, int shmidx, psm_epid_t epid)
+{
+    am_ctl_blockaux_t *aux = amsh_qdir[ptl->shmidx].aux;
+
+    am_ctl_shortpkt_init(amsh_qdir[ptl->shmidx].qreqRings + 
+                         shmidx * AMSH_RING_SLOTS, AMSH_RING_SLOTS);
+    ptl->ring[shmidx].rx_head = 0;
+    ptl->ring[shmidx].rx_deferred = 0;
+    ptl->ring[shmidx].rx_retry_stamp = 0;
+    aux->ring_pending[shmidx] = 0;
+    aux->ring_epid[shmidx] = epid;
+    _IPATH_PRDBG("Request ring set up for epid %" PRIx64 " at shmidx=%d\n",
+                 epid, shmidx);
+}
+
 static
 void
 amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len)
@@ -2471,6 +3161,10 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
             /* Do some version comparison, error checking if required. */
             /* Rewrite args */
             ptl->connect_from++;
+            if (shmidx != ptl->shmidx)
+                amsh_parked_drop(ptl, shmidx);
+            if (ptl->ring_enabled && shmidx != ptl->shmidx)
+                amsh_ring_setup(ptl, shmidx, epid);
             args[0].u32w0 = PSMI_AM_CONN_REP;
             args[1].u64w0 = (psm_epid_t) ptl->epid;
             args[2].u32w1 = PSM_OK;
@@ -2487,6 +3181,10 @@ amsh_conn_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len
             }
             epaddr = ptl->shmidx_map_epaddr[shmidx];
             *perr = err;
+            /* Use the ring the peer has set up for us, if any */
+            ptl->ring[shmidx].tx_tail = 0;
+            ptl->ring[shmidx].tx_on = ptl->ring_enabled && 
+                amsh_qdir[shmidx].aux->ring_epid[ptl->shmidx] == ptl->epid;
             AMSH_CSTATE_TO_SET(epaddr, REPLIED);
             ptl->connect_to++;
             _IPATH_VDBG("CCC epaddr=%s connected to ptl=%p\n",
@@ -2562,6 +3260,10 @@ amsh_init(psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
     ptl->epaddr = ep->epaddr; /* cache a copy */
     ptl->ctl    = ctl;
     ptl->zero_polls = 0;
+    ptl->nparked = 0;
+    memset(ptl->parked, 0, sizeof(ptl->parked));
+    ptl->pending = &amsh_empty_pending;
+    memset(ptl->ring, 0, sizeof(ptl->ring));
 
     pthread_mutex_init(&ptl->connect_lock, NULL);
     ptl->connect_phase = 0;
@@ -2570,6 +3272,7 @@ amsh_init(psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
 
     if ((err = amsh_init_segment(ptl)))
         goto fail;
+    ptl->ring_enabled = amsh_dirpage->geometry.rings;
 
     psmi_am_reqq_init();
     memset(ctl, 0, sizeof(*ctl));
@@ -2582,6 +3285,9 @@ amsh_init(psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
 
     ctl->mq_send  = amsh_mq_send;
     ctl->mq_isend = amsh_mq_isend;
+    ctl->mq_isendv = amsh_mq_isendv;
+    ctl->mq_cancel = amsh_mq_cancel;
+    ctl->mq_send_batch = amsh_mq_send_batch;
     
     ctl->am_short_request = psmi_amsh_am_short_request;
     ctl->am_short_reply   = psmi_amsh_am_short_reply;
@@ -2667,6 +3373,7 @@ amsh_fini(ptl_t *ptl, int force, uint64_t timeout_ns)
                 ptl->connect_from,
                 ptl->connect_to);
 
+    ptl->ep->doorbell = &ptl->ep->doorbell_local;
     if ((err_seg = psmi_shm_detach())) {
         err = err_seg;
         goto fail;
@@ -2676,6 +3383,17 @@ amsh_fini(ptl_t *ptl, int force, uint64_t timeout_ns)
      * deallocated to reference memory that disappeared */
     ptl->repH.head  = &amsh_empty_shortpkt;
     ptl->reqH.head  = &amsh_empty_shortpkt;
+    ptl->pending    = &amsh_empty_pending;
+
+    /* Requests still parked have no receiver left */
+    for (i = 0; i < PTL_AMSH_MAX_LOCAL_PROCS; i++) {
+        amsh_parked_t *p;
+        while ((p = ptl->parked[i].first) != NULL) {
+            ptl->parked[i].first = p->next;
+            psmi_free(p);
+        }
+    }
+    ptl->nparked = 0;
 
     return PSM_OK;
 fail:
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2006-2010. QLogic Corporation. All rights reserved.
+ * Copyright (c) 2003-2006, PathScale, Inc. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cmarw.h"
+
+/* C libraries older than the syscalls don't know their numbers */
+#ifndef __NR_process_vm_readv
+#  if defined(__x86_64__)
+#    define __NR_process_vm_readv  310
+#    define __NR_process_vm_writev 311
+#  elif defined(__i386__)
+#    define __NR_process_vm_readv  347
+#    define __NR_process_vm_writev 348
+#  endif
+#endif
+
+#ifdef __NR_process_vm_readv
+/* The kernel may stop short of n bytes, keep going until it's all there */
+static int64_t cma_rw(long nr, pid_t pid, void *local, void *remote, 
+		      int64_t n) {
+	struct iovec liov, riov;
+	int64_t done = 0;
+	long ret;
+
+	while (done < n) {
+		liov.iov_base = (char *) local + done;
+		liov.iov_len = n - done;
+		riov.iov_base = (char *) remote + done;
+		riov.iov_len = n - done;
+		ret = syscall(nr, pid, &liov, 1, &riov, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+int64_t cma_get(pid_t pid, const void *src, void *dst, int64_t n) {
+	return cma_rw(__NR_process_vm_readv, pid, dst, (void *) src, n);
+}
+
+int64_t cma_put(const void *src, pid_t pid, void *dst, int64_t n) {
+	return cma_rw(__NR_process_vm_writev, pid, (void *) src, dst, n);
+}
+#else
+int64_t cma_get(pid_t pid, const void *src, void *dst, int64_t n) {
+	errno = ENOSYS;
+	return -1;
+}
+
+int64_t cma_put(const void *src, pid_t pid, void *dst, int64_t n) {
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+int cma_available(void) {
+	uint64_t src = 0x70736d636d61ULL, dst = 0;
+
+	return cma_get(getpid(), &src, &dst, sizeof(dst)) == sizeof(dst) &&
+	       dst == src;
+}
@@ -47,6 +47,7 @@ struct amsh_am_token
   psm_mq_t	    mq;   /**> What matched queue is this for ? */
   int		    shmidx; /**> what shmidx sent this */
   int loopback;	  /**> Whether to reply as loopback */
+  int deferred;	  /**> Set by a handler that couldn't take the packet yet */
 }
 amsh_am_token_t;
 
@@ -62,6 +63,10 @@ typedef struct psmi_handlertab {
 #define PSMI_MQ_RV_THRESH_KCOPY	   16000
 #define PSMI_MQ_RV_THRESH_NO_KCOPY 16000
 
+/* Measured threshold (0 if not calibrated), in am_calibrate.c */
+uint32_t psmi_shm_calibrate_rv_thresh(uint32_t med_sz, uint32_t long_sz, 
+				      int kassist); /* PSMI_KASSIST_* */
+
 #define PSMI_AM_CONN_REQ    1
 #define PSMI_AM_CONN_REP    2
 #define PSMI_AM_DISC_REQ    3
@@ -73,8 +78,15 @@ typedef struct psmi_handlertab {
 #define PSMI_KCOPY_MODE_DEFAULT	PSMI_KCOPY_MODE_PUT
 #define PSMI_KCOPY_MODE_DEFAULT_STRING	"put"
 
+/* How the kcopy mode moves data, chosen when attaching to the segment: the
+ * kcopy module if it's loaded, else cross-memory attach */
+#define PSMI_KASSIST_OFF    0
+#define PSMI_KASSIST_KCOPY  1
+#define PSMI_KASSIST_CMA    2
+
 int psmi_kcopy_mode;
 int psmi_kcopy_fd;
+int psmi_kassist;
 int psmi_epaddr_kcopy_pid(psm_epaddr_t epaddr);
 
 /*
@@ -114,6 +126,8 @@ void psmi_am_mq_handler_data(void *toki, psm_amarg_t *args, int narg, void *buf,
 void psmi_am_mq_handler_complete(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
 void psmi_am_mq_handler_rtsmatch(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
 void psmi_am_mq_handler_rtsdone(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
+void psmi_am_mq_handler_rtscancel(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
+void psmi_am_mq_handler_rtscancel_ack(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
 void psmi_am_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len);
 
 /* AM over shared memory (forward decls) */
@@ -136,6 +150,8 @@ psmi_amsh_am_short_reply(psm_am_token_t tok,
 #define mq_handler_rtsmatch_hidx 4
 #define mq_handler_rtsdone_hidx  5
 #define am_handler_hidx          6
+#define mq_handler_rtscancel_hidx     7
+#define mq_handler_rtscancel_ack_hidx 8
 
 #define AMREQUEST_SHORT 0
 #define AMREQUEST_LONG  1
@@ -148,6 +164,17 @@ psmi_amsh_am_short_reply(psm_am_token_t tok,
 
 #define AM_FLAG_SRC_ASYNC   0x1
 #define AM_FLAG_SRC_TEMP    0x2
+#define AM_FLAG_SRC_IOV     0x4	/* src is a struct am_iov_src cursor */
+
+/*
+ * Source of a short request gathered from iovecs.  Each request consumes
+ * len bytes at off and advances it.
+ */
+struct am_iov_src {
+    const struct iovec *iov;
+    uint32_t	    iovcnt;
+    uint32_t	    off;
+};
 
 /*
  * Request Fifo.
@@ -35,11 +35,38 @@
 #include "psm_mq_internal.h"
 #include "psm_am_internal.h"
 #include "kcopyrw.h"
+#include "cmarw.h"
 
 #define _shmidx _ptladdr_u32
 
 int psmi_kcopy_mode = 0;
 
+/* Flags of an rtsmatch reply */
+#define RTSMATCH_IN_HANDLER 0x1	/* sent from the RTS handler */
+#define RTSMATCH_COPIED	    0x2	/* receiver already pulled the data */
+
+/* Single copies return the number of bytes moved, a failed one leaves the
+ * transfer to the fifos */
+PSMI_ALWAYS_INLINE(
+int64_t
+ptl_kassist_get(pid_t pid, const void *src, void *dst, int64_t n))
+{
+    if (psmi_kassist == PSMI_KASSIST_CMA)
+	return cma_get(pid, src, dst, n);
+    else
+	return kcopy_get(psmi_kcopy_fd, pid, src, dst, n);
+}
+
+PSMI_ALWAYS_INLINE(
+int64_t
+ptl_kassist_put(const void *src, pid_t pid, void *dst, int64_t n))
+{
+    if (psmi_kassist == PSMI_KASSIST_CMA)
+	return cma_put(src, pid, dst, n);
+    else
+	return kcopy_put(psmi_kcopy_fd, src, pid, dst, n);
+}
+
 static
 psm_error_t
 ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *tok)
@@ -47,7 +74,8 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
     psm_amarg_t	args[5];
     psm_epaddr_t epaddr = req->rts_peer;
     ptl_t *ptl = epaddr->ptl;
-    int pid = 0;
+    int pid;
+    int copied = 0;
 
     psmi_assert((tok != NULL && was_posted) || (tok == NULL && !was_posted));
 
@@ -58,16 +86,20 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
 	(pid = psmi_epaddr_kcopy_pid(epaddr))) 
     {
 	/* kcopy can be done in handler context or not. */
-	size_t nbytes = kcopy_get(psmi_kcopy_fd, pid, (void *) req->rts_sbuf,
-				  req->buf, req->recv_msglen);
-	psmi_assert_always(nbytes == req->recv_msglen);
+	int64_t nbytes = ptl_kassist_get(pid, (void *) req->rts_sbuf,
+					 req->buf, req->recv_msglen);
+	copied = (nbytes == req->recv_msglen);
+	if_pf (!copied)
+	    _IPATH_VDBG("[shm][rndv][recv] single-copy get from pid %d "
+			"failed, sender will push the data\n", pid);
     }
 
     args[0].u64w0 = (uint64_t)(uintptr_t) req->ptl_req_ptr;
     args[1].u64w0 = (uint64_t)(uintptr_t) req;
     args[2].u64w0 = (uint64_t)(uintptr_t) req->buf;
     args[3].u32w0 = req->recv_msglen;
-    args[3].u32w1 = tok != NULL ? 1 : 0;
+    args[3].u32w1 = (tok != NULL ? RTSMATCH_IN_HANDLER : 0) |
+		    (copied ? RTSMATCH_COPIED : 0);
 
     if (tok != NULL) { 
 	psmi_am_reqq_add(AMREQUEST_SHORT, tok->ptl, tok->tok.epaddr_from, 
@@ -78,7 +110,7 @@ ptl_handle_rtsmatch_request(psm_mq_req_t req, int was_posted, amsh_am_token_t *t
 				    args, 4, NULL, 0, 0);
 
     /* 0-byte completion or we used kcopy */
-    if (pid || req->recv_msglen == 0) 
+    if (copied || req->recv_msglen == 0) 
 	psmi_mq_handle_rts_complete(req);
     return PSM_OK;
 }
@@ -110,6 +142,8 @@ psmi_am_mq_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t le
 	case MQ_MSG_TINY:
 	  rc = psmi_mq_handle_tiny_envelope(tok->mq, tok->tok.epaddr_from, tag,
 					    buf, (uint32_t) len);
+	  /* Over the unexpected buffer budget, retry the packet later */
+	  tok->deferred = (rc == MQ_RET_UNEXP_NO_RESOURCES);
 	  return;
 	  break;
 	case MQ_MSG_SHORT:
@@ -117,6 +151,13 @@ psmi_am_mq_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t le
 	  rc = psmi_mq_handle_envelope(tok->mq, mode, tok->tok.epaddr_from,
 				       tag, (union psmi_egrid) 0U,
 				       msglen, buf, (uint32_t) len);
+	  tok->deferred = (rc == MQ_RET_UNEXP_NO_RESOURCES);
+	  return;
+	  break;
+	case MQ_MSG_BATCH:
+	  rc = psmi_mq_handle_batch(tok->mq, tok->tok.epaddr_from, 
+				    buf, (uint32_t) len);
+	  tok->deferred = (rc == MQ_RET_UNEXP_NO_RESOURCES);
 	  return;
 	  break;
 	default: {
@@ -153,6 +194,7 @@ psmi_am_mq_handler_rtsmatch(void *toki, psm_amarg_t *args, int narg, void *buf,
     psm_mq_req_t sreq = (psm_mq_req_t) (uintptr_t) args[0].u64w0;
     void *dest = (void *)(uintptr_t) args[2].u64w0;
     uint32_t msglen = args[3].u32w0;
+    uint32_t flags = args[3].u32w1;
     int pid = 0;
     psm_amarg_t rarg[1];
 
@@ -161,22 +203,17 @@ psmi_am_mq_handler_rtsmatch(void *toki, psm_amarg_t *args, int narg, void *buf,
 
     if (msglen > 0) {
 	rarg[0].u64w0 = args[1].u64w0; /* rreq */
-	if (psmi_kcopy_mode == PSMI_KCOPY_MODE_PUT ||
-	    psmi_kcopy_mode == PSMI_KCOPY_MODE_GET)
+	if (psmi_kcopy_mode == PSMI_KCOPY_MODE_PUT)
 	    pid = psmi_epaddr_kcopy_pid(tok->tok.epaddr_from);
-	else
-	    pid = 0;
-
-	if (!pid) 
-	    psmi_amsh_long_reply(tok, mq_handler_rtsdone_hidx, rarg, 1, 
-				 sreq->buf, msglen, dest, 0);
-	else if (psmi_kcopy_mode == PSMI_KCOPY_MODE_PUT)
-	{
-	    size_t nbytes = kcopy_put(psmi_kcopy_fd, sreq->buf, pid, dest,
-				      msglen);
-	    psmi_assert_always(nbytes == msglen);
-	    psmi_amsh_short_reply(tok, mq_handler_rtsdone_hidx, rarg, 1,
-				  NULL, 0, 0);
+
+	if (!(flags & RTSMATCH_COPIED)) { /* else the receiver pulled it */
+	    if (pid && 
+		ptl_kassist_put(sreq->buf, pid, dest, msglen) == msglen)
+		psmi_amsh_short_reply(tok, mq_handler_rtsdone_hidx, rarg, 1,
+				      NULL, 0, 0);
+	    else
+		psmi_amsh_long_reply(tok, mq_handler_rtsdone_hidx, rarg, 1, 
+				     sreq->buf, msglen, dest, 0);
 	}
     }
     psmi_mq_handle_rts_complete(sreq);
@@ -191,6 +228,42 @@ psmi_am_mq_handler_rtsdone(void *toki, psm_amarg_t *args, int narg, void *buf, s
     psmi_mq_handle_rts_complete(rreq);
 }
 
+static
+int
+ptl_rts_is_sender(psm_mq_req_t req, uintptr_t sreq)
+{
+    return req->ptl_req_ptr == (void *) sreq;
+}
+
+void
+psmi_am_mq_handler_rtscancel(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len)
+{
+    amsh_am_token_t *tok = (amsh_am_token_t *) toki;
+    psm_mq_req_t rreq;
+    psm_amarg_t rarg[2];
+
+    psmi_assert(narg == 2);
+    rreq = psmi_mq_handle_rts_cancel(tok->mq, args[0].u64w0, 
+				     tok->tok.epaddr_from, ptl_rts_is_sender,
+				     (uintptr_t) args[1].u64w0);
+    if (rreq != NULL)
+	psmi_mq_req_free(rreq);
+
+    rarg[0].u64w0 = args[1].u64w0; /* sreq */
+    rarg[1].u32w0 = rreq != NULL;
+    psmi_amsh_short_reply(tok, mq_handler_rtscancel_ack_hidx, rarg, 2, 
+			  NULL, 0, 0);
+}
+
+void
+psmi_am_mq_handler_rtscancel_ack(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len)
+{
+    psm_mq_req_t sreq = (psm_mq_req_t) (uintptr_t) args[0].u64w0;
+    psmi_assert(narg == 2);
+    _IPATH_VDBG("[rndv][cancel] req=%p cancelled=%d\n", sreq, args[1].u32w0);
+    psmi_mq_handle_send_cancel(sreq, args[1].u32w0);
+}
+
 void
 psmi_am_handler(void *toki, psm_amarg_t *args, int narg, void *buf, size_t len)
 {
@@ -202,6 +202,7 @@ struct ips_pend_sreq {
 #define IPS_PENDSEND_EAGER_REQ	2
 #define IPS_PENDSEND_EXP_TIDS	3
 #define IPS_PENDSEND_EXP_SENDS	4
+#define IPS_PENDSEND_CANCEL_ACK	5
 
 STAILQ_HEAD(ips_pendsendq, ips_pend_sreq);
 
@@ -610,8 +611,13 @@ psm_error_t ips_proto_mq_push_eager_req(struct ips_proto *proto,
 					psm_mq_req_t req);
 psm_error_t ips_proto_mq_push_eager_data(struct ips_proto *proto, 
 					 psm_mq_req_t req);
+psm_error_t ips_proto_mq_push_cancel_ack(struct ips_proto *proto, 
+					 psm_mq_req_t req);
 
 int ips_proto_mq_handle_cts(struct ips_proto *proto, ptl_arg_t *args);
+int ips_proto_mq_handle_rts_cancel(psm_mq_t mq, struct ptl_epaddr *ipsaddr,
+				   uint64_t tag, uint32_t reqidx_peer);
+int ips_proto_mq_handle_cancel_ack(struct ips_proto *proto, ptl_arg_t *args);
 
 int ips_proto_mq_handle_rts_envelope(psm_mq_t mq, int mode, struct ptl_epaddr *ipsaddr, 
 				     uint64_t tag, uint32_t reqidx_peer, 
@@ -625,6 +631,11 @@ psm_error_t ips_proto_mq_isend(struct ptl *ptl, psm_mq_t mq, psm_epaddr_t epaddr
 			       uint32_t flags, uint64_t tag, const void *ubuf, 
 			       uint32_t len, void *context, psm_mq_req_t *req_o);
 
+psm_error_t ips_proto_mq_cancel(struct ptl *ptl, psm_mq_req_t req);
+psm_error_t ips_proto_mq_send_batch(struct ptl *ptl, psm_epaddr_t epaddr,
+				    const void *buf, uint32_t len, 
+				    uint32_t *nsent);
+
 int ips_proto_am(const struct ips_recvhdrq_event *rcv_ev);
 
 /* IBTA feature related functions (path record, sl2vl etc.) */
@@ -527,6 +527,22 @@ ips_proto_is_expected_or_nak(struct ips_recvhdrq_event *rcv_ev))
     }
 }
 
+/* The MQ had no room for an unexpected eager message (max_sysbuf_bytes).
+ * Undo ips_proto_is_expected_or_nak as if the packet had never arrived, so
+ * the sender holds on to it and retransmits it in order.  Marking the NAK as
+ * sent without sending one lets the rest of the window drop quietly; the
+ * sender's next err_chk gets the NAK, which paces retries while the receiver
+ * stays over budget.
+ */
+PSMI_ALWAYS_INLINE(
+void
+ips_proto_refuse_expected(struct ips_flow *flow))
+{
+    flow->recv_seq_num.val = (flow->recv_seq_num.val - 1) & LOWER_24_BITS;
+    flow->last_seq_num.val = flow->recv_seq_num.val;
+    flow->flags |= IPS_FLOW_FLAG_NAK_SEND;
+}
+
 #if IPS_TINY_PROCESS_MQTINY
 PSMI_ALWAYS_INLINE(
 int 
@@ -536,11 +552,15 @@ ips_proto_process_mq_tiny(const struct ips_recvhdrq_event *rcv_ev))
   struct ips_message_header *p_hdr = rcv_ev->p_hdr;
   
   if (ips_proto_is_expected_or_nak((struct ips_recvhdrq_event*) rcv_ev)) {
-    psmi_mq_handle_tiny_envelope(
+    if_pf (psmi_mq_handle_tiny_envelope(
 				 ipsaddr->proto->mq,
 				 ipsaddr->epaddr, p_hdr->data[0].u64, /* tag */
 				 (void *) &p_hdr->data[1], 
-				 (uint32_t) p_hdr->hdr_dlen);
+				 (uint32_t) p_hdr->hdr_dlen) 
+	   == MQ_RET_UNEXP_NO_RESOURCES) {
+      ips_proto_refuse_expected(&ipsaddr->flows[ips_proto_flowid(p_hdr)]);
+      return IPS_RECVHDRQ_CONTINUE;
+    }
     
     if (p_hdr->flags & IPS_SEND_FLAG_ACK_REQ)
       ips_proto_send_ack((struct ips_recvhdrq *) rcv_ev->recvq, 
@@ -90,7 +90,7 @@ ips_proto_mq_eager_complete(void *reqp)
     psm_mq_req_t req = (psm_mq_req_t)reqp;
     
     req->state = MQ_STATE_COMPLETE;
-    mq_qq_append(&req->mq->completed_q, req);
+    mq_complete_append(req->mq, req);
     return IPS_RECVHDRQ_CONTINUE;
 }
 
@@ -325,6 +325,82 @@ fail:
     return err; 
 }
 
+/* Ask the receiver to drop the RTS of a rendezvous send, the answer comes
+ * back as MQ_MSG_RTS_CANCEL_ACK */
+psm_error_t
+ips_proto_mq_cancel(ptl_t *ptl, psm_mq_req_t req)
+{
+    ips_epaddr_t *ipsaddr = req->rts_peer->ptladdr;
+    struct ips_proto *proto = ipsaddr->proto;
+    ips_scb_t *scb;
+
+    scb = mq_alloc_tiny(proto);
+    ips_scb_epaddr(scb) = ipsaddr;
+    ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
+    ips_scb_mqhdr(scb) = MQ_MSG_RTS_CANCEL;
+    ips_scb_flags(scb) |= IPS_SEND_FLAG_ACK_REQ;
+    ips_scb_uwords(scb)[0].u64   = req->tag;
+    ips_scb_uwords(scb)[1].u32w0 = psmi_mpool_get_obj_index(req);
+
+    return ips_mq_send_envelope(ptl, proto, ipsaddr, scb, PSMI_TRUE);
+}
+
+/* Send the records of an aggregated batch as short eager packets, cut at
+ * record boundaries when the batch is larger than a pio packet.  On error,
+ * *nsent counts the bytes of the packets that did go out. */
+psm_error_t
+ips_proto_mq_send_batch(ptl_t *ptl, psm_epaddr_t epaddr, const void *ubuf, 
+			uint32_t len, uint32_t *nsent)
+{
+    const uint8_t *buf = (const uint8_t *) ubuf;
+    ips_epaddr_t *ipsaddr = epaddr->ptladdr;
+    struct ips_proto *proto = ipsaddr->proto;
+    uint32_t cksum_len = (proto->flags & IPS_PROTO_FLAG_CKSUM) ? 
+	PSM_CRC_SIZE_IN_BYTES : 0;
+    uint32_t pad_write_bytes, pktlen, reclen;
+    psm_error_t err = PSM_OK;
+    ips_scb_t *scb;
+
+    *nsent = 0;
+    while (len > 0) {
+	pktlen = 0;
+	do {
+	    reclen = MQ_BATCH_RECLEN(
+		((const struct mq_batch_rec *) (buf + pktlen))->len);
+	    if (pktlen > 0 && pktlen + reclen > ipsaddr->epr.epr_piosize)
+		break;
+	    pktlen += reclen;
+	} while (pktlen < len);
+
+	pad_write_bytes = ((PSM_CACHE_LINE_BYTES - 
+			    ((pktlen + cksum_len) & (PSM_CACHE_LINE_BYTES-1))) & 
+			   (PSM_CACHE_LINE_BYTES-1));
+        if_pf ((pad_write_bytes + pktlen) > ipsaddr->epr.epr_piosize)
+	  pad_write_bytes = 0;
+
+	scb = mq_alloc_pkts(proto, 1, (pktlen + pad_write_bytes),
+			    IPS_SCB_FLAG_ADD_BUFFER);
+	ips_scb_epaddr(scb) = ipsaddr;
+	ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
+	ips_scb_hdr_dlen(scb) = pad_write_bytes;
+	ips_scb_length(scb) = pktlen + pad_write_bytes;
+	ips_scb_mqhdr(scb) = MQ_MSG_BATCH;
+	ips_scb_mqtag(scb) = 0;
+
+	ips_shortcpy (ips_scb_buffer(scb), buf, pktlen);
+	err = ips_mq_send_envelope(ptl, proto, ipsaddr, scb, PSMI_TRUE);
+	if (err != PSM_OK)
+	    break;
+        _IPATH_VDBG("[batch][%s->%s][m=%d]\n", 
+	    psmi_epaddr_get_name(proto->ep->epid), 
+	    psmi_epaddr_get_name(epaddr->epid), pktlen);
+	buf += pktlen;
+	len -= pktlen;
+	*nsent += pktlen;
+    }
+    return err;
+}
+
 psm_error_t __sendpath
 ips_proto_mq_isend(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags, 
 	     uint64_t tag, const void *ubuf, uint32_t len, void *context,
@@ -357,7 +433,7 @@ ips_proto_mq_isend(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags,
 	/* We can mark this op complete since all the data is now copied
 	 * into an SCB that remains live until it is remotely acked */
 	req->state = MQ_STATE_COMPLETE;
-	mq_qq_append(&mq->completed_q, req);
+	mq_complete_append(mq, req);
         _IPATH_VDBG("[itiny][%s->%s][b=%p][m=%d][t=%"PRIx64"][req=%p]\n", 
 	    psmi_epaddr_get_name(mq->ep->epid), 
 	    psmi_epaddr_get_name(epaddr->epid), buf, len, tag, req);
@@ -393,7 +469,7 @@ ips_proto_mq_isend(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags,
 	ips_shortcpy (ips_scb_buffer(scb), buf, len);
 	err = ips_mq_send_envelope(ptl, proto, ipsaddr, scb, PSMI_TRUE);
 	req->state = MQ_STATE_COMPLETE;
-	mq_qq_append(&mq->completed_q, req);
+	mq_complete_append(mq, req);
         _IPATH_VDBG("[ishrt][%s->%s][b=%p][m=%d][t=%"PRIx64"][req=%p]\n", 
 	    psmi_epaddr_get_name(mq->ep->epid), 
 	    psmi_epaddr_get_name(epaddr->epid), buf, len, tag, req);
@@ -778,6 +854,88 @@ ips_proto_mq_handle_cts(struct ips_proto *proto, ptl_arg_t *args)
     return IPS_RECVHDRQ_CONTINUE;
 }
 
+/* The answer travels on a receive request: the dropped RTS, or a stand-in
+ * when the RTS has already been matched */
+psm_error_t
+ips_proto_mq_push_cancel_ack(struct ips_proto *proto, psm_mq_req_t req)
+{
+    ips_scb_t *scb;
+    ptl_arg_t *args;
+    ips_epaddr_t *ipsaddr;
+    struct ips_flow *flow;
+
+    scb = ips_scbctrl_alloc(&proto->scbc_egr, 1, 0, 0);
+    if (scb == NULL)
+	return PSM_OK_NO_PROGRESS;
+
+    args = (ptl_arg_t *) ips_scb_uwords(scb);
+    args[0].u32w0 = req->rts_reqidx_peer;
+    args[0].u32w1 = (req->error_code == PSM_OK);
+
+    ipsaddr = req->rts_peer->ptladdr;
+    flow = &ipsaddr->flows[EP_FLOW_GO_BACK_N_PIO];
+    ips_scb_epaddr(scb) = ipsaddr;
+    ips_scb_subopcode(scb) = OPCODE_SEQ_MQ_CTRL;
+    ips_scb_mqhdr (scb) = MQ_MSG_RTS_CANCEL_ACK;
+
+    flow->fn.xfer.enqueue(flow, scb);
+    flow->fn.xfer.flush(flow, NULL);
+
+    psmi_mq_req_free(req);
+    return PSM_OK;
+}
+
+static
+int
+ips_proto_mq_rts_is_sender(psm_mq_req_t req, uintptr_t reqidx_peer)
+{
+    return req->rts_reqidx_peer == (uint32_t) reqidx_peer;
+}
+
+int __recvpath
+ips_proto_mq_handle_rts_cancel(psm_mq_t mq, ips_epaddr_t *ipsaddr, 
+			       uint64_t tag, uint32_t reqidx_peer)
+{
+    struct ips_proto *proto = ipsaddr->proto;
+    struct ips_pend_sreq *sreq;
+    psm_mq_req_t req;
+
+    req = psmi_mq_handle_rts_cancel(mq, tag, ipsaddr->epaddr, 
+				    ips_proto_mq_rts_is_sender, reqidx_peer);
+    if (req != NULL)
+	req->error_code = PSM_OK;
+    else {
+	req = psmi_mq_req_alloc(mq, MQE_TYPE_RECV);
+	psmi_assert_always(req != NULL);
+	req->rts_peer = ipsaddr->epaddr;
+	req->rts_reqidx_peer = reqidx_peer;
+	req->error_code = PSM_MQ_NO_COMPLETIONS;
+    }
+
+    sreq = psmi_mpool_get(proto->pend_sends_pool);
+    psmi_assert(sreq != NULL);
+    sreq->type = IPS_PENDSEND_CANCEL_ACK;
+    sreq->req  = req;
+    STAILQ_INSERT_TAIL(&proto->pend_sends.pendq, sreq, next);
+    psmi_timer_request(proto->timerq, &proto->pend_sends.timer, 
+		       PSMI_TIMER_PRIO_1);
+
+    return IPS_RECVHDRQ_CONTINUE;
+}
+
+int __recvpath
+ips_proto_mq_handle_cancel_ack(struct ips_proto *proto, ptl_arg_t *args)
+{
+    psm_mq_t mq = proto->ep->mq;
+    psm_mq_req_t req;
+
+    req = psmi_mpool_find_obj_by_index(mq->sreq_pool, args[0].u32w0);
+    psmi_assert_always(req != NULL);
+    psmi_mq_handle_send_cancel(req, args[0].u32w1);
+
+    return IPS_RECVHDRQ_CONTINUE;
+}
+
 int __recvpath
 ips_proto_mq_handle_rts_envelope(psm_mq_t mq, int mode, ips_epaddr_t *ipsaddr, 
 				 uint64_t tag, uint32_t reqidx_peer, 
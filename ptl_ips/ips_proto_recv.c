@@ -170,6 +170,9 @@ ips_proto_timer_pendq_callback(struct psmi_timer *timer, uint64_t current)
 	    case IPS_PENDSEND_EAGER_DATA:
 		err = ips_proto_mq_push_eager_data(proto, sreq->req);
 		break;
+	    case IPS_PENDSEND_CANCEL_ACK:
+		err = ips_proto_mq_push_cancel_ack(proto, sreq->req);
+		break;
 
 	    default:
 		psmi_handle_error(PSMI_EP_NORETURN, PSM_INTERNAL_ERR,
@@ -234,9 +237,14 @@ _process_mq(struct ips_recvhdrq_event *rcv_ev)
 		egrid.egr_data = 0; 
 	}
 
-	psmi_mq_handle_envelope(
-	    mq, mode, ipsaddr->epaddr, p_hdr->data[0].u64, /* tag */
-	    egrid, msglen, (void *) payload, paylen);
+	if_pf (psmi_mq_handle_envelope(
+		mq, mode, ipsaddr->epaddr, p_hdr->data[0].u64, /* tag */
+		egrid, msglen, (void *) payload, paylen) 
+	       == MQ_RET_UNEXP_NO_RESOURCES) {
+	    /* No room for it, leave it with the sender */
+	    ips_proto_refuse_expected(flow);
+	    goto skip_ack_req;
+	}
     }
     else {
 
@@ -307,6 +315,28 @@ _process_mq(struct ips_recvhdrq_event *rcv_ev)
 		ips_proto_mq_handle_cts(rcv_ev->proto, args);
 		break;
 
+	    case MQ_MSG_RTS_CANCEL:
+		args = (ptl_arg_t *) p_hdr->data;
+		ips_proto_mq_handle_rts_cancel(mq, ipsaddr, args[0].u64, 
+					       args[1].u32w0);
+		break;
+
+	    case MQ_MSG_RTS_CANCEL_ACK:
+		args = p_hdr->data;
+		ips_proto_mq_handle_cancel_ack(rcv_ev->proto, args);
+		break;
+
+	    case MQ_MSG_BATCH:
+		/* Padded like MQ_MSG_SHORT */
+		paylen -= p_hdr->hdr_dlen;
+		if_pf (psmi_mq_handle_batch(mq, ipsaddr->epaddr, payload, 
+					    paylen) 
+		       == MQ_RET_UNEXP_NO_RESOURCES) {
+		    ips_proto_refuse_expected(flow);
+		    goto skip_ack_req;
+		}
+		break;
+
 	    default:
 		break;
 	}
@@ -232,6 +232,8 @@ ips_ptl_init(const psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
     ctl->ep_disconnect = ips_ptl_disconnect;
     ctl->mq_send       = ips_proto_mq_send;
     ctl->mq_isend      = ips_proto_mq_isend;
+    ctl->mq_cancel     = ips_proto_mq_cancel;
+    ctl->mq_send_batch = ips_proto_mq_send_batch;
 
     ctl->am_short_request = ips_am_short_request;
     ctl->am_short_reply   = ips_am_short_reply;
@@ -112,6 +112,31 @@ self_mq_send_testwait(psm_mq_req_t *ireq, int istest, psm_mq_status_t *status)
     return PSM_OK;
 }
 
+static
+int
+self_rts_is_sender(psm_mq_req_t recv_req, uintptr_t send_req)
+{
+    return recv_req->ptl_req_ptr == (void *) send_req;
+}
+
+/* The receive side is local, so cancelling is answered right away */
+static
+psm_error_t
+self_mq_cancel(ptl_t *ptl, psm_mq_req_t send_req)
+{
+    psm_mq_req_t recv_req;
+
+    recv_req = psmi_mq_handle_rts_cancel(send_req->mq, send_req->tag, 
+					 send_req->rts_peer, self_rts_is_sender,
+					 (uintptr_t) send_req);
+    if (recv_req != NULL) {
+	psmi_mq_req_free(recv_req);
+	send_req->testwait_callback = NULL;
+    }
+    psmi_mq_handle_send_cancel(send_req, recv_req != NULL);
+    return PSM_OK;
+}
+
 /* Self is different.  We do everything as rendezvous. */
 static
 psm_error_t __fastpath
@@ -132,6 +157,8 @@ self_mq_isend(ptl_t *ptl, psm_mq_t mq, psm_epaddr_t epaddr, uint32_t flags,
     send_req->buf = (void *) ubuf;
     send_req->send_msglen = len;
     send_req->context = context;
+    send_req->tag = tag;
+    send_req->rts_peer = epaddr;
     recv_req->ptl_req_ptr = (void *) send_req;
     if (rc == MQ_RET_MATCH_OK) 
 	ptl_handle_rtsmatch(recv_req, 1);
@@ -256,6 +283,7 @@ self_ptl_init(const psm_ep_t ep, ptl_t *ptl, ptl_ctl_t *ctl)
 
     ctl->mq_send  = self_mq_send;
     ctl->mq_isend = self_mq_isend;
+    ctl->mq_cancel = self_mq_cancel;
 
     /* No stats in self */
     ctl->epaddr_stats_num  = NULL;